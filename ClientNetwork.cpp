@@ -18,11 +18,45 @@
 	passed to the QueryFilter message queue for processing.  Other
 	threads will later call our member function ForwardUDPReply to
 	send the response back to the client.
+
+	When configured for more than one client thread, each instance
+	binds its own set of sockets using SO_REUSEPORT so the kernel
+	spreads the client flows across all of them.  Every ProxyEntry
+	remembers the instance that received the query in netowner, and
+	replies are always sent back through that same instance and socket.
+
+	In wildcard mode we skip the interface enumeration and bind a
+	single socket for each protocol to the any address.  The address
+	each UDP query was sent to is recovered with IP_PKTINFO so the
+	reply goes out from that same address, and the NetFilter
+	exclusions are applied to each query instead of at bind time.
+	Otherwise when WatchAddresses is enabled a netlink socket tells us
+	when addresses are added or removed, and the listeners for those
+	addresses are opened or closed while the epoll loop keeps running.
+
+	With edge triggered epoll each UDP socket is read until it is
+	empty, but only up to a fairness limit so one busy socket can't
+	starve the others.  When an XDP interface is configured the first
+	instance also owns an XdpSocket that receives queries directly from
+	the driver and sends the replies back out on the XDP transmit ring.
+
+	Each TCP session has its own read buffer so clients can pipeline
+	as many queries as they like, and each reply is sent as soon as it
+	is ready regardless of the order the queries arrived.  Idle
+	sessions are expired with a TimerWheel.  The DNS over TLS and HTTPS
+	listeners share the same session handling, with the reads and
+	writes going through the TlsEngine and a DohSession on each HTTPS
+	connection turning the HTTP/2 frames into queries.
 */
 
 /*--------------------------------------------------------------------------*/
-ClientNetwork::ClientNetwork(void)
+ClientNetwork::ClientNetwork(int argIndex)
 {
+int		x;
+
+// save our index in the array of client network threads
+ThreadNumber = argIndex;
+
 // clear the network array and count
 memset(&IPv4list,0,sizeof(IPv4list));
 IPv4tot = 0;
@@ -30,11 +64,59 @@ IPv4tot = 0;
 memset(netface,0,sizeof(netface));
 
 memset(tcplisten,0,sizeof(tcplisten));
+memset(tlslisten,0,sizeof(tlslisten));
+memset(dohlisten,0,sizeof(dohlisten));
 memset(udplisten,0,sizeof(udplisten));
 tcpactive = NULL;
 pollsock = 0;
 tcpcount = 0;
 running = 1;
+
+// allocate the table used to find the session for each TCP reply
+tcptable = (netportal **)calloc(cfg_SessionLimit,sizeof(netportal *));
+tcpserial = 0;
+
+// allocate all of the session objects up front and put them in the
+// pool with each one permanently assigned to its own table slot
+tcpslab = (netportal *)calloc(cfg_SessionLimit,sizeof(netportal));
+tcppool = NULL;
+
+	for(x = (cfg_SessionLimit - 1);x >= 0;x--)
+	{
+	tcpslab[x].session = x;
+	tcpslab[x].next = tcppool;
+	tcppool = &tcpslab[x];
+	}
+
+// the sessions from each source address are chained in a hash table
+// so we can count them without walking every session
+for(tcpbuckets = 1;tcpbuckets < (unsigned int)cfg_SessionLimit;tcpbuckets<<=1);
+tcpsource = (netportal **)calloc(tcpbuckets,sizeof(netportal *));
+tcpoldest = NULL;
+tcparmed = EPOLLIN;
+
+// the timer wheel used to expire idle TCP sessions
+tcpwheel = new TimerWheel(WHEELTICK);
+
+memset(udpbatch,0,sizeof(udpbatch));
+udpcount = 0;
+uring = NULL;
+
+memset(&xdpportal,0,sizeof(xdpportal));
+xdp = NULL;
+
+memset(&linkportal,0,sizeof(linkportal));
+
+memset(readylist,0,sizeof(readylist));
+readycount = 0;
+lastbusy = 0;
+spincount = 0;
+
+batchmsg = NULL;
+batchvec = NULL;
+batchaddr = NULL;
+batchbuffer = NULL;
+batchctrl = NULL;
 }
 /*--------------------------------------------------------------------------*/
 ClientNetwork::~ClientNetwork(void)
@@ -44,40 +126,49 @@ ClientNetwork::~ClientNetwork(void)
 void* ClientNetwork::ThreadWorker(void)
 {
 epoll_event		*trigger;
-netportal		*local;
-time_t			lasttime,current;
+cpu_set_t		cpuset;
 int				iftot,evtot;
+int				timeout;
 int				check;
 int				ret;
 int				x;
 
-// build the list of interfaces and open all the sockets
+	// when steering queries by core pin each thread to its own CPU
+	if (g_steer != NULL)
+	{
+	CPU_ZERO(&cpuset);
+	CPU_SET((ThreadNumber % sysconf(_SC_NPROCESSORS_ONLN)),&cpuset);
+	ret = pthread_setaffinity_np(pthread_self(),sizeof(cpuset),&cpuset);
+	if (ret != 0) g_log->LogMessage(LOG_WARNING,"Error %d returned from pthread_setaffinity_np(client)\n",ret);
+	}
+
+// start watching for address changes before we build the list of
+// interfaces so nothing is missed and then open all the sockets
+WatchInterfaces();
 EnumerateInterfaces();
 iftot = SocketStartup();
 
-	// not bound to any interfaces so clear running flag and return
-	if (iftot == 0)
+	// not bound to any interfaces and not waiting for any to be added
+	// or the startup failed so clear running flag and return
+	if ((iftot < 0) || ((iftot == 0) && (linkportal.sock <= 0)))
 	{
+	for(x = 0;x < cfg_SessionLimit;x++) free(tcpslab[x].inbuffer);
+	free(tcpslab);
+	free(tcpsource);
+	free(tcptable);
+	delete(tcpwheel);
 	running = 0;
 	return(NULL);
 	}
 
 // allocate a chunk of memory to hold events returned from epoll_wait
-evtot = ((iftot * 2) + cfg_SessionLimit);
+evtot = ((iftot * 4) + cfg_SessionLimit);
 trigger = (epoll_event *)calloc(evtot,sizeof(struct epoll_event));
 
-lasttime = time(NULL);
-
 	for(;;)
 	{
-	current = time(NULL);
-
-		// every second we clean the TCP session table
-		if (current > lasttime)
-		{
-		SessionCleanup();
-		lasttime = current;
-		}
+	// expire any TCP sessions that have been idle too long
+	SessionCleanup();
 
 	// watch the thread signal for termination
 	check = 0;
@@ -85,9 +176,30 @@ lasttime = time(NULL);
 	if (ret != 0) break;
 	if (check != 0) break;
 
+	// use a short timeout while replies are waiting to be sent
+	timeout = 1000;
+	for(x = 0;x < udpcount;x++) if ((udpbatch[x] != NULL) && (udpbatch[x]->PendingCount() != 0)) timeout = cfg_SendDelay;
+	if ((xdp != NULL) && (xdp->PendingCount() != 0)) timeout = cfg_SendDelay;
+
+	// don't wait at all when sockets are known to have data waiting
+	if (readycount != 0) timeout = 0;
+
+	// in busy poll mode keep spinning until we have been idle a while
+	if ((cfg_BusyPoll != 0) && (timeout != 0)) timeout = BusyTimeout(timeout);
+
+		// when using io_uring the ring does all of the waiting
+		if (uring != NULL)
+		{
+		ret = ProcessUringEvents(trigger,evtot,timeout);
+		if (ret > 0) lastbusy = TimerWheel::NowMilliseconds();
+		ProcessReadyList();
+		FlushReplies(cfg_SendDelay);
+		if (ret < 0) break;
+		continue;
+		}
+
 	// wait for one of the sockets to receive something
-	ret = epoll_wait(pollsock,trigger,evtot,1000);
-	if (ret == 0) continue;
+	ret = epoll_wait(pollsock,trigger,evtot,timeout);
 
 	// ignore interrupted system call errors
 	if ((ret < 0) && (errno == EINTR)) continue;
@@ -99,45 +211,232 @@ lasttime = time(NULL);
 		break;
 		}
 
-		// process all the events that were returned
-		for(x = 0;x < ret;x++)
-		{
-		// get pointer to the netportal object from the epoll event
-		local = (netportal *)trigger[x].data.ptr;
+	// process all the events that were returned and then give
+	// any sockets that hit the drain limit another turn
+	if (ret > 0) ProcessEpollEvents(trigger,ret);
+	if (ret > 0) lastbusy = TimerWheel::NowMilliseconds();
+	ProcessReadyList();
 
-		// use process and continue here because for a TCP event
-		// the netportal object may be deleted while processing
-		if (local->proto == IPPROTO_RAW) { ProcessTCPConnect(local); continue; }
-		if (local->proto == IPPROTO_TCP) { ProcessTCPQuery(local); continue; }
-		if (local->proto == IPPROTO_UDP) { ProcessUDPQuery(local); continue; }
-		}
+	// send any replies that have been waiting too long
+	FlushReplies(cfg_SendDelay);
 	}
 
 // force cleanup any active TCP sessions
 SessionCleanup(TRUE);
+g_busyspins+=spincount;
 
 // cleanup and return
 free(trigger);
 SocketDestroy();
+
+// the destructor runs before the thread is stopped so anything the
+// thread uses has to be released here instead
+for(x = 0;x < cfg_SessionLimit;x++) free(tcpslab[x].inbuffer);
+free(tcpslab);
+free(tcpsource);
+free(tcptable);
+delete(tcpwheel);
+
 running = 0;
 
 return(NULL);
 }
 /*--------------------------------------------------------------------------*/
+void ClientNetwork::ProcessEpollEvents(epoll_event *argList,int argCount)
+{
+netportal		*local;
+int				x;
+
+	for(x = 0;x < argCount;x++)
+	{
+	// get pointer to the netportal object from the epoll event
+	local = (netportal *)argList[x].data.ptr;
+
+	// the netlink socket tells us about interface address changes
+	if (local == &linkportal) { ProcessNetlink(); continue; }
+
+	// with edge triggered epoll the UDP sockets must be drained
+	if ((cfg_EdgeTrigger != 0) && (local->proto == IPPROTO_UDP)) { DrainUDPSocket(local); continue; }
+
+	// the XDP socket has its own receive logic
+	if (local == &xdpportal) { ProcessXDPQuery(BATCHLIMIT); continue; }
+
+	// use process and continue here because for a TCP event
+	// the netportal object may be deleted while processing
+	if (local->proto == IPPROTO_RAW) { ProcessTCPConnect(local); continue; }
+
+		// the session is written first since reading may delete it
+		if (local->proto == IPPROTO_TCP)
+		{
+		if (argList[x].events & EPOLLOUT) ProcessTCPWrite(local);
+		if (argList[x].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ProcessTCPQuery(local);
+		continue;
+		}
+
+	if (local->proto == IPPROTO_UDP) { ProcessUDPQuery(local); continue; }
+	}
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessUringEvents(epoll_event *argList,int argCount,int argTimeout)
+{
+MessageFrame			*list[BATCHLIMIT];
+unsigned long long		data;
+struct msghdr			control;
+ProxyEntry				*local;
+netportal				*portal;
+unsigned				flags;
+char					*buffer;
+int						count,size;
+int						events;
+int						result;
+int						ret;
+
+// submit any pending requests and wait for completions
+ret = uring->WaitEvents(argTimeout);
+
+	if (ret < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from io_uring_enter(client)\n",errno);
+	return(-1);
+	}
+
+count = events = 0;
+
+	while (uring->GrabEvent(data,result,flags) != 0)
+	{
+	events++;
+
+		// a zero tag is the poll on our epoll descriptor which holds all
+		// of the TCP sockets so we grab and process those events and then
+		// arm the poll again for the next time
+		if (data == 0)
+		{
+		ret = epoll_wait(pollsock,argList,argCount,0);
+		if (ret > 0) ProcessEpollEvents(argList,ret);
+		uring->ArmPoll(pollsock,0);
+		continue;
+		}
+
+	// nothing to do when a cancel request completes
+	if (data == URINGCANCEL) continue;
+
+	// anything else is a multishot receive on one of our UDP sockets
+	portal = (netportal *)data;
+	size = uring->ExtractMessage(result,flags,&portal->addr,&buffer,&control);
+
+		if (size >= 0)
+		{
+		if (cfg_Wildcard != 0) portal->ifaddr = ExtractTarget(&control);
+		check_dropcount(portal,&control,g_clientdrops);
+		g_recvpackets++;
+		local = InsertUDPQuery(portal,buffer,size);
+		if (local != NULL) list[count++] = new ProxyMessage(local->mygrid,local->myslot);
+		}
+
+	// give the buffer back to the kernel as soon as we're done with it
+	uring->RecycleBuffer(flags);
+
+		// hand the batch to the query filter when the list is full
+		if (count == BATCHLIMIT)
+		{
+		g_qfilter->PushBatch(list,count);
+		count = 0;
+		}
+
+	// the multishot receive must be armed again when it terminates
+	// which usually happens when the kernel runs out of buffers
+	// unless it was cancelled because the interface went away
+	if (uring->CheckMultishot(flags) != 0) continue;
+	if (result == -ECANCELED) continue;
+	if ((result < 0) && (result != -ENOBUFS)) g_log->LogMessage(LOG_WARNING,"Error %d returned from io_uring recvmsg(%s)\n",-result,netface[portal->ifidx]);
+	uring->ArmRecvMessage(portal->sock,(unsigned long)portal);
+	}
+
+// hand everything we received to the query filter queue
+g_qfilter->PushBatch(list,count);
+
+return(events);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::BusyTimeout(int argTimeout)
+{
+long long		current;
+
+current = TimerWheel::NowMilliseconds();
+
+	// still inside the idle period since the last traffic so we poll
+	// without blocking and let the kernel busy poll the device queue
+	if ((current - lastbusy) < cfg_BusyIdle)
+	{
+	spincount++;
+	return(0);
+	}
+
+	// the spinning just ended so count it and go back to blocking
+	if (spincount != 0)
+	{
+	g_busyspins+=spincount;
+	g_busysleeps++;
+	spincount = 0;
+	}
+
+return(argTimeout);
+}
+/*--------------------------------------------------------------------------*/
 void ClientNetwork::EnumerateInterfaces(void)
 {
+int		x;
+
+	// in wildcard mode we only need the any address
+	if (cfg_Wildcard != 0)
+	{
+	IPv4list[0] = htonl(INADDR_ANY);
+	strcpy(netface[0],"0.0.0.0");
+	IPv4tot = 1;
+	return;
+	}
+
+// save the address of each interface and the dotted quad string
+IPv4tot = ScanInterfaces(IPv4list,SOCKLIMIT);
+if (IPv4tot < 0) IPv4tot = 0;
+for(x = 0;x < IPv4tot;x++) inet_ntop(AF_INET,&IPv4list[x],netface[x],sizeof(netface[x]));
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::RefreshInterfaces(void)
+{
+unsigned int	list[SOCKLIMIT];
+int				count;
+int				x,y;
+
+// leave things alone if we can't get the current list
+count = ScanInterfaces(list,SOCKLIMIT);
+if (count < 0) return;
+
+	// remove the listeners for any addresses that are gone
+	for(x = 0;x < IPv4tot;x++)
+	{
+	if (netface[x][0] == 0) continue;
+	for(y = 0;y < count;y++) if (list[y] == IPv4list[x]) break;
+	if (y == count) RemoveInterface(IPv4list[x]);
+	}
+
+// add the new ones which skips any we already have
+for(y = 0;y < count;y++) InsertInterface(list[y]);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ScanInterfaces(unsigned int *argList,int argLimit)
+{
 struct sockaddr_in	*ptr;
 struct ifconf		info;
 struct ifreq		*ifr;
-unsigned int		special;
 char				*databuff;
 int					doff,len;
-int					skip,x;
-int					sock;
+int					sock,ret;
+int					total;
 
 // allocate buffer to hold the interface information
 databuff = (char *)calloc(1024,256);
-if (databuff == NULL) return;
+if (databuff == NULL) return(-1);
 
 // setup the interface request buffer
 memset(&info,0,sizeof(info));
@@ -146,13 +445,20 @@ info.ifc_len = (256 * 1024);
 
 // grab info about all the network interfaces
 sock = socket(PF_INET,SOCK_STREAM,0);
-ioctl(sock,SIOCGIFCONF,&info);
+ret = ioctl(sock,SIOCGIFCONF,&info);
 close(sock);
 
-doff = 0;
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from ioctl(SIOCGIFCONF)\n",errno);
+	free(databuff);
+	return(-1);
+	}
+
+doff = total = 0;
 
 	// walk through each entry in the buffer
-	while (doff < info.ifc_len)
+	while ((doff < info.ifc_len) && (total < argLimit))
 	{
 	ifr = (ifreq *)&databuff[doff];
 
@@ -175,516 +481,1994 @@ doff = 0;
 	if (ifr->ifr_ifru.ifru_addr.sa_family != AF_INET) continue;
 	ptr = (sockaddr_in *)&ifr->ifr_addr;
 	if (ptr->sin_addr.s_addr == 0) continue;
+	if (CheckNetFilter(ptr->sin_addr.s_addr) != 0) continue;
 
-	skip = 0;
+	// save the address in the list
+	argList[total++] = ptr->sin_addr.s_addr;
+	}
 
-		for(x = 0;x < cfg_NetFilterCount;x++)
-		{
-		special = (ptr->sin_addr.s_addr & cfg_NetFilterMask[x]);
-		if (special == cfg_NetFilterAddr[x]) skip++;
-		}
+free(databuff);
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::WatchInterfaces(void)
+{
+struct sockaddr_nl	addr;
+int					ret;
 
-	if (skip != 0) continue;
+// the wildcard socket already receives on every address
+if (cfg_WatchAddresses == 0) return;
+if (cfg_Wildcard != 0) return;
 
-	// save the address in our list
-	IPv4list[IPv4tot] = ptr->sin_addr.s_addr;
+linkportal.sock = socket(AF_NETLINK,SOCK_RAW,NETLINK_ROUTE);
 
-	// save the interface address dotted quad string
-	inet_ntop(AF_INET,&ptr->sin_addr,netface[IPv4tot],sizeof(netface[IPv4tot]));
-	IPv4tot++;
+	if (linkportal.sock == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from socket(netlink)\n",errno);
+	linkportal.sock = 0;
+	return;
 	}
 
-free(databuff);
+// set socket to nonblocking mode
+fcntl(linkportal.sock,F_SETFL,O_NONBLOCK);
+
+// join the group that announces IPv4 address changes
+memset(&addr,0,sizeof(addr));
+addr.nl_family = AF_NETLINK;
+addr.nl_groups = RTMGRP_IPV4_IFADDR;
+ret = bind(linkportal.sock,(struct sockaddr *)&addr,sizeof(addr));
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bind(netlink)\n",errno);
+	close(linkportal.sock);
+	linkportal.sock = 0;
+	return;
+	}
 }
 /*--------------------------------------------------------------------------*/
-int ClientNetwork::SocketStartup(void)
+int ClientNetwork::ProcessNetlink(void)
 {
-struct sockaddr_in		addr;
-struct epoll_event		evt;
-int						val,ret;
-int						total;
-int						x;
+struct ifaddrmsg	*info;
+struct nlmsghdr		*head;
+struct rtattr		*attr;
+unsigned int		local,remote;
+int					size,len;
+int					overrun;
+int					total;
 
-total = 0;
+total = overrun = 0;
 
-	for(x = 0;x < IPv4tot;x++)
+	for(;;)
 	{
-	// open a socket for the interface
-	g_log->LogMessage(LOG_INFO,"ClientNetwork listening on %s:%d\n",netface[x],cfg_ServerPort);
-	tcplisten[total].ifidx = x;
-	tcplisten[total].proto = IPPROTO_RAW;
-	tcplisten[total].sock = socket(PF_INET,SOCK_STREAM,0);
+	size = recv(linkportal.sock,netbuffer,sizeof(netbuffer),0);
 
-		if (tcplisten[total].sock == -1)
+		if (size < 0)
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from socket(client)\n",errno);
-		return(0);
+		// ignore interrupted system call errors
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN) break;
+
+			// the kernel dropped some messages because we fell behind
+			// so once the socket is empty we compare the current
+			// addresses with the ones we are listening on
+			if (errno == ENOBUFS)
+			{
+			g_log->LogMessage(LOG_WARNING,"ClientNetwork %d netlink overrun so checking every address\n",ThreadNumber);
+			overrun = 1;
+			continue;
+			}
+
+		g_log->LogMessage(LOG_WARNING,"Error %d returned from recv(netlink)\n",errno);
+		break;
 		}
 
-	// allow binding even with old sockets in TIME_WAIT status
-	val = 1;
-	ret = setsockopt(tcplisten[total].sock,SOL_SOCKET,SO_REUSEADDR,(char *)&val,sizeof(val));
+	// anything still queued after an overrun is older than the
+	// addresses we are going to scan so we just throw it away
+	if (overrun != 0) continue;
 
-		if (ret == -1)
+		// walk through every message in the buffer
+		for(head = (struct nlmsghdr *)netbuffer;NLMSG_OK(head,size);head = NLMSG_NEXT(head,size))
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEADDR)\n",errno);
-		return(0);
+		if ((head->nlmsg_type != RTM_NEWADDR) && (head->nlmsg_type != RTM_DELADDR)) continue;
+		info = (struct ifaddrmsg *)NLMSG_DATA(head);
+		if (info->ifa_family != AF_INET) continue;
+
+		local = remote = 0;
+		len = IFA_PAYLOAD(head);
+
+			for(attr = IFA_RTA(info);RTA_OK(attr,len);attr = RTA_NEXT(attr,len))
+			{
+			if (attr->rta_type == IFA_LOCAL) memcpy(&local,RTA_DATA(attr),sizeof(local));
+			if (attr->rta_type == IFA_ADDRESS) memcpy(&remote,RTA_DATA(attr),sizeof(remote));
+			}
+
+		// on point to point links IFA_ADDRESS is the peer so we only
+		// use it when the local address is missing
+		if (local == 0) local = remote;
+		if (local == 0) continue;
+
+		if (head->nlmsg_type == RTM_NEWADDR) InsertInterface(local);
+		else RemoveInterface(local);
+		total++;
 		}
+	}
 
-	// set socket to nonblocking mode
-	ret = fcntl(tcplisten[total].sock,F_SETFL,O_NONBLOCK);
-
-		if (ret == -1)
-		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from fcntl(O_NONBLOCK)\n",errno);
-		return(0);
-		}
+if (overrun != 0) RefreshInterfaces();
 
-	// bind the socket to our server interface
-	memset(&addr,0,sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(cfg_ServerPort);
-	addr.sin_addr.s_addr = IPv4list[x];
-	ret = bind(tcplisten[total].sock,(struct sockaddr *)&addr,sizeof(addr));
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::CheckNetFilter(unsigned int argAddr)
+{
+unsigned int		special;
+int					x;
 
-		if (ret == -1)
-		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from bind(client)\n",errno);
-		return(0);
-		}
+	// returns non-zero if the address matches any of the exclusions
+	for(x = 0;x < cfg_NetFilterCount;x++)
+	{
+	special = (argAddr & cfg_NetFilterMask[x]);
+	if (special == cfg_NetFilterAddr[x]) return(1);
+	}
 
-	// listen for connections on the socket
-	ret = listen(tcplisten[total].sock,cfg_ListenBacklog);
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+unsigned int ClientNetwork::ExtractTarget(struct msghdr *argHeader)
+{
+struct in_pktinfo	*info;
+struct cmsghdr		*cmsg;
 
-		if (ret == -1)
-		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from listen(client)\n",errno);
-		return(0);
-		}
+	// find the IP_PKTINFO message with the address the packet was sent to
+	for(cmsg = CMSG_FIRSTHDR(argHeader);cmsg != NULL;cmsg = CMSG_NXTHDR(argHeader,cmsg))
+	{
+	if (cmsg->cmsg_level != IPPROTO_IP) continue;
+	if (cmsg->cmsg_type != IP_PKTINFO) continue;
+	info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+	return(info->ipi_addr.s_addr);
+	}
 
-	udplisten[total].ifidx = x;
-	udplisten[total].proto = IPPROTO_UDP;
-	udplisten[total].sock = socket(PF_INET,SOCK_DGRAM,0);
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::SocketStartup(void)
+{
+struct epoll_event		evt;
+int						ret;
+int						total;
+int						x;
 
-		if (udplisten[total].sock == -1)
+	// allocate the ring of buffers used for receiving datagrams in batches
+	if (cfg_RecvBatch > 1)
+	{
+	batchmsg = (struct mmsghdr *)calloc(cfg_RecvBatch,sizeof(struct mmsghdr));
+	batchvec = (struct iovec *)calloc(cfg_RecvBatch,sizeof(struct iovec));
+	batchaddr = (struct sockaddr_in *)calloc(cfg_RecvBatch,sizeof(struct sockaddr_in));
+	batchbuffer = (char *)malloc(cfg_RecvBatch * SOCKBUFFER);
+	batchctrl = (char *)calloc(cfg_RecvBatch,CTRLBUFFER);
+
+		// point each message header at its own buffer and address
+		for(x = 0;x < cfg_RecvBatch;x++)
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from socket(client)\n",errno);
-		return(0);
+		batchvec[x].iov_base = &batchbuffer[x * SOCKBUFFER];
+		batchvec[x].iov_len = SOCKBUFFER;
+		batchmsg[x].msg_hdr.msg_iov = &batchvec[x];
+		batchmsg[x].msg_hdr.msg_iovlen = 1;
+		batchmsg[x].msg_hdr.msg_name = &batchaddr[x];
+		batchmsg[x].msg_hdr.msg_control = &batchctrl[x * CTRLBUFFER];
 		}
+	}
 
-	// allow binding even with old sockets in TIME_WAIT status
-	val = 1;
-	ret = setsockopt(udplisten[total].sock,SOL_SOCKET,SO_REUSEADDR,(char *)&val,sizeof(val));
+g_log->LogMessage(LOG_DEBUG,"Setting up client %d epoll engine\n",ThreadNumber);
 
-		if (ret == -1)
-		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEADDR)\n",errno);
-		return(0);
-		}
+// allocate an epoll large enough to hold all interfaces
+pollsock = epoll_create((SOCKLIMIT * 2) + cfg_SessionLimit);
 
-	// set socket to nonblocking mode
-	ret = fcntl(udplisten[total].sock,F_SETFL,O_NONBLOCK);
+	if (pollsock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_create(client)\n",errno);
+	return(-1);
+	}
 
-		if (ret == -1)
+	// when configured we try to use io_uring and fall back to epoll
+	if (cfg_UringEngine != 0)
+	{
+	g_log->LogMessage(LOG_DEBUG,"Setting up client %d io_uring engine\n",ThreadNumber);
+	uring = new UringEngine();
+	ret = uring->Startup(cfg_UringBuffers,cfg_UringBuffers,DNSBUFFER);
+
+		if (ret == 0)
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from fcntl(O_NONBLOCK)\n",errno);
-		return(0);
+		g_log->LogMessage(LOG_WARNING,"Client %d unable to use io_uring so falling back to epoll\n",ThreadNumber);
+		delete(uring);
+		uring = NULL;
 		}
 
-	// bind the socket to our server interface
-	memset(&addr,0,sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(cfg_ServerPort);
-	addr.sin_addr.s_addr = inet_addr(netface[x]);
-	ret = bind(udplisten[total].sock,(struct sockaddr *)&addr,sizeof(addr));
+	// every buffer needs room for the drop count and on the wildcard
+	// socket the IP_PKTINFO with the address the query was sent to
+	if (uring != NULL) uring->EnableControl(CTRLBUFFER);
+	}
 
-		if (ret == -1)
-		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from bind(client)\n",errno);
-		return(0);
-		}
+total = 0;
 
-	// increment number of active interfaces
+	// open and bind the sockets for each interface
+	for(x = 0;x < IPv4tot;x++)
+	{
+	ret = BindInterface(x);
+	if (ret == 0) return(-1);
 	total++;
 	}
 
-g_log->LogMessage(LOG_DEBUG,"Setting up client epoll engine\n");
-
-// allocate an epoll large enough to hold all interfaces
-pollsock = epoll_create((total * 2) + cfg_SessionLimit);
+udpcount = IPv4tot;
 
-	if (pollsock < 0)
+	// the XDP program matches queries by our local addresses so with
+	// the wildcard socket it would take every UDP query on the port
+	if ((cfg_XdpInterface[0] != 0) && (cfg_Wildcard != 0) && (ThreadNumber == 0))
 	{
-	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_create(client)\n",errno);
-	return(0);
+	g_log->LogMessage(LOG_WARNING,"Client %d can't use AF_XDP with a wildcard socket so using normal sockets\n",ThreadNumber);
 	}
 
-	// add each TCP and UDP socket to the epoll
-	for(x = 0;x < total;x++)
+	// the first client thread owns the XDP socket when configured and
+	// if anything goes wrong we just use the normal sockets instead
+	if ((cfg_XdpInterface[0] != 0) && (cfg_Wildcard == 0) && (ThreadNumber == 0))
 	{
-	memset(&evt,0,sizeof(evt));
-	evt.data.ptr = &tcplisten[x];
-	evt.events = EPOLLIN;
-	ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,tcplisten[x].sock,&evt);
+	g_log->LogMessage(LOG_DEBUG,"Setting up client %d AF_XDP on %s\n",ThreadNumber,cfg_XdpInterface);
+	xdp = new XdpSocket();
+	ret = xdp->Startup(cfg_XdpInterface,cfg_XdpQueue,cfg_XdpFrames,cfg_XdpNative,cfg_SendBatch);
+	for(x = 0;(ret != 0) && (x < total);x++) ret = xdp->InsertAddress(IPv4list[x]);
 
 		if (ret != 0)
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from TCP epoll_ctl(client)\n",errno);
-		return(0);
+		xdpportal.proto = IPPROTO_UDP;
+		xdpportal.sock = xdp->GetSocket();
+		memset(&evt,0,sizeof(evt));
+		evt.data.ptr = &xdpportal;
+		evt.events = (cfg_EdgeTrigger != 0 ? EPOLLIN | EPOLLET : EPOLLIN);
+		ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,xdpportal.sock,&evt);
+		if (ret != 0) g_log->LogMessage(LOG_ERR,"Error %d returned from XDP epoll_ctl(client)\n",errno);
+		ret = (ret == 0 ? 1 : 0);
+		}
+
+		if (ret == 0)
+		{
+		g_log->LogMessage(LOG_WARNING,"Client %d unable to use AF_XDP on %s so using normal sockets\n",ThreadNumber,cfg_XdpInterface);
+		delete(xdp);
+		xdp = NULL;
 		}
+	}
 
+	// add the netlink socket so we hear about address changes
+	if (linkportal.sock > 0)
+	{
 	memset(&evt,0,sizeof(evt));
-	evt.data.ptr = &udplisten[x];
+	evt.data.ptr = &linkportal;
 	evt.events = EPOLLIN;
-	ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,udplisten[x].sock,&evt);
+	ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,linkportal.sock,&evt);
 
 		if (ret != 0)
 		{
-		g_log->LogMessage(LOG_ERR,"Error %d returned from UDP epoll_ctl(client)\n",errno);
-		return(0);
+		g_log->LogMessage(LOG_ERR,"Error %d returned from netlink epoll_ctl(client)\n",errno);
+		return(-1);
 		}
 	}
 
+// with io_uring the epoll holding the TCP sockets is polled by the ring
+if (uring != NULL) uring->ArmPoll(pollsock,0);
+
 return(total);
 }
 /*--------------------------------------------------------------------------*/
-void ClientNetwork::SocketDestroy(void)
+int ClientNetwork::OpenListener(netportal *argPortal,int argIndex,int argPort)
 {
-int		x;
+struct sockaddr_in		addr;
+struct epoll_event		evt;
+int						val,ret;
 
-// close the epoll descriptor
-g_log->LogMessage(LOG_DEBUG,"Shutting down client epoll engine\n");
-close(pollsock);
+// open a TCP listen socket for the interface
+argPortal->ifaddr = IPv4list[argIndex];
+argPortal->ifidx = argIndex;
+argPortal->proto = IPPROTO_RAW;
+argPortal->sock = socket(PF_INET,SOCK_STREAM,0);
 
-	// shutdown and close all our sockets
-	for(x = 0;x < IPv4tot;x++)
+	if (argPortal->sock == -1)
 	{
-	g_log->LogMessage(LOG_INFO,"Disconnecting ClientNetwork from %s:%d\n",netface[x],cfg_ServerPort);
+	g_log->LogMessage(LOG_ERR,"Error %d returned from socket(client)\n",errno);
+	argPortal->sock = 0;
+	return(0);
+	}
 
-		if (tcplisten[x].sock > 0)
-		{
-		shutdown(tcplisten[x].sock,SHUT_RDWR);
-		close(tcplisten[x].sock);
-		}
+// allow binding even with old sockets in TIME_WAIT status
+val = 1;
+ret = setsockopt(argPortal->sock,SOL_SOCKET,SO_REUSEADDR,(char *)&val,sizeof(val));
 
-		if (udplisten[x].sock > 0)
-		{
-		shutdown(udplisten[x].sock,SHUT_RDWR);
-		close(udplisten[x].sock);
-		}
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEADDR)\n",errno);
+	return(0);
 	}
-}
-/*--------------------------------------------------------------------------*/
-int ClientNetwork::SessionCleanup(int argForce)
-{
-struct netportal	*item,*next;
-time_t				current;
-char				textaddr[32];
-int					total;
 
-// get the current time and initialize local variables
-current = time(NULL);
-item = tcpactive;
-total = 0;
+// enable busy polling when configured which accepted sessions inherit
+busypoll_socket(argPortal->sock);
+
+// with multiple client threads every thread binds the same address
+// and the kernel spreads inbound connections across the sockets
+val = 1;
+if (cfg_ClientThreads > 1) ret = setsockopt(argPortal->sock,SOL_SOCKET,SO_REUSEPORT,(char *)&val,sizeof(val));
 
-	// look at every item in the linked list
-	while (item != NULL)
+	if (ret == -1)
 	{
-	// save pointer to next
-	next = item->next;
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEPORT)\n",errno);
+	return(0);
+	}
 
-		// if the item is stale or force is set we delete
-		if (((current - item->created) > cfg_SessionTimeout) || (argForce != 0))
-		{
-		inet_ntop(AF_INET,&item->addr.sin_addr,textaddr,sizeof(textaddr));
-		g_log->LogMessage(LOG_DEBUG,"Removing stale client TCP session from %s:%d\n",textaddr,htons(item->addr.sin_port));
-		RemoveSession(item);
-		total++;
-		}
+// set socket to nonblocking mode
+ret = fcntl(argPortal->sock,F_SETFL,O_NONBLOCK);
 
-	// adjust our working pointer
-	item = next;
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from fcntl(O_NONBLOCK)\n",errno);
+	return(0);
 	}
 
-return(total);
-}
-/*--------------------------------------------------------------------------*/
-void ClientNetwork::RemoveSession(struct netportal *argPortal)
-{
-struct epoll_event	evt;
-int					ret;
+// bind the socket to our server interface
+memset(&addr,0,sizeof(addr));
+addr.sin_family = AF_INET;
+addr.sin_port = htons(argPort);
+addr.sin_addr.s_addr = IPv4list[argIndex];
+ret = bind(argPortal->sock,(struct sockaddr *)&addr,sizeof(addr));
 
-// remove the socket from the epoll - note that evt isn't used but
-// we pass it to prevent a bug in case the kernel version < 2.3.9
-memset(&evt,0,sizeof(evt));
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bind(client)\n",errno);
+	return(0);
+	}
+
+// have the kernel hold new connections until the first query arrives
+// so we never wake up to accept a session that has nothing to read
+val = cfg_DeferAccept;
+if (cfg_DeferAccept != 0) ret = setsockopt(argPortal->sock,IPPROTO_TCP,TCP_DEFER_ACCEPT,(char *)&val,sizeof(val));
+if (ret == -1) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(TCP_DEFER_ACCEPT)\n",errno);
+
+// allow clients to send the query along with the SYN which saves a
+// round trip when they connect to us again
+val = cfg_FastOpen;
+if (cfg_FastOpen != 0) ret = setsockopt(argPortal->sock,IPPROTO_TCP,TCP_FASTOPEN,(char *)&val,sizeof(val));
+if (ret == -1) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(TCP_FASTOPEN)\n",errno);
+
+// listen for connections on the socket
+ret = listen(argPortal->sock,cfg_ListenBacklog);
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from listen(client)\n",errno);
+	return(0);
+	}
+
+// add the socket to the epoll using the current listen state
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = argPortal;
+evt.events = tcparmed;
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,argPortal->sock,&evt);
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from TCP epoll_ctl(client)\n",errno);
+	return(0);
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::BindInterface(int argIndex)
+{
+struct sockaddr_in		addr;
+struct epoll_event		evt;
+int						val,ret;
+int						sock;
+
+// open the TCP listen socket for the interface
+g_log->LogMessage(LOG_INFO,"ClientNetwork %d listening on %s:%d\n",ThreadNumber,netface[argIndex],cfg_ServerPort);
+ret = OpenListener(&tcplisten[argIndex],argIndex,cfg_ServerPort);
+if (ret == 0) return(0);
+
+	// and the DNS over TLS listen socket on the same address
+	if (g_tls != NULL)
+	{
+	g_log->LogMessage(LOG_INFO,"ClientNetwork %d listening for TLS on %s:%d\n",ThreadNumber,netface[argIndex],cfg_TlsPort);
+	ret = OpenListener(&tlslisten[argIndex],argIndex,cfg_TlsPort);
+	if (ret == 0) return(0);
+	}
+
+	// and the DNS over HTTPS listen socket which also needs TLS
+	if ((g_tls != NULL) && (cfg_DohPort != 0))
+	{
+	g_log->LogMessage(LOG_INFO,"ClientNetwork %d listening for HTTPS on %s:%d\n",ThreadNumber,netface[argIndex],cfg_DohPort);
+	ret = OpenListener(&dohlisten[argIndex],argIndex,cfg_DohPort);
+	if (ret == 0) return(0);
+	}
+
+// the UDP socket is set up on a local descriptor since a slot being
+// reused already has one that replies may still be using
+sock = socket(PF_INET,SOCK_DGRAM,0);
+
+	if (sock == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from socket(client)\n",errno);
+	return(0);
+	}
+
+// allow binding even with old sockets in TIME_WAIT status
+val = 1;
+ret = setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,(char *)&val,sizeof(val));
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEADDR)\n",errno);
+	close(sock);
+	return(0);
+	}
+
+// enable busy polling when configured and watch for kernel drops
+busypoll_socket(sock);
+dropwatch_socket(sock);
+
+// with multiple client threads every thread binds the same address
+// and the kernel spreads inbound datagrams across the sockets
+val = 1;
+if (cfg_ClientThreads > 1) ret = setsockopt(sock,SOL_SOCKET,SO_REUSEPORT,(char *)&val,sizeof(val));
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_REUSEPORT)\n",errno);
+	close(sock);
+	return(0);
+	}
+
+// set socket to nonblocking mode
+ret = fcntl(sock,F_SETFL,O_NONBLOCK);
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from fcntl(O_NONBLOCK)\n",errno);
+	close(sock);
+	return(0);
+	}
+
+// bind the socket to our server interface
+memset(&addr,0,sizeof(addr));
+addr.sin_family = AF_INET;
+addr.sin_port = htons(cfg_ServerPort);
+addr.sin_addr.s_addr = IPv4list[argIndex];
+ret = bind(sock,(struct sockaddr *)&addr,sizeof(addr));
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bind(client)\n",errno);
+	close(sock);
+	return(0);
+	}
+
+// the wildcard socket needs the address each query was sent to
+val = 1;
+if (cfg_Wildcard != 0) ret = setsockopt(sock,IPPROTO_IP,IP_PKTINFO,(char *)&val,sizeof(val));
+
+	if (ret == -1)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(IP_PKTINFO)\n",errno);
+	close(sock);
+	return(0);
+	}
+
+// set the address first so ForwardUDPReply stops sending replies for
+// the old address before the descriptor below starts using the new one
+udplisten[argIndex].ifaddr = IPv4list[argIndex];
+
+	// the new socket takes over the existing descriptor number so it
+	// never refers to some other socket while replies still hold it, and
+	// replies for queries that came in on the old address are dropped
+	if (udplisten[argIndex].sock > 0)
+	{
+	dup2(sock,udplisten[argIndex].sock);
+	close(sock);
+	sock = udplisten[argIndex].sock;
+	}
+
+udplisten[argIndex].ifidx = argIndex;
+udplisten[argIndex].proto = IPPROTO_UDP;
+udplisten[argIndex].sock = sock;
+udplisten[argIndex].dropped = 0;
+
+// put the socket in the slot for this thread in the steering program
+if (g_steer != NULL) g_steer->AttachSocket(IPv4list[argIndex],ThreadNumber,sock);
+
+// allocate the reply transmit queue for the UDP socket
+if ((cfg_SendBatch > 1) && (udpbatch[argIndex] == NULL)) udpbatch[argIndex] = new PacketBatch(sock,cfg_SendBatch);
+
+	// with io_uring the UDP sockets use multishot receive requests
+	if (uring != NULL)
+	{
+	uring->ArmRecvMessage(sock,(unsigned long)&udplisten[argIndex]);
+	return(1);
+	}
+
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = &udplisten[argIndex];
+evt.events = (cfg_EdgeTrigger != 0 ? EPOLLIN | EPOLLET : EPOLLIN);
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,sock,&evt);
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from UDP epoll_ctl(client)\n",errno);
+	return(0);
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::UnbindInterface(int argIndex)
+{
+// the TCP listeners are closed but any sessions already accepted
+// on the address are left alone until they finish or time out
+CloseListener(&tcplisten[argIndex]);
+CloseListener(&tlslisten[argIndex]);
+CloseListener(&dohlisten[argIndex]);
+
+	// the UDP socket stays open since replies for queries it received
+	// may still be on the way, until another address takes the slot
+	// in BindInterface or it is closed in SocketDestroy
+	if (udplisten[argIndex].sock > 0)
+	{
+	if (uring != NULL) uring->CancelRequest((unsigned long)&udplisten[argIndex]);
+	else epoll_ctl(pollsock,EPOLL_CTL_DEL,udplisten[argIndex].sock,NULL);
+	}
+
+if (udpbatch[argIndex] != NULL) udpbatch[argIndex]->FlushBatch();
+
+// an empty name marks the slot as inactive
+IPv4list[argIndex] = 0;
+netface[argIndex][0] = 0;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::CloseListener(netportal *argPortal)
+{
+if (argPortal->sock <= 0) return;
+
+epoll_ctl(pollsock,EPOLL_CTL_DEL,argPortal->sock,NULL);
+shutdown(argPortal->sock,SHUT_RDWR);
+close(argPortal->sock);
+argPortal->sock = 0;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::InsertInterface(unsigned int argAddr)
+{
+int		ret,x;
+
+// ignore excluded addresses and any we are already using
+if (CheckNetFilter(argAddr) != 0) return;
+for(x = 0;x < IPv4tot;x++) if ((netface[x][0] != 0) && (IPv4list[x] == argAddr)) return;
+
+// reuse the first inactive slot or add a new one at the end
+for(x = 0;x < IPv4tot;x++) if (netface[x][0] == 0) break;
+
+	if (x == SOCKLIMIT)
+	{
+	g_log->LogMessage(LOG_WARNING,"ClientNetwork %d has no room for another listener\n",ThreadNumber);
+	return;
+	}
+
+IPv4list[x] = argAddr;
+inet_ntop(AF_INET,&argAddr,netface[x],sizeof(netface[x]));
+if (x == IPv4tot) IPv4tot++;
+
+ret = BindInterface(x);
+
+	if (ret == 0)
+	{
+	g_log->LogMessage(LOG_WARNING,"ClientNetwork %d unable to add listener on %s:%d\n",ThreadNumber,netface[x],cfg_ServerPort);
+	UnbindInterface(x);
+	return;
+	}
+
+udpcount = IPv4tot;
+if (xdp != NULL) xdp->InsertAddress(argAddr);
+
+g_log->LogMessage(LOG_NOTICE,"ClientNetwork %d added listener on %s:%d\n",ThreadNumber,netface[x],cfg_ServerPort);
+g_listenadd++;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::RemoveInterface(unsigned int argAddr)
+{
+int		x;
+
+// find the active slot for the address
+for(x = 0;x < IPv4tot;x++) if ((netface[x][0] != 0) && (IPv4list[x] == argAddr)) break;
+if (x == IPv4tot) return;
+
+g_log->LogMessage(LOG_NOTICE,"ClientNetwork %d removed listener on %s:%d\n",ThreadNumber,netface[x],cfg_ServerPort);
+UnbindInterface(x);
+
+// queries for the address go back to the kernel stack
+if (xdp != NULL) xdp->RemoveAddress(argAddr);
+
+g_listenremove++;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::SocketDestroy(void)
+{
+int		x;
+
+// close the epoll descriptor
+g_log->LogMessage(LOG_DEBUG,"Shutting down client %d epoll engine\n",ThreadNumber);
+close(pollsock);
+
+	// close the io_uring which cancels all outstanding requests
+	if (uring != NULL)
+	{
+	delete(uring);
+	uring = NULL;
+	}
+
+	// send anything left and detach the XDP program
+	if (xdp != NULL)
+	{
+	xdp->FlushTransmit();
+	delete(xdp);
+	xdp = NULL;
+	}
+
+	// stop watching for address changes
+	if (linkportal.sock > 0)
+	{
+	close(linkportal.sock);
+	linkportal.sock = 0;
+	}
+
+	// shutdown and close all our sockets including those in
+	// inactive slots that were left open for replies in flight
+	for(x = 0;x < IPv4tot;x++)
+	{
+	if (netface[x][0] != 0) g_log->LogMessage(LOG_INFO,"Disconnecting ClientNetwork %d from %s:%d\n",ThreadNumber,netface[x],cfg_ServerPort);
+
+		if (tcplisten[x].sock > 0)
+		{
+		shutdown(tcplisten[x].sock,SHUT_RDWR);
+		close(tcplisten[x].sock);
+		}
+
+		if (tlslisten[x].sock > 0)
+		{
+		shutdown(tlslisten[x].sock,SHUT_RDWR);
+		close(tlslisten[x].sock);
+		}
+
+		if (dohlisten[x].sock > 0)
+		{
+		shutdown(dohlisten[x].sock,SHUT_RDWR);
+		close(dohlisten[x].sock);
+		}
+
+		if (udpbatch[x] != NULL)
+		{
+		udpbatch[x]->FlushBatch();
+		delete(udpbatch[x]);
+		udpbatch[x] = NULL;
+		}
+
+		if (udplisten[x].sock > 0)
+		{
+		shutdown(udplisten[x].sock,SHUT_RDWR);
+		close(udplisten[x].sock);
+		}
+	}
+
+udpcount = 0;
+
+// free the batch receive buffers
+if (batchmsg != NULL) free(batchmsg);
+if (batchvec != NULL) free(batchvec);
+if (batchaddr != NULL) free(batchaddr);
+if (batchbuffer != NULL) free(batchbuffer);
+if (batchctrl != NULL) free(batchctrl);
+batchmsg = NULL;
+batchvec = NULL;
+batchaddr = NULL;
+batchbuffer = NULL;
+batchctrl = NULL;
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::SessionCleanup(int argForce)
+{
+struct netportal	*item,*next;
+struct timernode	*timer,*after;
+long long			current,expires;
+char				textaddr[32];
+int					total;
+
+total = 0;
+
+	// when forced we delete every session in the linked list
+	if (argForce != 0)
+	{
+	item = tcpactive;
+
+		while (item != NULL)
+		{
+		next = item->next;
+		RemoveSession(item);
+		total++;
+		item = next;
+		}
+
+	return(total);
+	}
+
+// get the list of session timers that have expired
+current = TimerWheel::NowMilliseconds();
+timer = tcpwheel->ExpireTimers(current);
+
+	while (timer != NULL)
+	{
+	// save pointer to next
+	after = timer->next;
+	item = (netportal *)timer->owner;
+
+	// a session that was active since the timer was started gets
+	// the timer started again for the rest of the timeout
+	tcplock.Acquire();
+	expires = (item->active + (cfg_SessionTimeout * 1000));
+	tcplock.Release();
+
+		if (expires > current)
+		{
+		tcpwheel->InsertTimer(&item->timer,expires);
+		timer = after;
+		continue;
+		}
+
+	inet_ntop(AF_INET,&item->addr.sin_addr,textaddr,sizeof(textaddr));
+	g_log->LogMessage(LOG_DEBUG,"Removing stale client TCP session from %s:%d\n",textaddr,htons(item->addr.sin_port));
+	RemoveSession(item);
+	total++;
+
+	// adjust our working pointer
+	timer = after;
+	}
+
+// when we stopped accepting because every session was busy we start
+// again once the oldest session has been idle long enough to evict
+if ((tcparmed == 0) && (CheckEviction() != 0)) ArmListeners(EPOLLIN);
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::RemoveSession(struct netportal *argPortal)
+{
+struct epoll_event	evt;
+int					ret;
+
+// remove the socket from the epoll - note that evt isn't used but
+// we pass it to prevent a bug in case the kernel version < 2.3.9
+memset(&evt,0,sizeof(evt));
 ret = epoll_ctl(pollsock,EPOLL_CTL_DEL,argPortal->sock,&evt);
 
-	// unexpected error so spew a message and clear the running flag
-	if (ret != 0)
+	// unexpected error so spew a message and clear the running flag
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
+	running = 0;
+	}
+
+// stop the idle timer for the session
+tcpwheel->RemoveTimer(&argPortal->timer);
+
+// clear the session from the table before the socket is closed so
+// a reply for the session can never be sent to a reused descriptor
+tcplock.Acquire();
+tcptable[argPortal->session] = NULL;
+tcplock.Release();
+
+// send the TLS close alert and free the session state
+if (argPortal->tls != NULL) g_tls->DestroySession(argPortal->tls);
+argPortal->tls = NULL;
+
+// replies can't find the session once it is out of the table
+if (argPortal->doh != NULL) delete(argPortal->doh);
+argPortal->doh = NULL;
+
+// shutdown and close the socket
+shutdown(argPortal->sock,SHUT_RDWR);
+close(argPortal->sock);
+
+// remove the netportal from the double linked list
+if (argPortal->last != NULL) argPortal->last->next = argPortal->next;
+if (argPortal->next != NULL) argPortal->next->last = argPortal->last;
+
+// if the item we deleted was first or last in the list adjust the pointer
+if (tcpactive == argPortal) tcpactive = argPortal->next;
+if (tcpoldest == argPortal) tcpoldest = argPortal->last;
+RemoveSource(argPortal);
+
+// return the object to the pool and decrement the session counter
+ReleasePortal(argPortal);
+tcpcount--;
+
+// there is room for a new session so start accepting again
+if (tcparmed == 0) ArmListeners(EPOLLIN);
+}
+/*--------------------------------------------------------------------------*/
+netportal *ClientNetwork::AllocatePortal(void)
+{
+netportal		*local;
+char			*inbuffer;
+int				insize;
+int				session;
+
+if (tcppool == NULL) return(NULL);
+
+local = tcppool;
+tcppool = local->next;
+
+// clear everything except the read buffer and table slot which
+// stay with the object so they can be used again without malloc
+inbuffer = local->inbuffer;
+insize = local->insize;
+session = local->session;
+memset(local,0,sizeof(netportal));
+local->inbuffer = inbuffer;
+local->insize = insize;
+local->session = session;
+
+	if (local->inbuffer == NULL)
+	{
+	local->insize = TCPBUFFER;
+	local->inbuffer = (char *)malloc(local->insize);
+	}
+
+return(local);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::ReleasePortal(netportal *argPortal)
+{
+	// a read buffer that grew for a large message is not kept
+	if (argPortal->insize > TCPBUFFER)
+	{
+	free(argPortal->inbuffer);
+	argPortal->inbuffer = NULL;
+	argPortal->insize = 0;
+	}
+
+// the reply queue is only needed while the session is busy
+if (argPortal->outbuffer != NULL) free(argPortal->outbuffer);
+argPortal->outbuffer = NULL;
+argPortal->outsize = 0;
+
+argPortal->next = tcppool;
+tcppool = argPortal;
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::CountSource(unsigned int argAddr)
+{
+netportal		*local;
+int				total;
+
+total = 0;
+
+	for(local = tcpsource[(argAddr * 2654435761U) & (tcpbuckets - 1)];local != NULL;local = local->chain)
+	{
+	if (local->addr.sin_addr.s_addr == argAddr) total++;
+	}
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::InsertSource(netportal *argPortal)
+{
+unsigned int	key;
+
+key = ((argPortal->addr.sin_addr.s_addr * 2654435761U) & (tcpbuckets - 1));
+argPortal->chain = tcpsource[key];
+tcpsource[key] = argPortal;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::RemoveSource(netportal *argPortal)
+{
+netportal		**local;
+unsigned int	key;
+
+key = ((argPortal->addr.sin_addr.s_addr * 2654435761U) & (tcpbuckets - 1));
+
+	for(local = &tcpsource[key];*local != NULL;local = &(*local)->chain)
+	{
+	if (*local != argPortal) continue;
+	*local = argPortal->chain;
+	break;
+	}
+
+argPortal->chain = NULL;
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::CheckEviction(void)
+{
+long long		active;
+
+// the least recently active session is at the end of the list
+if (tcpoldest == NULL) return(0);
+
+tcplock.Acquire();
+active = tcpoldest->active;
+tcplock.Release();
+
+if ((TimerWheel::NowMilliseconds() - active) < cfg_EvictIdle) return(0);
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::EvictSession(void)
+{
+char			textaddr[32];
+
+inet_ntop(AF_INET,&tcpoldest->addr.sin_addr,textaddr,sizeof(textaddr));
+g_log->LogMessage(LOG_DEBUG,"Evicting client TCP session from %s:%d\n",textaddr,htons(tcpoldest->addr.sin_port));
+RemoveSession(tcpoldest);
+g_tcpevicted++;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::ArmListeners(unsigned int argEvents)
+{
+int		x;
+
+tcparmed = argEvents;
+
+	// change the events on every listen socket we have open
+	for(x = 0;x < IPv4tot;x++)
+	{
+	ArmListener(&tcplisten[x],argEvents);
+	ArmListener(&tlslisten[x],argEvents);
+	ArmListener(&dohlisten[x],argEvents);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::ArmListener(netportal *argPortal,unsigned int argEvents)
+{
+struct epoll_event	evt;
+int					ret;
+
+if (argPortal->sock <= 0) return;
+
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = argPortal;
+evt.events = argEvents;
+ret = epoll_ctl(pollsock,EPOLL_CTL_MOD,argPortal->sock,&evt);
+if (ret != 0) g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::FlushSession(netportal *argPortal,struct iovec *argList,int argCount)
+{
+struct msghdr	msg;
+struct iovec	vec[4];
+int				total,sent,used;
+int				ret,x;
+
+	// the record layer can't gather so on TLS sessions the new data is
+	// added to the queue and everything goes out in one write
+	if (argPortal->tls != NULL)
+	{
+	for(x = 0;x < argCount;x++) AppendSession(argPortal,(char *)argList[x].iov_base,argList[x].iov_len);
+	argCount = 0;
+	}
+
+// the caller must hold the tcplock and we gather the queued data
+// followed by any new data so it all goes out in one call
+total = 0;
+
+	if (argPortal->outcount != 0)
+	{
+	vec[total].iov_base = argPortal->outbuffer;
+	vec[total].iov_len = argPortal->outcount;
+	total++;
+	}
+
+for(x = 0;x < argCount;x++) vec[total++] = argList[x];
+if (total == 0) return(0);
+
+memset(&msg,0,sizeof(msg));
+msg.msg_iov = vec;
+msg.msg_iovlen = total;
+
+if (argPortal->tls != NULL) ret = g_tls->WriteSession(argPortal->tls,argPortal->outbuffer,argPortal->outcount);
+else ret = sendmsg(argPortal->sock,&msg,MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	// the client is gone so we throw away anything waiting and the
+	// session is cleaned up when the network thread reads the socket
+	if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR))
+	{
+	if ((errno != EPIPE) && (errno != ECONNRESET)) g_log->LogMessage(LOG_WARNING,"Error %d returned from sendmsg(client)\n",errno);
+	argPortal->outcount = 0;
+	return(-1);
+	}
+
+// when the socket is full nothing was sent
+if (ret < 0) ret = 0;
+sent = ret;
+
+// remember the activity so the idle timer is pushed back
+if (ret > 0) argPortal->active = TimerWheel::NowMilliseconds();
+
+// remove whatever was sent from the front of the queue
+used = (sent < argPortal->outcount ? sent : argPortal->outcount);
+argPortal->outcount-=used;
+if ((used != 0) && (argPortal->outcount != 0)) memmove(argPortal->outbuffer,&argPortal->outbuffer[used],argPortal->outcount);
+sent-=used;
+
+	// and add whatever is left of the new data to the end
+	for(x = 0;x < argCount;x++)
+	{
+	if (sent >= (int)argList[x].iov_len) { sent-=argList[x].iov_len; continue; }
+	AppendSession(argPortal,(char *)argList[x].iov_base + sent,argList[x].iov_len - sent);
+	sent = 0;
+	}
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::AppendSession(netportal *argPortal,const char *argData,int argSize)
+{
+int		need;
+
+need = (argPortal->outcount + argSize);
+
+	// grow the queue in big steps to limit the number of copies
+	if (need > argPortal->outsize)
+	{
+	argPortal->outsize = (need * 2);
+	argPortal->outbuffer = (char *)realloc(argPortal->outbuffer,argPortal->outsize);
+	}
+
+memcpy(&argPortal->outbuffer[argPortal->outcount],argData,argSize);
+argPortal->outcount+=argSize;
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::UpdateSession(netportal *argPortal)
+{
+struct epoll_event	evt;
+unsigned int		mask;
+char				textaddr[32];
+int					ret;
+
+// keep reading unless the queue is over the limit and once we stop
+// we don't start again until at least half of it has been sent
+mask = (argPortal->events & EPOLLIN);
+if (argPortal->outcount > cfg_WriteLimit) mask = 0;
+if (argPortal->outcount <= (cfg_WriteLimit / 2)) mask = EPOLLIN;
+if (((argPortal->events & EPOLLIN) != 0) && (mask == 0)) g_tcppaused++;
+
+	// a client that stops reading altogether is dropped before the
+	// replies waiting for it can use up all of our memory
+	if (argPortal->outcount > (cfg_WriteLimit * 4))
+	{
+	inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
+	g_log->LogMessage(LOG_WARNING,"Dropping client TCP session from %s:%d with %d bytes waiting\n",textaddr,htons(argPortal->addr.sin_port),argPortal->outcount);
+	shutdown(argPortal->sock,SHUT_RDWR);
+	argPortal->outcount = 0;
+	mask = EPOLLIN;
+	g_tcpdropped++;
+	}
+
+// watch for the socket to drain while anything is waiting
+if (argPortal->outcount != 0) mask|=EPOLLOUT;
+
+	// don't hang on to a big queue once it has been emptied
+	if ((argPortal->outcount == 0) && (argPortal->outsize > cfg_WriteLimit))
+	{
+	free(argPortal->outbuffer);
+	argPortal->outbuffer = NULL;
+	argPortal->outsize = 0;
+	}
+
+if (mask == argPortal->events) return;
+
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = argPortal;
+evt.events = argPortal->events = mask;
+ret = epoll_ctl(pollsock,EPOLL_CTL_MOD,argPortal->sock,&evt);
+if (ret != 0) g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessTCPConnect(netportal *argPortal)
+{
+int		total,ret;
+
+g_acceptcalls++;
+total = 0;
+
+	// accept as many connections as are waiting up to the batch limit
+	// so a burst of new sessions doesn't take one epoll_wait for each
+	while (total < cfg_AcceptBatch)
+	{
+	ret = AcceptSession(argPortal);
+	if (ret < 0) break;
+	total+=ret;
+	}
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::AcceptSession(netportal *argPortal)
+{
+struct epoll_event	evt;
+struct sockaddr_in	local,remote;
+struct netportal	*network;
+struct ssl_st		*secure;
+unsigned int		ret,len;
+unsigned int		ifaddr;
+char				textaddr[32];
+int					sock,port;
+
+	// when every session is in use and none has been idle long enough
+	// to be evicted we stop watching the listen sockets until one of
+	// the sessions is closed since otherwise they stay triggered and
+	// epoll_wait would return immediately for as long as we are full
+	if ((tcppool == NULL) && (CheckEviction() == 0))
+	{
+	if (tcparmed != 0) g_tcpsaturated++;
+	if (tcparmed != 0) ArmListeners(0);
+	return(-1);
+	}
+
+// accept the inbound connection already in nonblocking mode
+len = sizeof(remote);
+sock = accept4(argPortal->sock,(struct sockaddr *)&remote,&len,SOCK_NONBLOCK);
+
+// nothing left to accept so we are done for now
+if ((sock == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return(-1);
+
+// connections that were reset before we got to them are skipped
+if ((sock == -1) && ((errno == ECONNABORTED) || (errno == EINTR))) return(0);
+
+	if (sock == -1)
+	{
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from accept4(%s)\n",errno,netface[argPortal->ifidx]);
+	return(-1);
+	}
+
+g_tcpaccepted++;
+
+// extract the inbound address and do some logging
+inet_ntop(AF_INET,&remote.sin_addr,textaddr,sizeof(textaddr));
+ifaddr = argPortal->ifaddr;
+
+	// on the wildcard socket we check the address they connected to
+	if (cfg_Wildcard != 0)
+	{
+	memset(&local,0,sizeof(local));
+	len = sizeof(local);
+	getsockname(sock,(struct sockaddr *)&local,&len);
+	ifaddr = local.sin_addr.s_addr;
+
+		if (CheckNetFilter(ifaddr) != 0)
+		{
+		g_log->LogMessage(LOG_DEBUG,"Ignoring TCP connection from %s:%d to a filtered address\n",textaddr,htons(remote.sin_port));
+		close(sock);
+		return(0);
+		}
+	}
+
+	// close the connection when the source already has too many
+	if ((cfg_SourceLimit != 0) && (CountSource(remote.sin_addr.s_addr) >= cfg_SourceLimit))
+	{
+	g_log->LogMessage(LOG_DEBUG,"Refusing TCP connection from %s:%d over the source limit\n",textaddr,htons(remote.sin_port));
+	close(sock);
+	g_tcprefused++;
+	return(0);
+	}
+
+// connections on the TLS listener get a session for the handshake
+// which runs when the client hello arrives
+secure = NULL;
+port = cfg_ServerPort;
+
+	if (argPortal == &tlslisten[argPortal->ifidx])
+	{
+	secure = g_tls->CreateSession(sock,0);
+	port = cfg_TlsPort;
+
+		if (secure == NULL)
+		{
+		close(sock);
+		return(0);
+		}
+	}
+
+	// and the HTTPS listener is the same except for the protocol
+	if (argPortal == &dohlisten[argPortal->ifidx])
+	{
+	secure = g_tls->CreateSession(sock,1);
+	port = cfg_DohPort;
+
+		if (secure == NULL)
+		{
+		close(sock);
+		return(0);
+		}
+	}
+
+// make room by closing the least recently active session
+if (tcppool == NULL) EvictSession();
+
+network = AllocatePortal();
+network->sock = sock;
+network->ifaddr = ifaddr;
+network->tls = secure;
+memcpy(&network->addr,&remote,sizeof(remote));
+
+	// HTTP/2 sessions get the protocol state and a read buffer big
+	// enough for the largest frame we allow the client to send
+	if (argPortal == &dohlisten[argPortal->ifidx])
+	{
+	network->doh = new DohSession(cfg_DohStreams);
+
+		if (network->insize < DOHBUFFER)
+		{
+		network->inbuffer = (char *)realloc(network->inbuffer,DOHBUFFER);
+		network->insize = DOHBUFFER;
+		}
+
+	g_dohsessions++;
+	}
+
+g_log->LogMessage(LOG_DEBUG,"CLIENT CONNECT %s:%d from %s:%d\n",netface[argPortal->ifidx],port,textaddr,htons(network->addr.sin_port));
+
+// add the new network objet to the front of the double linked list
+// which is kept in order of activity with the oldest at the end
+network->proto = IPPROTO_TCP;
+network->next = tcpactive;
+network->length = 0;
+network->last = NULL;
+if (tcpactive != NULL) tcpactive->last = network;
+if (tcpoldest == NULL) tcpoldest = network;
+tcpactive = network;
+InsertSource(network);
+
+// the pooled object owns a slot in the session table and we assign a
+// serial number so replies can tell if the slot has been given to a
+// different session while they were in flight
+network->serial = ++tcpserial;
+
+tcplock.Acquire();
+tcptable[network->session] = network;
+tcplock.Release();
+
+// start the idle timer for the session
+network->active = TimerWheel::NowMilliseconds();
+network->timer.owner = network;
+tcpwheel->InsertTimer(&network->timer,network->active + (cfg_SessionTimeout * 1000));
+
+// add the new socket to the epoll
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = network;
+evt.events = network->events = EPOLLIN;
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,network->sock,&evt);
+
+	// unexpected error so spew a message and clear the running flag
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
+	running = 0;
+	}
+
+// increment the count of active TCP sessions
+tcpcount++;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessTCPQuery(netportal *argPortal)
+{
+MessageFrame		*list[BATCHLIMIT];
+ProxyEntry			*local;
+unsigned short		prefix;
+int					offset,need,size;
+int					count;
+
+// read whatever the client has sent into the space left in the buffer
+if (argPortal->tls == NULL) size = recv(argPortal->sock,&argPortal->inbuffer[argPortal->incount],argPortal->insize - argPortal->incount,MSG_DONTWAIT);
+
+	// TLS sessions finish the handshake first without the lock since no
+	// reply can be written before the first query, but the reads need
+	// the lock since replies are written on other threads after that
+	// and the client may have sent the first query along with it
+	if (argPortal->tls != NULL)
+	{
+	size = g_tls->AcceptSession(argPortal->tls);
+
+		if (size > 0)
+		{
+		tcplock.Acquire();
+		size = g_tls->ReadSession(argPortal->tls,&argPortal->inbuffer[argPortal->incount],argPortal->insize - argPortal->incount);
+		tcplock.Release();
+		}
+	}
+
+// nothing to read right now so wait for the next event
+if ((size < 0) && ((errno == EAGAIN) || (errno == EINTR))) return(1);
+
+	// anything else means the client closed the connection or an error
+	if (size <= 0)
+	{
+	RemoveSession(argPortal);
+	return(0);
+	}
+
+// remember the activity so the idle timer is pushed back
+tcplock.Acquire();
+argPortal->active = TimerWheel::NowMilliseconds();
+tcplock.Release();
+
+	// move the session to the front of the list so the one at the
+	// end is always the least recently active when we need to evict
+	if (tcpactive != argPortal)
+	{
+	if (tcpoldest == argPortal) tcpoldest = argPortal->last;
+	argPortal->last->next = argPortal->next;
+	if (argPortal->next != NULL) argPortal->next->last = argPortal->last;
+	argPortal->last = NULL;
+	argPortal->next = tcpactive;
+	tcpactive->last = argPortal;
+	tcpactive = argPortal;
+	}
+
+argPortal->incount+=size;
+offset = count = 0;
+
+	// HTTP/2 sessions pull the queries out of the frames instead
+	if (argPortal->doh != NULL)
+	{
+	offset = ProcessFrames(argPortal,list,&count);
+
+		if (offset < 0)
+		{
+		g_qfilter->PushBatch(list,count);
+		RemoveSession(argPortal);
+		return(0);
+		}
+	}
+
+	// clients may send many queries without waiting for the answers
+	// so we pull every complete message out of the buffer
+	else while ((argPortal->incount - offset) >= (int)sizeof(prefix))
 	{
-	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
-	running = 0;
+	memcpy(&prefix,&argPortal->inbuffer[offset],sizeof(prefix));
+	need = ntohs(prefix);
+	if ((argPortal->incount - offset - (int)sizeof(prefix)) < need) break;
+
+	local = InsertTCPQuery(argPortal,&argPortal->inbuffer[offset + sizeof(prefix)],need);
+	offset+=(sizeof(prefix) + need);
+
+		// a message too small to be a query is a protocol violation
+		// so we pass along what we have and shut the session down
+		if ((local == NULL) && (need < 17))
+		{
+		g_qfilter->PushBatch(list,count);
+		RemoveSession(argPortal);
+		return(0);
+		}
+
+	if (local == NULL) continue;
+	list[count++] = new ProxyMessage(local->mygrid,local->myslot);
+
+		// hand the batch to the query filter when the list is full
+		if (count == BATCHLIMIT)
+		{
+		g_qfilter->PushBatch(list,count);
+		count = 0;
+		}
 	}
 
-// shutdown and close the socket
-shutdown(argPortal->sock,SHUT_RDWR);
-close(argPortal->sock);
+// move any partial message to the front of the buffer
+argPortal->incount-=offset;
+if ((offset != 0) && (argPortal->incount != 0)) memmove(argPortal->inbuffer,&argPortal->inbuffer[offset],argPortal->incount);
 
-// remove the netportal from the double linked list
-if (argPortal->last != NULL) argPortal->last->next = argPortal->next;
-if (argPortal->next != NULL) argPortal->next->last = argPortal->last;
+	// grow the buffer when the next message won't fit
+	if ((argPortal->doh == NULL) && (argPortal->incount >= (int)sizeof(prefix)))
+	{
+	memcpy(&prefix,argPortal->inbuffer,sizeof(prefix));
+	need = (ntohs(prefix) + sizeof(prefix));
 
-// if the item we deleted was first in the list adjust the pointer
-if (tcpactive == argPortal) tcpactive = argPortal->next;
+		if (need > argPortal->insize)
+		{
+		argPortal->inbuffer = (char *)realloc(argPortal->inbuffer,need);
+		argPortal->insize = need;
+		}
+	}
 
-// delete the object and decrement the session counter
-delete(argPortal);
-tcpcount--;
+	// a full buffer on an HTTP/2 session holds a header block split
+	// across continuation frames that hasn't arrived yet
+	if ((argPortal->doh != NULL) && (argPortal->incount == argPortal->insize))
+	{
+	argPortal->insize+=DOHBUFFER;
+	argPortal->inbuffer = (char *)realloc(argPortal->inbuffer,argPortal->insize);
+	}
+
+// hand everything we received to the query filter queue
+g_qfilter->PushBatch(list,count);
+
+// the library may be holding decrypted data that won't trigger the
+// socket again so we keep going until all of it has been read
+if ((argPortal->tls != NULL) && (g_tls->PendingData(argPortal->tls) != 0)) return(ProcessTCPQuery(argPortal));
+
+return(size);
 }
 /*--------------------------------------------------------------------------*/
-int ClientNetwork::ProcessTCPConnect(netportal *argPortal)
+int ClientNetwork::ProcessFrames(netportal *argPortal,MessageFrame **argList,int *argCount)
 {
-struct epoll_event	evt;
-struct netportal	*network;
-unsigned int		ret,len;
-char				textaddr[32];
+struct iovec		vec;
+DohSession			*session;
+ProxyEntry			*local;
+int					offset,ret;
+
+session = argPortal->doh;
+offset = 0;
+
+	// the session stops at each complete query so we can insert it
+	// before the buffer it points to is used for the next one
+	for(;;)
+	{
+	tcplock.Acquire();
+	ret = session->ProcessInput(&argPortal->inbuffer[offset],argPortal->incount - offset);
+	tcplock.Release();
+
+	if (ret <= 0) break;
+	offset+=ret;
+
+	if (session->query == NULL) continue;
+
+	local = InsertTCPQuery(argPortal,session->query,session->querysize);
+
+		// queries we can't parse get an error on their stream
+		if (local == NULL)
+		{
+		tcplock.Acquire();
+		session->InsertStatus(session->querystream,400);
+		tcplock.Release();
+		continue;
+		}
 
-// if maximum number of sessions has been reached just return.
-// the socket will stay in triggered status and we try again
-// on the next epoll_wait attempt
-if (tcpcount == cfg_SessionLimit) return(0);
+	local->netstream = session->querystream;
+	argList[(*argCount)++] = new ProxyMessage(local->mygrid,local->myslot);
+
+		// hand the batch to the query filter when the list is full
+		if (*argCount == BATCHLIMIT)
+		{
+		g_qfilter->PushBatch(argList,*argCount);
+		*argCount = 0;
+		}
+	}
 
-// create new network object and accept the inbound connection
-network = new netportal();
-memset(network,0,sizeof(struct netportal));
-len = sizeof(network->addr);
-network->sock = accept(argPortal->sock,(struct sockaddr *)&network->addr,&len);
+	// send the settings, window updates, and errors the session
+	// generated including the GOAWAY when the client broke the rules
+	tcplock.Acquire();
 
-	if (network->sock == -1)
+	if (session->outcount != 0)
 	{
-	g_log->LogMessage(LOG_WARNING,"Error %d returned from accept(%s)\n",errno,netface[argPortal->ifidx]);
-	delete(network);
-	return(0);
+	vec.iov_base = session->output;
+	vec.iov_len = session->outcount;
+	SendSession(argPortal,&vec,1);
+	session->outcount = 0;
 	}
 
-// extract the inbound address and do some logging
-inet_ntop(AF_INET,&network->addr.sin_addr,textaddr,sizeof(textaddr));
+tcplock.Release();
 
-g_log->LogMessage(LOG_DEBUG,"CLIENT CONNECT %s:%d from %s:%d\n",netface[argPortal->ifidx],cfg_ServerPort,textaddr,htons(network->addr.sin_port));
+if (ret < 0) return(-1);
+return(offset);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessTCPWrite(netportal *argPortal)
+{
+int		ret;
 
-// add the new network objet to the double linked list
-network->created = time(NULL);
-network->proto = IPPROTO_TCP;
-network->next = tcpactive;
-network->length = 0;
-network->next = NULL;
-network->last = NULL;
-if (tcpactive != NULL) tcpactive->last = network;
-tcpactive = network;
+// send everything that was waiting for the socket to drain
+tcplock.Acquire();
+ret = FlushSession(argPortal,NULL,0);
+UpdateSession(argPortal);
+tcplock.Release();
 
-// add the new socket to the epoll
-memset(&evt,0,sizeof(evt));
-evt.data.ptr = network;
-evt.events = EPOLLIN;
-ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,network->sock,&evt);
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessUDPQuery(netportal *argPortal)
+{
+ProxyEntry			*local;
+struct msghdr		msg;
+struct iovec		vec;
+int					size;
 
-	// unexpected error so spew a message and clear the running flag
-	if (ret != 0)
+// use the batched receive logic when enabled
+if (cfg_RecvBatch > 1) return(ProcessUDPBatch(argPortal));
+
+// grab the packet from the socket along with any control messages
+memset(&argPortal->addr,0,sizeof(argPortal->addr));
+memset(&msg,0,sizeof(msg));
+vec.iov_base = netbuffer;
+vec.iov_len = sizeof(netbuffer);
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+msg.msg_name = &argPortal->addr;
+msg.msg_namelen = sizeof(argPortal->addr);
+msg.msg_control = netcontrol;
+msg.msg_controllen = sizeof(netcontrol);
+size = recvmsg(argPortal->sock,&msg,MSG_DONTWAIT);
+
+	if (size < 0)
 	{
-	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(client)\n",errno);
-	running = 0;
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(-1);
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvmsg(%s)\n",errno,netface[argPortal->ifidx]);
+	return(0);
 	}
 
-// increment the count of active TCP sessions
-tcpcount++;
+g_recvcalls++;
+g_recvpackets++;
+
+// on the wildcard socket grab the address the query was sent to
+if (cfg_Wildcard != 0) argPortal->ifaddr = ExtractTarget(&msg);
+
+// count anything the kernel dropped because the socket was full
+check_dropcount(argPortal,&msg,g_clientdrops);
+
+// create the proxy entry and push to query filter queue
+local = InsertUDPQuery(argPortal,netbuffer,size);
+if (local == NULL) return(1);
+
+g_qfilter->PushMessage(new ProxyMessage(local->mygrid,local->myslot));
 
 return(1);
 }
 /*--------------------------------------------------------------------------*/
-int ClientNetwork::ProcessTCPQuery(netportal *argPortal)
+int ClientNetwork::ProcessUDPBatch(netportal *argPortal)
 {
+MessageFrame		*list[BATCHLIMIT];
 ProxyEntry			*local;
-unsigned short		prefix;
-void				*buffer;
-char				textaddr[32];
-char				temp[256];
-int					need,size,ret;
+int					count;
+int					ret,x;
 
-	// if we don't have the length yet we need to read that first
-	if (argPortal->length == 0)
+	// reset the address length and flags for every message in the batch
+	for(x = 0;x < cfg_RecvBatch;x++)
 	{
-	buffer = &prefix;
-	need = sizeof(prefix);
+	batchmsg[x].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	batchmsg[x].msg_hdr.msg_controllen = CTRLBUFFER;
+	batchmsg[x].msg_hdr.msg_flags = 0;
+	batchmsg[x].msg_len = 0;
 	}
 
-	// otherwise we know the length so now receive the data
-	else
+// grab as many packets as are waiting up to the batch limit
+ret = recvmmsg(argPortal->sock,batchmsg,cfg_RecvBatch,MSG_DONTWAIT,NULL);
+if (ret == 0) return(-1);
+
+	if (ret < 0)
 	{
-	buffer = netbuffer;
-	need = argPortal->length;
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(-1);
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvmmsg(%s)\n",errno,netface[argPortal->ifidx]);
+	return(0);
 	}
 
-// read the data from the socket
-size = recv(argPortal->sock,buffer,need,MSG_DONTWAIT);
+g_recvcalls++;
+g_recvpackets+=ret;
 
-	// if we don't get exactly what we need for any reason, shut it down
-	// this will pick up socket close and blatent protocol violations
-	if (size != need)
+count = 0;
+
+	for(x = 0;x < ret;x++)
 	{
-	RemoveSession(argPortal);
-	return(0);
+	// copy the source address where InsertQuery expects to find it
+	memcpy(&argPortal->addr,&batchaddr[x],sizeof(argPortal->addr));
+
+	// on the wildcard socket grab the address the query was sent to
+	if (cfg_Wildcard != 0) argPortal->ifaddr = ExtractTarget(&batchmsg[x].msg_hdr);
+
+	// count anything the kernel dropped because the socket was full
+	check_dropcount(argPortal,&batchmsg[x].msg_hdr,g_clientdrops);
+
+	// create the proxy entry and save the message for the batch
+	local = InsertUDPQuery(argPortal,(char *)batchvec[x].iov_base,batchmsg[x].msg_len);
+	if (local == NULL) continue;
+
+	list[count++] = new ProxyMessage(local->mygrid,local->myslot);
 	}
 
-	// if we just grabbed the length save it and return
-	if (argPortal->length == 0)
+// hand the entire batch to the query filter queue
+g_qfilter->PushBatch(list,count);
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::ProcessXDPQuery(int argLimit)
+{
+MessageFrame		*list[BATCHLIMIT];
+struct xdppacket	packet;
+ProxyEntry			*local;
+int					count,total;
+int					ret,x;
+
+if (argLimit > BATCHLIMIT) argLimit = BATCHLIMIT;
+count = total = 0;
+
+	// grab everything waiting in the receive ring up to the limit
+	while (total < argLimit)
 	{
-	// convert to host byte order
-	argPortal->length = ntohs(prefix);
-	return(1);
+	ret = xdp->GrabPacket(&packet);
+	if (ret == 0) break;
+	total++;
+
+		// the frame was malformed and has already been released
+		if (ret < 0)
+		{
+		g_xdpdrop++;
+		continue;
+		}
+
+	// find the interface index for the target address
+	for(x = 0;x < IPv4tot;x++) if ((netface[x][0] != 0) && (IPv4list[x] == packet.target)) break;
+
+		if (x == IPv4tot)
+		{
+		xdp->ReleasePacket(&packet);
+		g_xdpdrop++;
+		continue;
+		}
+
+	g_xdprecv++;
+	g_recvpackets++;
+
+	// copy the source address where InsertQuery expects to find it
+	memcpy(&xdpportal.addr,&packet.source,sizeof(xdpportal.addr));
+	xdpportal.ifaddr = packet.target;
+	xdpportal.ifidx = x;
+
+	// the query is copied so the frame goes back to the kernel right away
+	local = InsertUDPQuery(&xdpportal,packet.data,packet.size);
+	xdp->ReleasePacket(&packet);
+	if (local == NULL) continue;
+
+	// save the link addresses so the reply can go back the same way
+	memcpy(local->linkaddr,packet.linkaddr,sizeof(local->linkaddr));
+
+	list[count++] = new ProxyMessage(local->mygrid,local->myslot);
 	}
 
-// reset the length counter for the next iteration
-argPortal->length = 0;
+// hand the entire batch to the query filter queue
+g_qfilter->PushBatch(list,count);
+
+// let the caller know when the ring was already empty
+if (total == 0) return(-1);
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::DrainUDPSocket(netportal *argPortal)
+{
+int		total;
+int		ret;
+
+total = 0;
+
+	// keep reading until the socket is empty or we reach the fairness
+	// limit and count every pass so a socket error can't loop forever
+	while (total < cfg_DrainLimit)
+	{
+	if (argPortal == &xdpportal) ret = ProcessXDPQuery(cfg_DrainLimit - total);
+	else ret = ProcessUDPQuery(argPortal);
+	if (ret < 0) return(total);
+	total+=(ret > 0 ? ret : 1);
+	}
+
+	// with edge triggered epoll we won't get another event for data
+	// that is already waiting so we remember the socket and come
+	// back to it once everyone else has had a turn
+	if (argPortal->ready == 0)
+	{
+	argPortal->ready = 1;
+	readylist[readycount++] = argPortal;
+	g_draincapped++;
+	}
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void ClientNetwork::ProcessReadyList(void)
+{
+netportal	*list[SOCKLIMIT + 1];
+int			count,x;
+
+if (readycount == 0) return;
+
+// take the current list so a socket that hits the limit again
+// goes to the back of the line behind the new epoll events
+count = readycount;
+memcpy(list,readylist,count * sizeof(netportal *));
+readycount = 0;
+
+	for(x = 0;x < count;x++)
+	{
+	list[x]->ready = 0;
+	DrainUDPSocket(list[x]);
+	}
+}
+/*--------------------------------------------------------------------------*/
+ProxyEntry *ClientNetwork::InsertUDPQuery(netportal *argPortal,const char *argBuffer,int argSize)
+{
+ProxyEntry			*local;
+char				textaddr[32];
+char				temp[256];
+int					ret;
 
 // extract the inbound address and do some logging
 inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
 
 	if (cfg_LogClientBinary != 0)
 	{
-	sprintf(temp,"CLIENT TCP: %d bytes on %s:%d from %s:%d\n",size,netface[argPortal->ifidx],cfg_ServerPort,textaddr,htons(argPortal->addr.sin_port));
-	g_log->LogBinary(LOG_DEBUG,temp,netbuffer,size);
+	sprintf(temp,"CLIENT UDP: %d bytes on %s:%d from %s:%d\n",argSize,netface[argPortal->ifidx],cfg_ServerPort,textaddr,htons(argPortal->addr.sin_port));
+	g_log->LogBinary(LOG_DEBUG,temp,argBuffer,argSize);
+	}
+
+	// on the wildcard socket we ignore queries sent to filtered addresses
+	if ((cfg_Wildcard != 0) && (CheckNetFilter(argPortal->ifaddr) != 0))
+	{
+	g_log->LogMessage(LOG_DEBUG,"Ignoring UDP query from %s:%d to a filtered address\n",textaddr,htons(argPortal->addr.sin_port));
+	return(NULL);
 	}
 
 	// minimum size for a DNS query
-	if (size < 17)
+	if (argSize < 17)
 	{
-	g_log->LogMessage(LOG_WARNING,"Incomplete TCP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
-	RemoveSession(argPortal);
-	return(0);
+	g_log->LogMessage(LOG_WARNING,"Incomplete UDP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
+	return(NULL);
 	}
 
 // allocate a new proxy entry object and insert the query
 local = new ProxyEntry();
-ret = local->InsertQuery(netbuffer,size,argPortal);
+ret = local->InsertQuery(argBuffer,argSize,argPortal);
+local->netowner = this;
 
 	// some error occurred while parsing the query
 	if (ret == 0)
 	{
-	g_log->LogMessage(LOG_WARNING,"Invalid TCP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
+	g_log->LogMessage(LOG_WARNING,"Invalid UDP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
 	delete(local);
-	return(0);
+	return(NULL);
 	}
 
 g_clientcount++;
 
-// add the query to the proxy table and push to query filter queue
+// add the query to the proxy table
 g_table->InsertObject(local);
-g_log->LogMessage(LOG_DEBUG,"ClientNetwork created index %hu-%hu\n",local->mygrid,local->myslot);
-g_qfilter->PushMessage(new ProxyMessage(local->mygrid,local->myslot));
+g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d created index %hu-%hu\n",ThreadNumber,local->mygrid,local->myslot);
 
-return(size);
+return(local);
 }
 /*--------------------------------------------------------------------------*/
-int ClientNetwork::ProcessUDPQuery(netportal *argPortal)
+ProxyEntry *ClientNetwork::InsertTCPQuery(netportal *argPortal,const char *argBuffer,int argSize)
 {
 ProxyEntry			*local;
-unsigned int		len;
 char				textaddr[32];
 char				temp[256];
-int					size,ret;
-
-// grab the packet from the socket
-memset(&argPortal->addr,0,sizeof(argPortal->addr));
-len = sizeof(argPortal->addr);
-size = recvfrom(argPortal->sock,netbuffer,sizeof(netbuffer),0,(struct sockaddr *)&argPortal->addr,&len);
-if (size == 0) return(0);
-
-	if (size < 0)
-	{
-	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvfrom(%s)\n",errno,netface[argPortal->ifidx]);
-	return(0);
-	}
+int					ret;
 
 // extract the inbound address and do some logging
 inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
 
 	if (cfg_LogClientBinary != 0)
 	{
-	sprintf(temp,"CLIENT UDP: %d bytes on %s:%d from %s:%d\n",size,netface[argPortal->ifidx],cfg_ServerPort,textaddr,htons(argPortal->addr.sin_port));
-	g_log->LogBinary(LOG_DEBUG,temp,netbuffer,size);
+	sprintf(temp,"CLIENT TCP: %d bytes on %s:%d from %s:%d\n",argSize,netface[argPortal->ifidx],cfg_ServerPort,textaddr,htons(argPortal->addr.sin_port));
+	g_log->LogBinary(LOG_DEBUG,temp,argBuffer,argSize);
 	}
 
 	// minimum size for a DNS query
-	if (size < 17)
+	if (argSize < 17)
 	{
-	g_log->LogMessage(LOG_WARNING,"Incomplete UDP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
-	return(0);
+	g_log->LogMessage(LOG_WARNING,"Incomplete TCP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
+	return(NULL);
 	}
 
 // allocate a new proxy entry object and insert the query
 local = new ProxyEntry();
-ret = local->InsertQuery(netbuffer,size,argPortal);
+ret = local->InsertQuery(argBuffer,argSize,argPortal);
+local->netowner = this;
 
 	// some error occurred while parsing the query
 	if (ret == 0)
 	{
-	g_log->LogMessage(LOG_WARNING,"Invalid UDP query received on %s from %s:%d\n",netface[argPortal->ifidx],netface,htons(argPortal->addr.sin_port));
+	g_log->LogMessage(LOG_WARNING,"Invalid TCP query received on %s from %s:%d\n",netface[argPortal->ifidx],textaddr,htons(argPortal->addr.sin_port));
 	delete(local);
-	return(0);
+	return(NULL);
 	}
 
 g_clientcount++;
 
-// add the query to the proxy table and push to query filter queue
+// add the query to the proxy table
 g_table->InsertObject(local);
-g_log->LogMessage(LOG_DEBUG,"ClientNetwork created index %hu-%hu\n",local->mygrid,local->myslot);
-g_qfilter->PushMessage(new ProxyMessage(local->mygrid,local->myslot));
+g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d created index %hu-%hu\n",ThreadNumber,local->mygrid,local->myslot);
 
-return(size);
+return(local);
 }
 /*--------------------------------------------------------------------------*/
 int ClientNetwork::ForwardTCPReply(ProxyEntry *argEntry)
 {
+struct iovec		vec[2];
 unsigned short		*qid;
 unsigned short		prefix;
-int					total;
+netportal			*portal;
 int					ret;
 
-// copy the packet size into the socket buffer
+// replace the inbound reply id with the original client query id
+qid = (unsigned short *)&argEntry->rawreply[0];
+*qid = htons(argEntry->q_header.qid);
+
+// the reply goes out with the length in front
 prefix = htons(argEntry->rawrsize);
-memcpy(&netbuffer[0],&prefix,sizeof(prefix));
-total = sizeof(prefix);
+vec[0].iov_base = &prefix;
+vec[0].iov_len = sizeof(prefix);
+vec[1].iov_base = argEntry->rawreply;
+vec[1].iov_len = argEntry->rawrsize;
 
-// copy the raw reply into the socket buffer
-memcpy(&netbuffer[total],argEntry->rawreply,argEntry->rawrsize);
-total+=argEntry->rawrsize;
+tcplock.Acquire();
 
-// replace the inbound reply id with the original client query id
-qid = (unsigned short *)&netbuffer[2];
-*qid = htons(argEntry->q_header.qid);
+// make sure the session that sent the query is still connected since
+// the socket may have been closed and even reused while we were busy
+portal = tcptable[argEntry->netsession];
+
+	if ((portal == NULL) || (portal->serial != argEntry->netserial))
+	{
+	tcplock.Release();
+	g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d TCP session closed for index %hu-%hu\n",ThreadNumber,argEntry->mygrid,argEntry->myslot);
+	return(-1);
+	}
+
+	// on HTTP/2 sessions the reply goes out as a response on the stream
+	// that carried the query instead of with the length in front
+	if (portal->doh != NULL)
+	{
+	portal->doh->InsertReply(argEntry->netstream,argEntry->rawreply,argEntry->rawrsize);
+
+		if (portal->doh->outcount == 0)
+		{
+		tcplock.Release();
+		g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d HTTPS stream closed for index %hu-%hu\n",ThreadNumber,argEntry->mygrid,argEntry->myslot);
+		return(-1);
+		}
+
+	vec[0].iov_base = portal->doh->output;
+	vec[0].iov_len = portal->doh->outcount;
+	ret = SendSession(portal,vec,1);
+	portal->doh->outcount = 0;
+	}
 
-// forward the reply to the original client
-ret+=send(argEntry->netsocket,netbuffer,total,MSG_DONTWAIT);
+	else
+	{
+	ret = SendSession(portal,vec,2);
+	}
+
+tcplock.Release();
+
+g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d TCP returned index %hu-%hu\n",ThreadNumber,argEntry->mygrid,argEntry->myslot);
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ClientNetwork::SendSession(netportal *argPortal,struct iovec *argList,int argCount)
+{
+int		ret,x;
+
+	// the caller must hold the tcplock and when the socket is already
+	// full we just add the data to the queue and it goes out with the
+	// rest once the socket drains
+	if (argPortal->events & EPOLLOUT)
+	{
+	for(x = 0;x < argCount;x++) AppendSession(argPortal,(char *)argList[x].iov_base,argList[x].iov_len);
+	ret = 0;
+	}
+
+	// otherwise we send it right away along with anything waiting
+	else
+	{
+	ret = FlushSession(argPortal,argList,argCount);
+	}
 
-g_log->LogMessage(LOG_DEBUG,"ClientNetwork TCP returned index %hu-%hu\n",argEntry->mygrid,argEntry->myslot);
+if (argPortal->outcount != 0) g_tcpqueued++;
+UpdateSession(argPortal);
 
 return(ret);
 }
 /*--------------------------------------------------------------------------*/
 int ClientNetwork::ForwardUDPReply(ProxyEntry *argEntry)
 {
-unsigned short	*qid;
-int				ret;
+struct in_pktinfo	*info;
+struct cmsghdr		*cmsg;
+struct msghdr		msg;
+struct iovec		vec;
+unsigned short		*qid;
+unsigned int		source;
+char				temp[CTRLBUFFER];
+int					ret;
 
 // replace the inbound reply id with the original client query id
 qid = (unsigned short *)&argEntry->rawreply[0];
 *qid = htons(argEntry->q_header.qid);
 
 // now forward the reply to the original client
-g_log->LogMessage(LOG_DEBUG,"ClientNetwork UDP returned index %hu-%hu\n",argEntry->mygrid,argEntry->myslot);
-ret = sendto(argEntry->netsocket,argEntry->rawreply,argEntry->rawrsize,0,(sockaddr *)&argEntry->origin,sizeof(argEntry->origin));
+g_log->LogMessage(LOG_DEBUG,"ClientNetwork %d UDP returned index %hu-%hu\n",ThreadNumber,argEntry->mygrid,argEntry->myslot);
+
+	// queries received on the XDP socket are answered on the XDP transmit
+	// ring and anything it can't handle goes out the interface socket
+	if ((xdp != NULL) && (argEntry->netsocket == xdpportal.sock))
+	{
+	ret = xdp->TransmitPacket(argEntry->rawreply,argEntry->rawrsize,&argEntry->origin,argEntry->netlocal,argEntry->linkaddr);
+	if (ret >= 0) return(ret);
+	argEntry->netsocket = udplisten[argEntry->netindex].sock;
+	}
+
+	// the client would ignore a reply from a different address than the
+	// one it asked so when the slot now has another address we drop it
+	if ((cfg_Wildcard == 0) && (udplisten[argEntry->netindex].ifaddr != argEntry->netlocal))
+	{
+	g_stalereplies++;
+	return(0);
+	}
+
+// on the wildcard socket we reply from the address the query was sent to
+source = (cfg_Wildcard != 0 ? argEntry->netlocal : 0);
+
+	// when batching queue the reply on the socket that received the query
+	if ((argEntry->netindex < udpcount) && (udpbatch[argEntry->netindex] != NULL))
+	{
+	ret = udpbatch[argEntry->netindex]->InsertPacket(argEntry->rawreply,argEntry->rawrsize,&argEntry->origin,source);
+	return(ret);
+	}
+
+memset(&msg,0,sizeof(msg));
+vec.iov_base = argEntry->rawreply;
+vec.iov_len = argEntry->rawrsize;
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+msg.msg_name = &argEntry->origin;
+msg.msg_namelen = sizeof(argEntry->origin);
+
+	// attach the source address with IP_PKTINFO
+	if (source != 0)
+	{
+	memset(temp,0,sizeof(temp));
+	msg.msg_control = temp;
+	msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type = IP_PKTINFO;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+	info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+	info->ipi_spec_dst.s_addr = source;
+	}
+
+ret = sendmsg(argEntry->netsocket,&msg,0);
+g_sendcalls++;
+g_sendpackets++;
 
 return(ret);
 }
 /*--------------------------------------------------------------------------*/
+int ClientNetwork::FlushReplies(int argDelay)
+{
+int		total;
+int		x;
+
+total = 0;
+
+	// transmit any replies queued on our UDP sockets
+	for(x = 0;x < udpcount;x++)
+	{
+	if (udpbatch[x] == NULL) continue;
+	total+=udpbatch[x]->FlushBatch(argDelay);
+	}
+
+// the XDP transmit ring doesn't track how long replies have waited
+if (xdp != NULL) total+=xdp->FlushTransmit();
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
 
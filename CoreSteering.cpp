@@ -0,0 +1,317 @@
+// CoreSteering.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The CoreSteering class keeps each client query on the CPU that
+	received it when there are multiple client network threads.  Each
+	thread is pinned to its own core, and every group of SO_REUSEPORT
+	UDP sockets bound to the same address gets a small BPF program and
+	a socket array holding the socket of each thread at the index of
+	that thread.  The program picks the socket for the CPU handling
+	the packet so the receive, filter, and reply work all stay in the
+	same core caches instead of being spread by the flow hash.  When
+	the selected slot is empty the kernel falls back to the hash.  A
+	per-CPU counter map records how many packets were steered to the
+	thread on the same core and how many landed somewhere else, and
+	the counters for each core are logged at shutdown.  Like the XDP
+	program everything is built with the raw bpf system call.
+*/
+
+#ifdef HAVE_REUSEPORT_EBPF
+
+const int STEERLOCAL = 0;			// counter index for packets kept on the core
+const int STEERREMOTE = 1;			// counter index for packets sent elsewhere
+
+/*--------------------------------------------------------------------------*/
+CoreSteering::CoreSteering(int argThreads)
+{
+threads = argThreads;
+grouplist = (struct steergroup *)calloc(SOCKLIMIT,sizeof(struct steergroup));
+groupcount = 0;
+program = NULL;
+proglen = 0;
+cpucount = 0;
+statmap = -1;
+}
+/*--------------------------------------------------------------------------*/
+CoreSteering::~CoreSteering(void)
+{
+int		x;
+
+	for(x = 0;x < groupcount;x++)
+	{
+	if (grouplist[x].progsock >= 0) close(grouplist[x].progsock);
+	if (grouplist[x].mapsock >= 0) close(grouplist[x].mapsock);
+	}
+
+if (statmap >= 0) close(statmap);
+if (program != NULL) free(program);
+free(grouplist);
+}
+/*--------------------------------------------------------------------------*/
+int CoreSteering::Startup(void)
+{
+union bpf_attr		attr;
+FILE				*stream;
+int					first,last;
+
+// the per-CPU map values come back for every possible CPU so we need
+// the real count and not just the number that happen to be online
+first = last = 0;
+stream = fopen("/sys/devices/system/cpu/possible","r");
+
+	if (stream != NULL)
+	{
+	if (fscanf(stream,"%d-%d",&first,&last) < 2) last = first;
+	fclose(stream);
+	}
+
+cpucount = (last + 1);
+
+// create the map that counts local and remote packets on each CPU
+memset(&attr,0,sizeof(attr));
+attr.map_type = BPF_MAP_TYPE_PERCPU_ARRAY;
+attr.key_size = sizeof(unsigned int);
+attr.value_size = sizeof(unsigned long long);
+attr.max_entries = 2;
+statmap = syscall(__NR_bpf,BPF_MAP_CREATE,&attr,sizeof(attr));
+
+	if (statmap < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_CREATE PERCPU_ARRAY)\n",errno);
+	return(0);
+	}
+
+program = (struct bpf_insn *)calloc(64,sizeof(struct bpf_insn));
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int CoreSteering::AttachSocket(unsigned int argAddr,int argIndex,int argSock)
+{
+struct steergroup	*group;
+union bpf_attr		attr;
+unsigned int		key;
+unsigned long long	value;
+int					ret,x;
+
+control.Acquire();
+
+// find the group for the address or create one the first time any
+// of the client threads binds a socket to that address
+group = NULL;
+for(x = 0;x < groupcount;x++) if (grouplist[x].addr == argAddr) group = &grouplist[x];
+
+	if ((group == NULL) && (groupcount < SOCKLIMIT))
+	{
+	group = &grouplist[groupcount];
+	group->addr = argAddr;
+	group->mapsock = -1;
+	group->progsock = -1;
+
+	memset(&attr,0,sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+	attr.key_size = sizeof(unsigned int);
+	attr.value_size = sizeof(unsigned long long);
+	attr.max_entries = threads;
+	group->mapsock = syscall(__NR_bpf,BPF_MAP_CREATE,&attr,sizeof(attr));
+
+		if (group->mapsock < 0)
+		{
+		g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_CREATE REUSEPORT_SOCKARRAY)\n",errno);
+		control.Release();
+		return(0);
+		}
+
+	group->progsock = LoadProgram(group->mapsock);
+
+		if (group->progsock < 0)
+		{
+		close(group->mapsock);
+		control.Release();
+		return(0);
+		}
+
+	groupcount++;
+	}
+
+	if (group == NULL)
+	{
+	control.Release();
+	return(0);
+	}
+
+// put the socket in the slot for the thread that owns it
+key = argIndex;
+value = argSock;
+memset(&attr,0,sizeof(attr));
+attr.map_fd = group->mapsock;
+attr.key = (unsigned long)&key;
+attr.value = (unsigned long)&value;
+attr.flags = BPF_ANY;
+ret = syscall(__NR_bpf,BPF_MAP_UPDATE_ELEM,&attr,sizeof(attr));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_UPDATE_ELEM REUSEPORT_SOCKARRAY)\n",errno);
+	control.Release();
+	return(0);
+	}
+
+// attaching to any socket in the group sets the program for all of them
+ret = setsockopt(argSock,SOL_SOCKET,SO_ATTACH_REUSEPORT_EBPF,&group->progsock,sizeof(group->progsock));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(SO_ATTACH_REUSEPORT_EBPF)\n",errno);
+	control.Release();
+	return(0);
+	}
+
+control.Release();
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void CoreSteering::ReportCounters(void)
+{
+union bpf_attr		attr;
+unsigned long long	*local,*remote;
+unsigned int		key;
+int					x;
+
+local = (unsigned long long *)calloc(cpucount,sizeof(unsigned long long));
+remote = (unsigned long long *)calloc(cpucount,sizeof(unsigned long long));
+
+key = STEERLOCAL;
+memset(&attr,0,sizeof(attr));
+attr.map_fd = statmap;
+attr.key = (unsigned long)&key;
+attr.value = (unsigned long)local;
+syscall(__NR_bpf,BPF_MAP_LOOKUP_ELEM,&attr,sizeof(attr));
+
+key = STEERREMOTE;
+attr.value = (unsigned long)remote;
+syscall(__NR_bpf,BPF_MAP_LOOKUP_ELEM,&attr,sizeof(attr));
+
+	for(x = 0;x < cpucount;x++)
+	{
+	if ((local[x] == 0) && (remote[x] == 0)) continue;
+	g_log->LogMessage(LOG_INFO,"CORE:%d  STEERLOCAL:%llu  STEERREMOTE:%llu\n",x,local[x],remote[x]);
+	}
+
+free(local);
+free(remote);
+}
+/*--------------------------------------------------------------------------*/
+int CoreSteering::LoadProgram(int argMap)
+{
+union bpf_attr		attr;
+char				*logbuff;
+int					progsock;
+
+proglen = 0;
+
+// save the context and get the CPU handling the packet
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_6,BPF_REG_1,0,0);
+AddInstruction(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_get_smp_processor_id);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_7,BPF_REG_0,0,0);
+
+// select the socket of the thread for that CPU from the socket array
+AddInstruction(BPF_ALU | BPF_MOD | BPF_K,BPF_REG_0,0,0,threads);
+AddInstruction(BPF_STX | BPF_MEM | BPF_W,BPF_REG_10,BPF_REG_0,-4,0);
+AddInstruction(BPF_LD | BPF_DW | BPF_IMM,BPF_REG_2,BPF_PSEUDO_MAP_FD,0,argMap);
+AddInstruction(0,0,0,0,0);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_3,BPF_REG_10,0,0);
+AddInstruction(BPF_ALU64 | BPF_ADD | BPF_K,BPF_REG_3,0,0,-4);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_1,BPF_REG_6,0,0);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_4,0,0,0);
+AddInstruction(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_sk_select_reuseport);
+
+// the packet stayed local if the select worked and the thread for
+// the slot is pinned to the same CPU which is only true for CPUs
+// with a number below the thread count
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_8,0,0,STEERREMOTE);
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_0,0,2,0);
+AddInstruction(BPF_JMP | BPF_JGE | BPF_K,BPF_REG_7,0,1,threads);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_8,0,0,STEERLOCAL);
+
+// bump the counter in the per-CPU map
+AddInstruction(BPF_STX | BPF_MEM | BPF_W,BPF_REG_10,BPF_REG_8,-8,0);
+AddInstruction(BPF_LD | BPF_DW | BPF_IMM,BPF_REG_1,BPF_PSEUDO_MAP_FD,0,statmap);
+AddInstruction(0,0,0,0,0);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_2,BPF_REG_10,0,0);
+AddInstruction(BPF_ALU64 | BPF_ADD | BPF_K,BPF_REG_2,0,0,-8);
+AddInstruction(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_map_lookup_elem);
+AddInstruction(BPF_JMP | BPF_JEQ | BPF_K,BPF_REG_0,0,3,0);
+AddInstruction(BPF_LDX | BPF_MEM | BPF_DW,BPF_REG_1,BPF_REG_0,0,0);
+AddInstruction(BPF_ALU64 | BPF_ADD | BPF_K,BPF_REG_1,0,0,1);
+AddInstruction(BPF_STX | BPF_MEM | BPF_DW,BPF_REG_0,BPF_REG_1,0,0);
+
+// always let the packet through whether we picked a socket or not
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_0,0,0,SK_PASS);
+AddInstruction(BPF_JMP | BPF_EXIT,0,0,0,0);
+
+logbuff = (char *)calloc(1,0x10000);
+
+memset(&attr,0,sizeof(attr));
+attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+attr.insns = (unsigned long)program;
+attr.insn_cnt = proglen;
+attr.license = (unsigned long)"GPL";
+attr.log_buf = (unsigned long)logbuff;
+attr.log_size = 0x10000;
+attr.log_level = 1;
+progsock = syscall(__NR_bpf,BPF_PROG_LOAD,&attr,sizeof(attr));
+
+	if (progsock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_PROG_LOAD SK_REUSEPORT)\n",errno);
+	g_log->LogMessage(LOG_ERR,"%s\n",logbuff);
+	}
+
+free(logbuff);
+
+return(progsock);
+}
+/*--------------------------------------------------------------------------*/
+void CoreSteering::AddInstruction(int argCode,int argDst,int argSrc,int argOff,int argImm)
+{
+program[proglen].code = argCode;
+program[proglen].dst_reg = argDst;
+program[proglen].src_reg = argSrc;
+program[proglen].off = argOff;
+program[proglen].imm = argImm;
+proglen++;
+}
+/*--------------------------------------------------------------------------*/
+
+#else
+
+/*--------------------------------------------------------------------------*/
+CoreSteering::CoreSteering(int argThreads)
+{
+threads = argThreads;
+}
+/*--------------------------------------------------------------------------*/
+CoreSteering::~CoreSteering(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+int CoreSteering::Startup(void)
+{
+g_log->LogMessage(LOG_ERR,"This build does not include reuseport steering support\n");
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int CoreSteering::AttachSocket(unsigned int argAddr,int argIndex,int argSock)	{ return(0); }
+void CoreSteering::ReportCounters(void)										{ }
+/*--------------------------------------------------------------------------*/
+
+#endif
+
@@ -0,0 +1,1067 @@
+// DohSession.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The DohSession class handles the HTTP/2 protocol for one DNS over
+	HTTPS client connection.  The client network reads the decrypted
+	stream into the session buffer and hands it to ProcessInput which
+	works through the frames until a query is complete, and then
+	returns with the query so it can be inserted in the ProxyTable
+	the same way as any other TCP query before it comes back for the
+	next one.  Every stream is a separate query so a client can have
+	as many in flight as we allow in the settings and each answer is
+	sent on its stream as soon as it is ready.  GET queries are base64
+	decoded from the path into the scratch buffer used for the header
+	block, and a POST body that arrives in a single DATA frame is used
+	right where it was read, so the only copy of the query is the one
+	made for the ProxyEntry.  The HPACK decoder keeps the dynamic table
+	the client builds up, but our responses only use the static table
+	so we never have to track a table on the client side.  Anything we
+	need to send is added to the output buffer which the caller moves
+	to the socket.  The caller holds the session lock for every call
+	since replies are added from the filter threads.
+*/
+
+const int DOHPREFACE = 24;			// length of the client connection preface
+const int DOHHEADER = 9;			// length of the HTTP/2 frame header
+const int DOHBLOCK = 0x10000;		// largest header block we will assemble
+const int DOHWINDOW = 65535;		// initial flow control window
+const int DOHTABLE = 4096;			// size of the HPACK dynamic table
+
+const int FRAME_DATA = 0x0;
+const int FRAME_HEADERS = 0x1;
+const int FRAME_PRIORITY = 0x2;
+const int FRAME_RST_STREAM = 0x3;
+const int FRAME_SETTINGS = 0x4;
+const int FRAME_PUSH_PROMISE = 0x5;
+const int FRAME_PING = 0x6;
+const int FRAME_GOAWAY = 0x7;
+const int FRAME_WINDOW_UPDATE = 0x8;
+const int FRAME_CONTINUATION = 0x9;
+
+const int FLAG_END_STREAM = 0x1;
+const int FLAG_ACK = 0x1;
+const int FLAG_END_HEADERS = 0x4;
+const int FLAG_PADDED = 0x8;
+const int FLAG_PRIORITY = 0x20;
+
+const int ERROR_PROTOCOL = 0x1;
+const int ERROR_FLOW_CONTROL = 0x3;
+const int ERROR_STREAM_CLOSED = 0x5;
+const int ERROR_FRAME_SIZE = 0x6;
+const int ERROR_REFUSED_STREAM = 0x7;
+const int ERROR_COMPRESSION = 0x9;
+
+const int SETTING_MAX_CONCURRENT_STREAMS = 0x3;
+const int SETTING_INITIAL_WINDOW_SIZE = 0x4;
+const int SETTING_MAX_FRAME_SIZE = 0x5;
+
+const int STREAM_OPEN = 1;			// receiving the request
+const int STREAM_WAIT = 2;			// query is waiting for the reply
+const int STREAM_SEND = 3;			// reply is waiting for the window
+
+const int METHOD_GET = 1;
+const int METHOD_POST = 2;
+const int METHOD_OTHER = 3;
+
+const char *DOHMESSAGE = "application/dns-message";
+
+// the HPACK static table from RFC 7541 appendix A
+const char *staticname[62] = { "",
+	":authority",":method",":method",":path",":path",":scheme",":scheme",":status",
+	":status",":status",":status",":status",":status",":status","accept-charset","accept-encoding",
+	"accept-language","accept-ranges","accept","access-control-allow-origin","age","allow","authorization","cache-control",
+	"content-disposition","content-encoding","content-language","content-length","content-location","content-range","content-type","cookie",
+	"date","etag","expect","expires","from","host","if-match","if-modified-since",
+	"if-none-match","if-range","if-unmodified-since","last-modified","link","location","max-forwards","proxy-authenticate",
+	"proxy-authorization","range","referer","refresh","retry-after","server","set-cookie","strict-transport-security",
+	"transfer-encoding","user-agent","vary","via","www-authenticate"
+	};
+
+const char *staticvalue[62] = { "",
+	"","GET","POST","/","/index.html","http","https","200",
+	"204","206","304","400","404","500","","gzip, deflate"
+	};
+
+// the first code, number of codes, and first symbol for each code length of
+// the canonical HPACK Huffman code from RFC 7541 appendix B
+const unsigned int huffmanfirst[31] = {
+	0x0,0x0,0x0,0x0,0x0,0x0,0x14,0x5C,
+	0xF8,0x0,0x3F8,0x7FA,0xFFA,0x1FF8,0x3FFC,0x7FFC,
+	0x0,0x0,0x0,0x7FFF0,0xFFFE6,0x1FFFDC,0x3FFFD2,0x7FFFD8,
+	0xFFFFEA,0x1FFFFEC,0x3FFFFE0,0x7FFFFDE,0xFFFFFE2,0x0,0x3FFFFFFC
+	};
+
+const unsigned short huffmancount[31] = {
+	0,0,0,0,0,10,26,32,6,0,5,3,2,6,2,3,
+	0,0,0,3,8,13,26,29,12,4,15,19,29,0,4
+	};
+
+const unsigned short huffmanindex[31] = {
+	0,0,0,0,0,0,10,36,68,0,74,79,82,84,90,92,
+	0,0,0,95,98,106,119,145,174,186,190,205,224,0,253
+	};
+
+// the symbols sorted by code length and value
+const unsigned short huffmansymbol[257] = {
+	48,49,50,97,99,101,105,111,115,116,32,37,45,46,47,51,
+	52,53,54,55,56,57,61,65,95,98,100,102,103,104,108,109,
+	110,112,114,117,58,66,67,68,69,70,71,72,73,74,75,76,
+	77,78,79,80,81,82,83,84,85,86,87,89,106,107,113,118,
+	119,120,121,122,38,42,44,59,88,90,33,34,40,41,63,39,
+	43,124,35,62,0,36,64,91,93,126,94,125,60,96,123,92,
+	195,208,128,130,131,162,184,194,224,226,153,161,167,172,176,177,
+	179,209,216,217,227,229,230,129,132,133,134,136,146,154,156,160,
+	163,164,169,170,173,178,181,185,186,187,189,190,196,198,228,232,
+	233,1,135,137,138,139,140,141,143,147,149,150,151,152,155,157,
+	158,165,166,168,174,175,180,182,183,188,191,197,231,239,9,142,
+	144,145,148,159,171,206,215,225,236,237,199,207,234,235,192,193,
+	200,201,202,205,210,213,218,219,238,240,242,243,255,203,204,211,
+	212,214,221,222,223,241,244,245,246,247,248,250,251,252,253,254,
+	2,3,4,5,6,7,8,11,12,14,15,16,17,18,19,20,
+	21,23,24,25,26,27,28,29,30,31,127,220,249,10,13,22,
+	256
+	};
+/*--------------------------------------------------------------------------*/
+DohSession::DohSession(int argStreams)
+{
+streamcount = argStreams;
+streamlist = (dohstream *)calloc(streamcount,sizeof(dohstream));
+
+memset(tablelist,0,sizeof(tablelist));
+tablehead = 0;
+tablecount = 0;
+tablesize = 0;
+tablelimit = DOHTABLE;
+
+scratch = NULL;
+scratchsize = 0;
+scratchused = 0;
+block = NULL;
+blocksize = 0;
+
+output = NULL;
+outcount = 0;
+outsize = 0;
+
+query = NULL;
+querysize = 0;
+querystream = 0;
+
+laststream = 0;
+sendwindow = DOHWINDOW;
+peerwindow = DOHWINDOW;
+peerframe = DOHFRAME;
+recvcount = 0;
+preface = 0;
+}
+/*--------------------------------------------------------------------------*/
+DohSession::~DohSession(void)
+{
+int		x;
+
+for(x = 0;x < streamcount;x++) if (streamlist[x].id != 0) CloseStream(&streamlist[x]);
+for(x = 0;x < tablecount;x++) free(tablelist[(tablehead + x) % HPACKLIMIT].name);
+
+free(streamlist);
+if (scratch != NULL) free(scratch);
+if (block != NULL) free(block);
+if (output != NULL) free(output);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::ProcessInput(char *argBuffer,int argSize)
+{
+unsigned char	*data;
+unsigned int	stream;
+int				length,total;
+int				offset,ret;
+
+query = NULL;
+querysize = 0;
+querystream = 0;
+
+	// the client starts with a fixed preface and we answer with our
+	// settings before anything else is sent
+	if (preface == 0)
+	{
+	if (argSize < DOHPREFACE) return(0);
+	if (memcmp(argBuffer,"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",DOHPREFACE) != 0) return(GoAway(ERROR_PROTOCOL));
+	SendSettings();
+	preface = 1;
+	return(DOHPREFACE);
+	}
+
+offset = 0;
+
+	// stop after a complete query so the caller can insert it before
+	// the scratch space it points to is used for the next one
+	while (((argSize - offset) >= DOHHEADER) && (query == NULL))
+	{
+	data = (unsigned char *)&argBuffer[offset];
+	length = ((data[0] << 16) | (data[1] << 8) | data[2]);
+	stream = (ntohl(*(unsigned int *)&data[5]) & 0x7FFFFFFF);
+
+	if (length > DOHFRAME) return(GoAway(ERROR_FRAME_SIZE));
+	if ((argSize - offset - DOHHEADER) < length) break;
+
+		// a header block split across continuation frames is only
+		// handled once every piece of it has arrived
+		if ((data[3] == FRAME_HEADERS) && ((data[4] & FLAG_END_HEADERS) == 0))
+		{
+		total = CollectBlock(&argBuffer[offset],argSize - offset);
+		if (total < 0) return(GoAway(ERROR_PROTOCOL));
+		if (total == 0) break;
+		ret = ProcessHeaders(data[4] & ~(FLAG_PADDED | FLAG_PRIORITY),stream,block,blocksize);
+		if (ret < 0) return(-1);
+		offset+=total;
+		continue;
+		}
+
+	ret = ProcessFrame(data[3],data[4],stream,&argBuffer[offset + DOHHEADER],length);
+	if (ret < 0) return(-1);
+	offset+=(DOHHEADER + length);
+	}
+
+	// give back the connection window used by the request bodies
+	if (recvcount != 0)
+	{
+	SendWindow(0,recvcount);
+	recvcount = 0;
+	}
+
+return(offset);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::InsertReply(unsigned int argStream,const char *argReply,int argSize)
+{
+dohstream		*local;
+unsigned char	buffer[64];
+char			text[16];
+int				len,sent;
+
+// the client may have reset the stream while we were busy
+local = FindStream(argStream);
+if ((local == NULL) || (local->state != STREAM_WAIT)) return(0);
+
+// status 200 is in the static table and the content headers are
+// sent as literals using the static table names
+len = 0;
+buffer[len++] = 0x88;
+len+=EncodeLiteral(&buffer[len],31,DOHMESSAGE,strlen(DOHMESSAGE));
+len+=EncodeLiteral(&buffer[len],28,text,sprintf(text,"%d",argSize));
+
+AppendFrame(FRAME_HEADERS,FLAG_END_HEADERS,argStream,(char *)buffer,len);
+
+// send what the flow control windows allow and keep the rest
+local->state = STREAM_SEND;
+sent = SendData(local,argReply,argSize);
+
+	if (sent < argSize)
+	{
+	local->pending = (char *)malloc(argSize - sent);
+	memcpy(local->pending,&argReply[sent],argSize - sent);
+	local->pendsize = (argSize - sent);
+	local->pendsent = 0;
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::InsertStatus(unsigned int argStream,int argStatus)
+{
+dohstream		*local;
+unsigned char	buffer[16];
+char			text[8];
+int				len;
+
+len = 0;
+
+// use the static table entry when there is one for the status
+if (argStatus == 400) buffer[len++] = 0x8C;
+else if (argStatus == 404) buffer[len++] = 0x8D;
+else if (argStatus == 500) buffer[len++] = 0x8E;
+else len+=EncodeLiteral(&buffer[len],8,text,sprintf(text,"%d",argStatus));
+
+AppendFrame(FRAME_HEADERS,FLAG_END_HEADERS | FLAG_END_STREAM,argStream,(char *)buffer,len);
+
+local = FindStream(argStream);
+if (local != NULL) CloseStream(local);
+
+g_dohrejected++;
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::ProcessFrame(int argType,int argFlags,unsigned int argStream,char *argData,int argSize)
+{
+dohstream		*local;
+unsigned char	*data;
+unsigned int	value;
+int				delta,ret,x;
+
+data = (unsigned char *)argData;
+
+	switch(argType)
+	{
+	case FRAME_DATA:
+		return(ProcessData(argFlags,argStream,argData,argSize));
+
+	case FRAME_HEADERS:
+		return(ProcessHeaders(argFlags,argStream,argData,argSize));
+
+	case FRAME_PRIORITY:
+		if (argSize != 5) return(GoAway(ERROR_FRAME_SIZE));
+		return(0);
+
+	case FRAME_RST_STREAM:
+		if (argSize != 4) return(GoAway(ERROR_FRAME_SIZE));
+		local = FindStream(argStream);
+		if (local != NULL) CloseStream(local);
+		return(0);
+
+	case FRAME_SETTINGS:
+		if (argStream != 0) return(GoAway(ERROR_PROTOCOL));
+		if (argFlags & FLAG_ACK) return(0);
+		if ((argSize % 6) != 0) return(GoAway(ERROR_FRAME_SIZE));
+
+		for(x = 0;x < argSize;x+=6)
+		{
+		value = ntohl(*(unsigned int *)&data[x + 2]);
+
+			// a new initial window changes every open stream by the
+			// difference and may let waiting replies go out
+			if (ntohs(*(unsigned short *)&data[x]) == SETTING_INITIAL_WINDOW_SIZE)
+			{
+			if (value > 0x7FFFFFFF) return(GoAway(ERROR_FLOW_CONTROL));
+			delta = ((int)value - peerwindow);
+			peerwindow = value;
+			for(ret = 0;ret < streamcount;ret++) if (streamlist[ret].id != 0) streamlist[ret].window+=delta;
+			}
+
+			if (ntohs(*(unsigned short *)&data[x]) == SETTING_MAX_FRAME_SIZE)
+			{
+			if ((value < DOHFRAME) || (value > 0xFFFFFF)) return(GoAway(ERROR_PROTOCOL));
+			peerframe = value;
+			}
+		}
+
+		AppendFrame(FRAME_SETTINGS,FLAG_ACK,0,NULL,0);
+		SendPending(NULL);
+		return(0);
+
+	case FRAME_PING:
+		if (argStream != 0) return(GoAway(ERROR_PROTOCOL));
+		if (argSize != 8) return(GoAway(ERROR_FRAME_SIZE));
+		if ((argFlags & FLAG_ACK) == 0) AppendFrame(FRAME_PING,FLAG_ACK,0,argData,argSize);
+		return(0);
+
+	case FRAME_GOAWAY:
+		// the client will close the connection once it has the
+		// answers it is still waiting for
+		return(0);
+
+	case FRAME_WINDOW_UPDATE:
+		if (argSize != 4) return(GoAway(ERROR_FRAME_SIZE));
+		value = (ntohl(*(unsigned int *)data) & 0x7FFFFFFF);
+
+			if (argStream == 0)
+			{
+			if ((value == 0) || (value > (unsigned int)(0x7FFFFFFF - sendwindow))) return(GoAway(ERROR_FLOW_CONTROL));
+			sendwindow+=value;
+			SendPending(NULL);
+			return(0);
+			}
+
+		local = FindStream(argStream);
+		if (local == NULL) return(0);
+		local->window+=value;
+		SendPending(local);
+		return(0);
+
+	case FRAME_PUSH_PROMISE:
+	case FRAME_CONTINUATION:
+		return(GoAway(ERROR_PROTOCOL));
+	}
+
+// unknown frame types are ignored
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::ProcessHeaders(int argFlags,unsigned int argStream,char *argData,int argSize)
+{
+dohstream		*local;
+unsigned char	*data;
+int				first,last;
+int				ret;
+
+data = (unsigned char *)argData;
+first = 0;
+last = argSize;
+
+if (argStream == 0) return(GoAway(ERROR_PROTOCOL));
+
+// skip the padding and priority fields
+if ((argFlags & FLAG_PADDED) && (argSize < 1)) return(GoAway(ERROR_PROTOCOL));
+if (argFlags & FLAG_PADDED) last-=data[first++];
+if (argFlags & FLAG_PRIORITY) first+=5;
+if (first > last) return(GoAway(ERROR_PROTOCOL));
+
+local = FindStream(argStream);
+
+	// a new stream must use a higher odd number than any before it
+	if (local == NULL)
+	{
+	if (((argStream & 1) == 0) || (argStream <= laststream)) return(GoAway(ERROR_PROTOCOL));
+	laststream = argStream;
+	local = CreateStream(argStream);
+	}
+
+// the block has to be decoded even for a stream we refuse since the
+// client added any new entries to its copy of the dynamic table
+ret = DecodeBlock(local,&data[first],last - first);
+if (ret < 0) return(GoAway(ERROR_COMPRESSION));
+
+	if (local == NULL)
+	{
+	SendReset(argStream,ERROR_REFUSED_STREAM);
+	return(0);
+	}
+
+// trailers on a stream that already has its query are ignored
+if (local->state != STREAM_OPEN) return(0);
+
+	// only GET takes the query from the path but a body we already
+	// collected for the stream belongs to it and stays where it is
+	if ((local->method != METHOD_GET) && (local->bodylimit == 0))
+	{
+	local->body = NULL;
+	local->bodysize = 0;
+	}
+
+if (argFlags & FLAG_END_STREAM) return(CompleteRequest(local));
+
+	// the GET query is still in the scratch space so the stream needs
+	// its own copy when the request doesn't end with these headers
+	if ((local->bodysize != 0) && (local->bodylimit == 0))
+	{
+	query = (char *)malloc(local->bodysize);
+	memcpy(query,local->body,local->bodysize);
+	local->body = query;
+	local->bodylimit = local->bodysize;
+	query = NULL;
+	}
+
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::ProcessData(int argFlags,unsigned int argStream,char *argData,int argSize)
+{
+dohstream		*local;
+int				first,last;
+
+first = 0;
+last = argSize;
+
+if (argStream == 0) return(GoAway(ERROR_PROTOCOL));
+
+// skip the padding
+if ((argFlags & FLAG_PADDED) && (argSize < 1)) return(GoAway(ERROR_PROTOCOL));
+if (argFlags & FLAG_PADDED) last-=(unsigned char)argData[first++];
+if (first > last) return(GoAway(ERROR_PROTOCOL));
+
+// all of the frame counts against the connection window
+recvcount+=argSize;
+
+local = FindStream(argStream);
+
+	if ((local == NULL) || (local->state != STREAM_OPEN))
+	{
+	SendReset(argStream,ERROR_STREAM_CLOSED);
+	return(0);
+	}
+
+	// a body that arrives in one frame is used right where it is
+	if ((local->bodysize == 0) && (argFlags & FLAG_END_STREAM))
+	{
+	local->body = &argData[first];
+	local->bodysize = (last - first);
+	return(CompleteRequest(local));
+	}
+
+	// otherwise the pieces are collected for the stream but anything
+	// bigger than a DNS message can't be a valid query
+	if ((local->bodysize + (last - first)) > 0xFFFF)
+	{
+	InsertStatus(argStream,413);
+	return(0);
+	}
+
+	if ((local->bodysize + (last - first)) > local->bodylimit)
+	{
+	local->bodylimit = (local->bodysize + (last - first));
+	local->body = (char *)realloc(local->body,local->bodylimit);
+	}
+
+memcpy(&local->body[local->bodysize],&argData[first],last - first);
+local->bodysize+=(last - first);
+
+if (argFlags & FLAG_END_STREAM) return(CompleteRequest(local));
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::CollectBlock(char *argBuffer,int argSize)
+{
+unsigned char	*data;
+unsigned int	stream;
+int				offset,length;
+int				first,last;
+
+data = (unsigned char *)argBuffer;
+stream = (ntohl(*(unsigned int *)&data[5]) & 0x7FFFFFFF);
+length = ((data[0] << 16) | (data[1] << 8) | data[2]);
+
+// start with the fragment from the headers frame itself without
+// the padding and priority fields which only that frame can have
+first = 0;
+last = length;
+if ((data[4] & FLAG_PADDED) && (length < 1)) return(-1);
+if (data[4] & FLAG_PADDED) last-=data[DOHHEADER + first++];
+if (data[4] & FLAG_PRIORITY) first+=5;
+if (first > last) return(-1);
+
+blocksize = 0;
+AppendBlock(&argBuffer[DOHHEADER + first],last - first);
+offset = (DOHHEADER + length);
+
+	// the continuation frames must follow with nothing in between
+	for(;;)
+	{
+	if ((argSize - offset) < DOHHEADER) return(0);
+	data = (unsigned char *)&argBuffer[offset];
+	length = ((data[0] << 16) | (data[1] << 8) | data[2]);
+
+	if (data[3] != FRAME_CONTINUATION) return(-1);
+	if ((ntohl(*(unsigned int *)&data[5]) & 0x7FFFFFFF) != stream) return(-1);
+	if ((length > DOHFRAME) || ((blocksize + length) > DOHBLOCK)) return(-1);
+	if ((argSize - offset - DOHHEADER) < length) return(0);
+
+	AppendBlock(&argBuffer[offset + DOHHEADER],length);
+	offset+=(DOHHEADER + length);
+	if (data[4] & FLAG_END_HEADERS) return(offset);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::AppendBlock(const char *argData,int argSize)
+{
+if (argSize == 0) return;
+block = (char *)realloc(block,blocksize + argSize);
+memcpy(&block[blocksize],argData,argSize);
+blocksize+=argSize;
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::CompleteRequest(dohstream *argStream)
+{
+int		status;
+
+status = 0;
+
+// check everything the request needs before we take the query
+if ((argStream->method != METHOD_GET) && (argStream->method != METHOD_POST)) status = 405;
+else if (argStream->pathcount > 1) status = 400;
+else if (argStream->pathok == 0) status = 404;
+else if ((argStream->method == METHOD_POST) && (argStream->typeok == 0)) status = 415;
+else if (argStream->bodysize == 0) status = 400;
+
+	if (status != 0)
+	{
+	InsertStatus(argStream->id,status);
+	return(0);
+	}
+
+query = argStream->body;
+querysize = argStream->bodysize;
+querystream = argStream->id;
+argStream->state = STREAM_WAIT;
+
+g_dohqueries++;
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::DecodeBlock(dohstream *argStream,const unsigned char *argData,int argSize)
+{
+const char		*name,*value;
+unsigned int	index;
+int				namelen,valuelen;
+int				offset,ret;
+int				indexed;
+
+// huffman strings never decode to more than 8/5 of their encoded size
+// and the one GET query from the path is no more than 3/4 of the path
+// which can be one of those strings or a value from the dynamic table
+scratchused = 0;
+
+	if (scratchsize < ((argSize * 3) + DOHTABLE + 64))
+	{
+	scratchsize = ((argSize * 3) + DOHTABLE + 64);
+	scratch = (char *)realloc(scratch,scratchsize);
+	}
+
+offset = 0;
+
+	while (offset < argSize)
+	{
+		// indexed header field
+		if (argData[offset] & 0x80)
+		{
+		ret = DecodeInteger(argData,argSize,&offset,7,&index);
+		if (ret == 0) return(-1);
+		ret = LookupTable(index,&name,&namelen,&value,&valuelen);
+		if (ret == 0) return(-1);
+		InsertHeader(argStream,name,namelen,value,valuelen);
+		continue;
+		}
+
+		// dynamic table size update
+		if ((argData[offset] & 0xE0) == 0x20)
+		{
+		ret = DecodeInteger(argData,argSize,&offset,5,&index);
+		if ((ret == 0) || (index > (unsigned int)DOHTABLE)) return(-1);
+		tablelimit = index;
+		EvictTable(0);
+		continue;
+		}
+
+	// literal with or without indexing using an indexed or new name
+	indexed = ((argData[offset] & 0xC0) == 0x40 ? 1 : 0);
+	ret = DecodeInteger(argData,argSize,&offset,(indexed != 0 ? 6 : 4),&index);
+	if (ret == 0) return(-1);
+
+	if (index != 0) ret = LookupTable(index,&name,&namelen,&value,&valuelen);
+	else ret = DecodeString(argData,argSize,&offset,&name,&namelen);
+	if (ret == 0) return(-1);
+
+	ret = DecodeString(argData,argSize,&offset,&value,&valuelen);
+	if (ret == 0) return(-1);
+
+	InsertHeader(argStream,name,namelen,value,valuelen);
+	if (indexed != 0) InsertTable(name,namelen,value,valuelen);
+	}
+
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::InsertHeader(dohstream *argStream,const char *argName,int argNameLen,const char *argValue,int argValueLen)
+{
+const char		*find;
+int				len,ret;
+
+if (argStream == NULL) return;
+
+	if ((argNameLen == 7) && (memcmp(argName,":method",7) == 0))
+	{
+	argStream->method = METHOD_OTHER;
+	if ((argValueLen == 3) && (memcmp(argValue,"GET",3) == 0)) argStream->method = METHOD_GET;
+	if ((argValueLen == 4) && (memcmp(argValue,"POST",4) == 0)) argStream->method = METHOD_POST;
+	return;
+	}
+
+	if ((argNameLen == 12) && (memcmp(argName,"content-type",12) == 0))
+	{
+	len = strlen(DOHMESSAGE);
+	argStream->typeok = (((argValueLen == len) && (strncasecmp(argValue,DOHMESSAGE,len) == 0)) ? 1 : 0);
+	return;
+	}
+
+if ((argNameLen != 5) || (memcmp(argName,":path",5) != 0)) return;
+
+// a second path makes the request malformed and a body we already
+// collected for the stream is never replaced by one from the path
+argStream->pathcount++;
+if ((argStream->pathcount > 1) || (argStream->bodylimit != 0)) return;
+
+// the path has to match and may be followed by the query string
+len = strlen(cfg_DohPath);
+if ((argValueLen < len) || (memcmp(argValue,cfg_DohPath,len) != 0)) return;
+if ((argValueLen > len) && (argValue[len] != '?')) return;
+argStream->pathok = 1;
+
+	// look for the dns parameter in the query string and decode it
+	// into the scratch space after the strings we have so far
+	for(find = &argValue[len];find < &argValue[argValueLen];find++)
+	{
+	if ((*find != '?') && (*find != '&')) continue;
+	if (((&argValue[argValueLen] - find) < 5) || (memcmp(find + 1,"dns=",4) != 0)) continue;
+
+	find+=5;
+	for(len = 0;((find + len) < &argValue[argValueLen]) && (find[len] != '&');len++);
+
+	ret = DecodeBase64(find,len,(unsigned char *)&scratch[scratchused],scratchsize - scratchused);
+	if (ret <= 0) return;
+
+	argStream->body = &scratch[scratchused];
+	argStream->bodysize = ret;
+	scratchused+=ret;
+	return;
+	}
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::DecodeInteger(const unsigned char *argData,int argSize,int *argOffset,int argPrefix,unsigned int *argValue)
+{
+unsigned int	mask,value;
+int				shift;
+
+if (*argOffset >= argSize) return(0);
+
+mask = ((1 << argPrefix) - 1);
+value = (argData[(*argOffset)++] & mask);
+
+	// values that don't fit in the prefix continue seven bits at a time
+	if (value == mask)
+	{
+		for(shift = 0;;shift+=7)
+		{
+		if ((*argOffset >= argSize) || (shift > 21)) return(0);
+		value+=((argData[*argOffset] & 0x7F) << shift);
+		if ((argData[(*argOffset)++] & 0x80) == 0) break;
+		}
+	}
+
+*argValue = value;
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::DecodeString(const unsigned char *argData,int argSize,int *argOffset,const char **argText,int *argLength)
+{
+unsigned int	length;
+int				huffman,ret;
+
+if (*argOffset >= argSize) return(0);
+huffman = (argData[*argOffset] & 0x80);
+
+ret = DecodeInteger(argData,argSize,argOffset,7,&length);
+if (ret == 0) return(0);
+if (length > (unsigned int)(argSize - *argOffset)) return(0);
+
+	// a plain string is used right where it is in the block
+	if (huffman == 0)
+	{
+	*argText = (const char *)&argData[*argOffset];
+	*argLength = length;
+	*argOffset+=length;
+	return(1);
+	}
+
+ret = DecodeHuffman(&argData[*argOffset],length,&scratch[scratchused],scratchsize - scratchused);
+if (ret < 0) return(0);
+
+*argText = &scratch[scratchused];
+*argLength = ret;
+scratchused+=ret;
+*argOffset+=length;
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::DecodeHuffman(const unsigned char *argData,int argSize,char *argTarget,int argLimit)
+{
+unsigned int	code,index;
+int				bits,out;
+int				x,y;
+
+code = bits = out = 0;
+
+	// the code is canonical so a code of each length is valid when it
+	// falls in the range of codes assigned to that length
+	for(x = 0;x < argSize;x++)
+	{
+		for(y = 7;y >= 0;y--)
+		{
+		code = ((code << 1) | ((argData[x] >> y) & 1));
+		bits++;
+
+		if (bits > 30) return(-1);
+		if (bits < 5) continue;
+
+		index = (code - huffmanfirst[bits]);
+		if (index >= huffmancount[bits]) continue;
+		if (huffmansymbol[huffmanindex[bits] + index] == 256) return(-1);
+		if (out >= argLimit) return(-1);
+
+		argTarget[out++] = huffmansymbol[huffmanindex[bits] + index];
+		code = bits = 0;
+		}
+	}
+
+// whatever is left must be padding made from the start of the EOS code
+if ((bits > 7) || (code != (unsigned int)((1 << bits) - 1))) return(-1);
+return(out);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::DecodeBase64(const char *argText,int argLength,unsigned char *argTarget,int argLimit)
+{
+unsigned int	value;
+int				bits,out;
+int				x,c;
+
+value = bits = out = 0;
+
+	// base64url without padding but we accept the normal alphabet too
+	for(x = 0;x < argLength;x++)
+	{
+	c = argText[x];
+	if (c == '=') break;
+
+	if ((c >= 'A') && (c <= 'Z')) c = (c - 'A');
+	else if ((c >= 'a') && (c <= 'z')) c = (c - 'a' + 26);
+	else if ((c >= '0') && (c <= '9')) c = (c - '0' + 52);
+	else if ((c == '-') || (c == '+')) c = 62;
+	else if ((c == '_') || (c == '/')) c = 63;
+	else return(-1);
+
+	value = ((value << 6) | c);
+	bits+=6;
+
+		if (bits >= 8)
+		{
+		bits-=8;
+		if (out >= argLimit) return(-1);
+		argTarget[out++] = ((value >> bits) & 0xFF);
+		}
+	}
+
+return(out);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::LookupTable(unsigned int argIndex,const char **argName,int *argNameLen,const char **argValue,int *argValueLen)
+{
+hpackentry		*entry;
+
+if (argIndex == 0) return(0);
+
+	if (argIndex < 62)
+	{
+	*argName = staticname[argIndex];
+	*argNameLen = strlen(staticname[argIndex]);
+	*argValue = (argIndex < 17 ? staticvalue[argIndex] : "");
+	*argValueLen = strlen(*argValue);
+	return(1);
+	}
+
+// the newest entry in the dynamic table comes right after the static
+if ((argIndex - 62) >= (unsigned int)tablecount) return(0);
+entry = &tablelist[(tablehead + (argIndex - 62)) % HPACKLIMIT];
+
+*argName = entry->name;
+*argNameLen = entry->namelen;
+*argValue = &entry->name[entry->namelen];
+*argValueLen = entry->valuelen;
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::InsertTable(const char *argName,int argNameLen,const char *argValue,int argValueLen)
+{
+hpackentry		*entry;
+char			*local;
+int				size;
+
+// copy the strings first since the name may point at an entry that
+// is about to be evicted
+size = (argNameLen + argValueLen + 32);
+local = (char *)malloc(argNameLen + argValueLen + 1);
+memcpy(local,argName,argNameLen);
+memcpy(&local[argNameLen],argValue,argValueLen);
+
+EvictTable(size);
+
+	// an entry bigger than the whole table just leaves it empty
+	if (size > tablelimit)
+	{
+	free(local);
+	return;
+	}
+
+tablehead = ((tablehead + HPACKLIMIT - 1) % HPACKLIMIT);
+entry = &tablelist[tablehead];
+entry->name = local;
+entry->namelen = argNameLen;
+entry->valuelen = argValueLen;
+
+tablecount++;
+tablesize+=size;
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::EvictTable(int argRoom)
+{
+hpackentry		*entry;
+
+	// the oldest entries go first until there is room
+	while ((tablecount > 0) && ((tablesize + argRoom) > tablelimit))
+	{
+	entry = &tablelist[(tablehead + tablecount - 1) % HPACKLIMIT];
+	tablesize-=(entry->namelen + entry->valuelen + 32);
+	free(entry->name);
+	entry->name = NULL;
+	tablecount--;
+	}
+}
+/*--------------------------------------------------------------------------*/
+dohstream *DohSession::FindStream(unsigned int argStream)
+{
+int		x;
+
+if (argStream == 0) return(NULL);
+for(x = 0;x < streamcount;x++) if (streamlist[x].id == argStream) return(&streamlist[x]);
+return(NULL);
+}
+/*--------------------------------------------------------------------------*/
+dohstream *DohSession::CreateStream(unsigned int argStream)
+{
+int		x;
+
+	// refuse the stream when every slot is in use
+	for(x = 0;x < streamcount;x++)
+	{
+	if (streamlist[x].id != 0) continue;
+	memset(&streamlist[x],0,sizeof(dohstream));
+	streamlist[x].id = argStream;
+	streamlist[x].state = STREAM_OPEN;
+	streamlist[x].window = peerwindow;
+	return(&streamlist[x]);
+	}
+
+return(NULL);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::CloseStream(dohstream *argStream)
+{
+// only a body we collected belongs to the stream
+if (argStream->bodylimit != 0) free(argStream->body);
+if (argStream->pending != NULL) free(argStream->pending);
+memset(argStream,0,sizeof(dohstream));
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::SendData(dohstream *argStream,const char *argData,int argSize)
+{
+int		chunk,sent;
+
+sent = 0;
+
+	// each frame is limited by the frame size and both windows
+	while (sent < argSize)
+	{
+	chunk = (argSize - sent);
+	if (chunk > peerframe) chunk = peerframe;
+	if (chunk > sendwindow) chunk = sendwindow;
+	if (chunk > argStream->window) chunk = argStream->window;
+	if (chunk <= 0) break;
+
+	AppendFrame(FRAME_DATA,((sent + chunk) == argSize ? FLAG_END_STREAM : 0),argStream->id,&argData[sent],chunk);
+	sendwindow-=chunk;
+	argStream->window-=chunk;
+	sent+=chunk;
+	}
+
+// the stream is finished once the whole reply has gone out
+if (sent == argSize) CloseStream(argStream);
+
+return(sent);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::SendPending(dohstream *argStream)
+{
+dohstream	*local;
+int			x;
+
+	// send what we can for one stream or every stream that is waiting
+	for(x = 0;x < streamcount;x++)
+	{
+	local = (argStream != NULL ? argStream : &streamlist[x]);
+
+		if ((local->state == STREAM_SEND) && (local->pending != NULL))
+		{
+		local->pendsent+=SendData(local,&local->pending[local->pendsent],local->pendsize - local->pendsent);
+		}
+
+	if (argStream != NULL) break;
+	}
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::SendSettings(void)
+{
+unsigned char	buffer[6];
+
+// the only setting we change is the limit on concurrent streams
+*(unsigned short *)&buffer[0] = htons(SETTING_MAX_CONCURRENT_STREAMS);
+*(unsigned int *)&buffer[2] = htonl(streamcount);
+AppendFrame(FRAME_SETTINGS,0,0,(char *)buffer,sizeof(buffer));
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::SendWindow(unsigned int argStream,int argSize)
+{
+unsigned int	value;
+
+value = htonl(argSize);
+AppendFrame(FRAME_WINDOW_UPDATE,0,argStream,(char *)&value,sizeof(value));
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::SendReset(unsigned int argStream,int argError)
+{
+unsigned int	value;
+
+value = htonl(argError);
+AppendFrame(FRAME_RST_STREAM,0,argStream,(char *)&value,sizeof(value));
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::GoAway(int argError)
+{
+unsigned int	value[2];
+
+// tell the client the last stream we looked at and why we are leaving
+value[0] = htonl(laststream);
+value[1] = htonl(argError);
+AppendFrame(FRAME_GOAWAY,0,0,(char *)value,sizeof(value));
+
+return(-1);
+}
+/*--------------------------------------------------------------------------*/
+int DohSession::EncodeLiteral(unsigned char *argTarget,int argIndex,const char *argValue,int argLength)
+{
+int		len;
+
+len = 0;
+
+// literal without indexing using a name from the static table
+if (argIndex < 15) argTarget[len++] = argIndex;
+else { argTarget[len++] = 0x0F; argTarget[len++] = (argIndex - 15); }
+
+// the values we send are always short enough for one length byte
+argTarget[len++] = argLength;
+memcpy(&argTarget[len],argValue,argLength);
+
+return(len + argLength);
+}
+/*--------------------------------------------------------------------------*/
+void DohSession::AppendFrame(int argType,int argFlags,unsigned int argStream,const char *argData,int argSize)
+{
+unsigned char	*data;
+
+	if ((outcount + DOHHEADER + argSize) > outsize)
+	{
+	outsize = ((outcount + DOHHEADER + argSize) * 2);
+	output = (char *)realloc(output,outsize);
+	}
+
+data = (unsigned char *)&output[outcount];
+data[0] = ((argSize >> 16) & 0xFF);
+data[1] = ((argSize >> 8) & 0xFF);
+data[2] = (argSize & 0xFF);
+data[3] = argType;
+data[4] = argFlags;
+*(unsigned int *)&data[5] = htonl(argStream);
+
+if (argSize != 0) memcpy(&data[DOHHEADER],argData,argSize);
+outcount+=(DOHHEADER + argSize);
+}
+/*--------------------------------------------------------------------------*/
@@ -69,6 +69,38 @@ if (ListHead == NULL) ListHead = ListTail;
 // increment the message signal semaphore
 sem_post(&MessageSignal);
 
+// release the access control lock
+ListLock->Release();
+}
+/*--------------------------------------------------------------------------*/
+void MessageQueue::PushBatch(MessageFrame **argList,int argCount)
+{
+int		x;
+
+if (argCount == 0) return;
+
+// acquire the access control lock once for the entire batch
+ListLock->Acquire();
+
+	for(x = 0;x < argCount;x++)
+	{
+	// if queue is empty assign message to tail pointer
+	if (ListTail == NULL) ListTail = argList[x];
+
+		// otherwise append to the current tail object
+		else
+		{
+		ListTail->next = argList[x];
+		ListTail = argList[x];
+		}
+
+	// if head is null copy the tail
+	if (ListHead == NULL) ListHead = ListTail;
+
+	// increment the message signal semaphore
+	sem_post(&MessageSignal);
+	}
+
 // release the access control lock
 ListLock->Release();
 }
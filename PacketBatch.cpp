@@ -0,0 +1,206 @@
+// PacketBatch.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The PacketBatch class holds a queue of outbound datagrams for a
+	single UDP socket so they can be transmitted with one sendmmsg
+	call instead of one sendto call per packet.  Any thread may call
+	InsertPacket, which copies the packet into one of the pre-allocated
+	buffers and transmits the batch once it is full.  The packets are
+	also transmitted when FlushBatch is called, which normally happens
+	when a filter thread finds its message queue empty, or when the
+	network thread that owns the socket notices packets have been
+	waiting longer than the configured delay.  Packets too large for
+	the batch buffers are sent directly after flushing the queue so
+	the order of transmission is preserved.  When a source address is
+	given it is attached to the packet with IP_PKTINFO so replies on a
+	wildcard socket go out from the address the query was sent to.
+	The server network uses the same class to batch the queries it
+	forwards on each of its sockets and gives us its own counters.
+*/
+
+/*--------------------------------------------------------------------------*/
+PacketBatch::PacketBatch(int argSock,int argLimit,AtomicValue *argCalls,AtomicValue *argPackets)
+{
+int		x;
+
+// the client reply counters are used unless we are given others
+sendcalls = (argCalls != NULL ? argCalls : &g_sendcalls);
+sendpackets = (argPackets != NULL ? argPackets : &g_sendpackets);
+
+sock = argSock;
+limit = argLimit;
+count = 0;
+oldest = 0;
+
+// allocate the message headers and buffers for the batch
+batchmsg = (struct mmsghdr *)calloc(limit,sizeof(struct mmsghdr));
+batchvec = (struct iovec *)calloc(limit,sizeof(struct iovec));
+batchaddr = (struct sockaddr_in *)calloc(limit,sizeof(struct sockaddr_in));
+batchbuffer = (char *)malloc(limit * DNSBUFFER);
+batchctrl = (char *)calloc(limit,CTRLBUFFER);
+
+	// point each message header at its own buffer and address
+	for(x = 0;x < limit;x++)
+	{
+	batchvec[x].iov_base = &batchbuffer[x * DNSBUFFER];
+	batchmsg[x].msg_hdr.msg_iov = &batchvec[x];
+	batchmsg[x].msg_hdr.msg_iovlen = 1;
+	batchmsg[x].msg_hdr.msg_name = &batchaddr[x];
+	batchmsg[x].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+}
+/*--------------------------------------------------------------------------*/
+PacketBatch::~PacketBatch(void)
+{
+free(batchmsg);
+free(batchvec);
+free(batchaddr);
+free(batchbuffer);
+free(batchctrl);
+}
+/*--------------------------------------------------------------------------*/
+int PacketBatch::InsertPacket(const char *argBuffer,int argSize,const sockaddr_in *argTarget,unsigned int argSource)
+{
+struct msghdr	msg;
+struct iovec	vec;
+char			temp[CTRLBUFFER];
+int				ret;
+
+control.Acquire();
+
+	// packets that don't fit in a batch buffer are sent directly
+	// but we flush anything queued first to preserve the order
+	if (argSize > DNSBUFFER)
+	{
+	TransmitBatch();
+	memset(&msg,0,sizeof(msg));
+	vec.iov_base = (void *)argBuffer;
+	vec.iov_len = argSize;
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_name = (void *)argTarget;
+	msg.msg_namelen = sizeof(sockaddr_in);
+	SetSource(&msg,temp,argSource);
+	ret = sendmsg(sock,&msg,0);
+	control.Release();
+	(*sendcalls)++;
+	(*sendpackets)++;
+	return(ret);
+	}
+
+// remember when the first packet was queued
+if (count == 0) oldest = NowMilliseconds();
+
+// copy the packet and target address into the next slot
+memcpy(batchvec[count].iov_base,argBuffer,argSize);
+batchvec[count].iov_len = argSize;
+memcpy(&batchaddr[count],argTarget,sizeof(sockaddr_in));
+SetSource(&batchmsg[count].msg_hdr,&batchctrl[count * CTRLBUFFER],argSource);
+count++;
+
+// transmit the batch as soon as it is full
+if (count == limit) TransmitBatch();
+
+control.Release();
+
+return(argSize);
+}
+/*--------------------------------------------------------------------------*/
+int PacketBatch::FlushBatch(int argDelay)
+{
+int		ret;
+
+// quick unlocked check so idle queues cost almost nothing
+if (count == 0) return(0);
+
+control.Acquire();
+
+	// when a delay is given only flush if the oldest packet has waited
+	// at least that long so we don't defeat the batching on a busy box
+	if ((argDelay != 0) && ((NowMilliseconds() - oldest) < argDelay))
+	{
+	control.Release();
+	return(0);
+	}
+
+ret = TransmitBatch();
+
+control.Release();
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int PacketBatch::TransmitBatch(void)
+{
+int		total,sent,ret;
+
+// the caller must hold the control lock
+total = sent = 0;
+
+	while (total < count)
+	{
+	ret = sendmmsg(sock,&batchmsg[total],count - total,0);
+
+		if (ret < 0)
+		{
+		// ignore interrupted system call errors
+		if (errno == EINTR) continue;
+
+		// anything else is for the first message we haven't sent yet
+		// so we skip just that one and keep going with the rest
+		g_log->LogMessage(LOG_WARNING,"Error %d returned from sendmmsg\n",errno);
+		total++;
+		continue;
+		}
+
+	(*sendcalls)++;
+	(*sendpackets)+=ret;
+	total+=ret;
+	sent+=ret;
+	}
+
+count = 0;
+
+return(sent);
+}
+/*--------------------------------------------------------------------------*/
+void PacketBatch::SetSource(struct msghdr *argHeader,char *argControl,unsigned int argSource)
+{
+struct in_pktinfo	*info;
+struct cmsghdr		*cmsg;
+
+	// without a source address the kernel picks one for us
+	if (argSource == 0)
+	{
+	argHeader->msg_control = NULL;
+	argHeader->msg_controllen = 0;
+	return;
+	}
+
+memset(argControl,0,CTRLBUFFER);
+argHeader->msg_control = argControl;
+argHeader->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+
+cmsg = CMSG_FIRSTHDR(argHeader);
+cmsg->cmsg_level = IPPROTO_IP;
+cmsg->cmsg_type = IP_PKTINFO;
+cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+info->ipi_spec_dst.s_addr = argSource;
+}
+/*--------------------------------------------------------------------------*/
+long long PacketBatch::NowMilliseconds(void)
+{
+struct timespec		ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return(((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+/*--------------------------------------------------------------------------*/
@@ -16,12 +16,29 @@
 	with a particular network port in NetworkServer, and the 16 bit
 	slot value is used in the query header and response for mapping
 	the forwarded query/reply chain to the outstanding client request.
+	The additional section of each query is searched for an EDNS0 OPT
+	record to learn the UDP payload size the client can accept.  UDP
+	queries without one get an OPT record added before they are sent
+	upstream so the server can return large answers, and that record
+	is removed again from the reply.  Replies larger than the client
+	payload size are cut down to the header and question with the TC
+	bit set so the client knows to retry over TCP.  An entry that asks
+	the same question as one already waiting on the server is held as
+	a follower of that entry and gets a copy of its reply.  When the
+	servers never answer, the entry gets a SERVFAIL reply of our own so
+	the client isn't left waiting and the entry can be cleaned up.
 */
 
 /*--------------------------------------------------------------------------*/
 ProxyEntry::ProxyEntry(void)
 {
 memset(&origin,0,sizeof(origin));
+netlocal = 0;
+memset(linkaddr,0,sizeof(linkaddr));
+netowner = NULL;
+netindex = 0;
+netsession = 0;
+netserial = 0;
 netprotocol = 0;
 netsocket = 0;
 mygrid = 0;
@@ -30,6 +47,27 @@ myslot = 0;
 rawquery = rawreply = NULL;
 rawqsize = rawrsize = 0;
 
+ednsclient = ednsadded = 0;
+ednspayload = DNSUDPLIMIT;
+ednsflags = 0;
+ednsoptions = 0;
+querysigned = 0;
+netretry = 0;
+netstream = 0;
+netupstream = 0;
+netattempt = 0;
+nethedge = -1;
+netmask = 0;
+netsent = 0;
+nethedged = 0;
+netdeadline = 0;
+memset(&nettimer,0,sizeof(nettimer));
+nettimer.owner = this;
+netleader = netfollower = netchain = NULL;
+netkey = 0;
+netvariant = 0;
+netflight = 0;
+
 memset(&q_header,0,sizeof(q_header));
 memset(&q_record,0,sizeof(q_record));
 }
@@ -52,7 +90,11 @@ if (argSize < 17) return(0);
 // save the origin address and connection information
 memcpy(&origin,&argPortal->addr,sizeof(origin));
 netprotocol = argPortal->proto;
+netindex = argPortal->ifidx;
 netsocket = argPortal->sock;
+netlocal = argPortal->ifaddr;
+netsession = argPortal->session;
+netserial = argPortal->serial;
 
 // save the raw query packet
 rawquery = (char *)malloc(argSize);
@@ -109,28 +151,283 @@ out = 0;
 // skip over the final label
 offset++;
 
+// make sure the type and class are actually there
+if ((offset + 4) > argSize) return(0);
+
 // extract the query type and class
 q_record.qtype = ntohs(*(unsigned short *)&data[offset]);
 offset+=2;
 q_record.qclass = ntohs(*(unsigned short *)&data[offset]);
 offset+=2;
 
+// look for an EDNS0 option in the rest of the query
+if ((q_header.ancount + q_header.nscount + q_header.arcount) != 0) ExtractOption(data,argSize,offset);
+
+// UDP queries without EDNS0 get our own option for the server unless
+// it would follow a signature which must be the last record
+if ((netprotocol == IPPROTO_UDP) && (ednsclient == 0) && (querysigned == 0) && (cfg_EdnsPayload != 0)) InsertOption();
+
 return(1);
 }
 /*--------------------------------------------------------------------------*/
+int ProxyEntry::ExtractOption(const unsigned char *argData,int argSize,int argOffset)
+{
+unsigned int	total,x;
+int				offset,start;
+int				type;
+
+total = (q_header.ancount + q_header.nscount + q_header.arcount);
+offset = argOffset;
+
+	for(x = 0;x < total;x++)
+	{
+	start = offset;
+	offset = SkipRecord(argData,argSize,offset,&type);
+	if (offset < 0) return(0);
+
+	// OPT and signature records only count in the additional section
+	if (x < (unsigned int)(q_header.ancount + q_header.nscount)) continue;
+	if ((type == DNSTYPETSIG) || (type == DNSTYPESIG)) querysigned = 1;
+	if (type != DNSTYPEOPT) continue;
+
+	// the class holds the payload size and the TTL holds the extended
+	// rcode, version, and flags and we skip the root name to get them
+	start = SkipName(argData,argSize,start);
+	ednspayload = ntohs(*(unsigned short *)&argData[start + 2]);
+	ednsflags = ntohl(*(unsigned int *)&argData[start + 4]);
+	ednsoptions = ntohs(*(unsigned short *)&argData[start + 8]);
+	if (ednspayload < DNSUDPLIMIT) ednspayload = DNSUDPLIMIT;
+	ednsclient = 1;
+	return(1);
+	}
+
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+void ProxyEntry::InsertOption(void)
+{
+unsigned char	*data;
+
+rawquery = (char *)realloc(rawquery,rawqsize + 11);
+data = (unsigned char *)&rawquery[rawqsize];
+
+// root name, type, payload size in the class, and a zero TTL and length
+data[0] = 0;
+*(unsigned short *)&data[1] = htons(DNSTYPEOPT);
+*(unsigned short *)&data[3] = htons(cfg_EdnsPayload);
+*(unsigned int *)&data[5] = 0;
+*(unsigned short *)&data[9] = 0;
+rawqsize+=11;
+
+// bump the additional count in the header of the raw query
+*(unsigned short *)&rawquery[10] = htons(q_header.arcount + 1);
+ednsadded = 1;
+}
+/*--------------------------------------------------------------------------*/
+void ProxyEntry::RemoveOption(void)
+{
+// our option is always the last record so we just drop it and put
+// back the additional count the client sent
+if (ednsadded == 0) return;
+rawqsize-=11;
+*(unsigned short *)&rawquery[10] = htons(q_header.arcount);
+ednsadded = 0;
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::SkipName(const unsigned char *argData,int argSize,int argOffset)
+{
+int		offset;
+
+offset = argOffset;
+
+	while (offset < argSize)
+	{
+	// the end of the name
+	if (argData[offset] == 0) return(offset + 1);
+
+	// a compression pointer always ends the name
+	if ((argData[offset] & 0xC0) == 0xC0) return((offset + 2) <= argSize ? offset + 2 : -1);
+
+	// anything else must be a normal label
+	if (argData[offset] > 63) return(-1);
+	offset+=(argData[offset] + 1);
+	}
+
+return(-1);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::SkipRecord(const unsigned char *argData,int argSize,int argOffset,int *argType)
+{
+int		offset;
+int		size;
+
+offset = SkipName(argData,argSize,argOffset);
+if (offset < 0) return(-1);
+
+// make sure the type, class, TTL, and data length are there
+if ((offset + 10) > argSize) return(-1);
+
+*argType = ntohs(*(unsigned short *)&argData[offset]);
+size = ntohs(*(unsigned short *)&argData[offset + 8]);
+offset+=(10 + size);
+
+if (offset > argSize) return(-1);
+return(offset);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::TrimReply(void)
+{
+unsigned char	*data;
+unsigned int	ancount,nscount,arcount,x;
+int				offset,question,start;
+int				optstart,optsize;
+int				type;
+
+if (rawreply == NULL) return(0);
+if (rawrsize < 12) return(0);
+
+data = (unsigned char *)rawreply;
+ancount = ntohs(*(unsigned short *)&data[6]);
+nscount = ntohs(*(unsigned short *)&data[8]);
+arcount = ntohs(*(unsigned short *)&data[10]);
+
+// we only handle replies that echo our one question
+if (ntohs(*(unsigned short *)&data[4]) != 1) return(0);
+offset = SkipName(data,rawrsize,12);
+if ((offset < 0) || ((offset + 4) > rawrsize)) return(0);
+question = (offset + 4);
+offset = question;
+
+// find the OPT record in the additional section
+optstart = optsize = 0;
+
+	for(x = 0;x < (ancount + nscount + arcount);x++)
+	{
+	start = offset;
+	offset = SkipRecord(data,rawrsize,offset,&type);
+	if (offset < 0) return(0);
+	if (x < (ancount + nscount)) continue;
+	if (type != DNSTYPEOPT) continue;
+	optstart = start;
+	optsize = (offset - start);
+	}
+
+	// the client didn't ask for EDNS0 so the OPT record we added must
+	// not be passed back to them
+	if ((ednsadded != 0) && (optsize != 0))
+	{
+	memmove(&data[optstart],&data[optstart + optsize],rawrsize - (optstart + optsize));
+	rawrsize-=optsize;
+	arcount--;
+	*(unsigned short *)&data[10] = htons(arcount);
+	optsize = 0;
+	}
+
+if (rawrsize <= ednspayload) return(1);
+
+// too big for the client so we keep the header and question plus the
+// OPT record if there is one and set the TC bit so the client retries
+if (optsize != 0) memmove(&data[question],&data[optstart],optsize);
+rawrsize = (question + optsize);
+data[2]|=0x02;
+*(unsigned short *)&data[6] = 0;
+*(unsigned short *)&data[8] = 0;
+*(unsigned short *)&data[10] = htons(optsize != 0 ? 1 : 0);
+
+g_ednstruncate++;
+
+return(2);
+}
+/*--------------------------------------------------------------------------*/
 int ProxyEntry::InsertReply(const char *argBuffer,int argSize)
 {
+// a retried query may already have the truncated reply
+if (rawreply != NULL) free(rawreply);
+
 // save the raw reply packet
 rawreply = (char *)malloc(argSize);
 memcpy(rawreply,argBuffer,argSize);
 rawrsize = argSize;
 
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::CopyReply(ProxyEntry *argEntry)
+{
+int		offset;
+
+// a follower gets the reply to the query it was waiting on
+InsertReply(argEntry->rawreply,argEntry->rawrsize);
+
+// the name in the reply is spelled the way the other client asked
+// so we put back our own spelling for clients that check the case
+offset = SkipName((const unsigned char *)rawquery,rawqsize,12);
+if ((offset < 0) || (offset > rawrsize)) return(1);
+if (ntohs(*(unsigned short *)&rawreply[4]) != 1) return(1);
+memcpy(&rawreply[12],&rawquery[12],offset - 12);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::InsertFailure(void)
+{
+DNSPacket		*packet;
+dnsflags		flags;
+
+// answer with the query flags plus the response bit and SERVFAIL
+flags = q_header.flags;
+flags.pf.response = 1;
+flags.pf.truncate = 0;
+flags.pf.authority = 0;
+flags.pf.status = 2;
+if (flags.pf.wantrec != 0) flags.pf.haverec = 1;
+
+// the query id is our slot like a reply from the server would have
+// and the client network puts back the one from the client
+packet = new DNSPacket();
+packet->Insert_Master(myslot,flags.value,1,0,0,ednsclient);
+packet->Insert_Question(q_record.qname,q_record.qtype,q_record.qclass);
+
+	// answer an EDNS0 query with our own option record keeping only
+	// the DO flag from the query
+	if (ednsclient != 0)
+	{
+	packet->Begin_Record(".",DNSTYPEOPT,(cfg_EdnsPayload != 0 ? cfg_EdnsPayload : DNSUDPLIMIT),(ednsflags & 0x8000));
+	packet->Close_Record();
+	}
+
+InsertReply(packet);
+delete(packet);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyEntry::MatchReply(const char *argBuffer,int argSize)
+{
+int		offset,x;
+
+// the reply must echo our one question since a late reply can find
+// its slot already holding a different query
+offset = SkipName((const unsigned char *)rawquery,rawqsize,12);
+if (offset < 0) return(0);
+offset+=4;
+
+if (argSize < offset) return(0);
+if (ntohs(*(unsigned short *)&argBuffer[4]) != 1) return(0);
+
+	// servers can change the case of the name when they echo it
+	for(x = 12;x < offset;x++)
+	{
+	if (tolower((unsigned char)argBuffer[x]) != tolower((unsigned char)rawquery[x])) return(0);
+	}
+
 return(1);
 }
 /*--------------------------------------------------------------------------*/
 int ProxyEntry::InsertReply(DNSPacket *argPacket)
 {
 // copy the raw data from the argumented packet
+if (rawreply != NULL) free(rawreply);
 rawreply = (char *)malloc(argPacket->length);
 memcpy(rawreply,argPacket->buffer,argPacket->length);
 rawrsize = argPacket->length;
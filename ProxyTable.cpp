@@ -29,6 +29,16 @@
 	id.  If they had allowed 32 bits this would be so much easier, but
 	instead we have this mess.  But hey, it gave me an excuse to
 	use *** which is kinda cool!
+
+	The table also keeps a hash of the queries that are waiting on the
+	server so when a popular name expires and many clients ask for it
+	at once only the first query is forwarded.  The others are linked
+	to it as followers, and when its reply comes back each follower
+	gets a copy which goes through the reply filter on its own so the
+	client query id is restored the same way as for any other reply.
+	Only plain queries for the same name, type, and class with the
+	same flags and EDNS0 details can share a reply.  The flight hash
+	has its own lock since it is used by the filter threads.
 */
 
 /*--------------------------------------------------------------------------*/
@@ -44,6 +54,8 @@ worktable = (ProxyEntry ***)calloc(argSize,sizeof(ProxyEntry *));
 	worktable[x] = (ProxyEntry **)calloc(0x10000,sizeof(ProxyEntry *));
 	}
 
+flighttable = (ProxyEntry **)calloc(FLIGHTBUCKETS,sizeof(ProxyEntry *));
+
 tablesize = argSize;
 slotindex = 0;
 gridindex = 0;
@@ -65,12 +77,16 @@ int		x,y;
 // delete the work tables
 for(x = 0;x < tablesize;x++) free(worktable[x]);
 free(worktable);
+free(flighttable);
 }
 /*--------------------------------------------------------------------------*/
 int ProxyTable::InsertObject(ProxyEntry *argEntry)
 {
 unsigned short		grid,slot;
 
+// multiple client threads may be inserting at the same time
+tablelock.Acquire();
+
 // grab the index values for the new object
 slot = slotindex;
 grid = gridindex;
@@ -87,9 +103,14 @@ slotindex++;
 	if (gridindex == tablesize) gridindex = 0;
 	}
 
-	// if object is dirty delete the old object first
+	// if object is dirty delete the old object first after making
+	// sure the server network isn't timing it any more
 	if (worktable[grid][slot] != NULL)
 	{
+	if (g_server != NULL) g_server->CancelQuery(worktable[grid][slot]);
+	flightlock.Acquire();
+	DetachFlight(worktable[grid][slot]);
+	flightlock.Release();
 	delete(worktable[grid][slot]);
 	g_dirtycount++;
 	}
@@ -101,6 +122,8 @@ worktable[grid][slot] = argEntry;
 argEntry->mygrid = grid;
 argEntry->myslot = slot;
 
+tablelock.Release();
+
 g_log->LogMessage(LOG_DEBUG,"QINDEX:%hu-%hu  QNAME:%s  QTYPE:%hu  QCLASS:%hu\n",
 	grid,slot,argEntry->q_record.qname,argEntry->q_record.qtype,argEntry->q_record.qclass);
 
@@ -109,13 +132,22 @@ return(1);
 /*--------------------------------------------------------------------------*/
 int ProxyTable::RemoveObject(unsigned short argGrid,unsigned short argSlot)
 {
-// object is null so return error
-if (worktable[argGrid][argSlot] == NULL) return(0);
+ProxyEntry		*local;
 
-// delete the object and clear the entry
-delete(worktable[argGrid][argSlot]);
+tablelock.Acquire();
+
+// grab the object and clear the entry
+local = worktable[argGrid][argSlot];
 worktable[argGrid][argSlot] = NULL;
 
+tablelock.Release();
+
+// object is null so return error
+if (local == NULL) return(0);
+
+// delete the object
+delete(local);
+
 // return index as confirmation
 return(1);
 }
@@ -126,4 +158,185 @@ ProxyEntry *ProxyTable::RetrieveObject(unsigned short argGrid,unsigned short arg
 return(worktable[argGrid][argSlot]);
 }
 /*--------------------------------------------------------------------------*/
+int ProxyTable::ClaimObject(unsigned short argGrid,unsigned short argSlot,const char *argBuffer,int argSize,int argServer)
+{
+ProxyEntry		*local;
+int				ret;
+
+// with hedging a second reply for the same query is common so we hold
+// the table lock until the query is claimed to keep the reply filter
+// from deleting the entry while the network thread is looking at it
+tablelock.Acquire();
+
+local = worktable[argGrid][argSlot];
+
+// the entry is gone or holds a different query when another server
+// already answered this one, and the match also makes sure the reply
+// holds the header and question since a valid reply can be shorter
+// than the query when the server doesn't echo the OPT record
+if ((local == NULL) || (local->MatchReply(argBuffer,argSize) == 0)) ret = CLAIM_LATE;
+
+// the reply must come from a server we sent the query to
+else if ((local->netmask & (1 << argServer)) == 0) ret = CLAIM_SERVER;
 
+// stop the timer or ignore the reply if we weren't waiting for it
+else if (g_server->ClaimQuery(local) == 0) ret = CLAIM_LATE;
+
+else ret = CLAIM_TAKEN;
+
+tablelock.Release();
+
+// once claimed nothing else will delete the entry until the reply
+// filter gets the message the caller pushes for it
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyTable::InsertFlight(ProxyEntry *argEntry)
+{
+ProxyEntry		*local;
+unsigned int	bucket;
+int				variant;
+
+// queries that can't share a reply are always forwarded
+variant = FlightVariant(argEntry);
+if (variant < 0) return(1);
+
+argEntry->netkey = FlightKey(argEntry);
+argEntry->netvariant = variant;
+bucket = (argEntry->netkey % FLIGHTBUCKETS);
+
+flightlock.Acquire();
+
+	// look for the same question already waiting on the server
+	for(local = flighttable[bucket];local != NULL;local = local->netchain)
+	{
+	if (local->netkey != argEntry->netkey) continue;
+	if (local->netvariant != argEntry->netvariant) continue;
+	if (local->MatchReply(argEntry->rawquery,argEntry->rawqsize) == 0) continue;
+	break;
+	}
+
+	// found one so we follow it and wait for a copy of the reply
+	if (local != NULL)
+	{
+	argEntry->netleader = local;
+	argEntry->netfollower = local->netfollower;
+	local->netfollower = argEntry;
+	flightlock.Release();
+
+	g_log->LogMessage(LOG_DEBUG,"QINDEX:%hu-%hu  following %hu-%hu\n",argEntry->mygrid,argEntry->myslot,local->mygrid,local->myslot);
+	g_coalesced++;
+	return(0);
+	}
+
+// otherwise this query goes to the server and others can follow it
+argEntry->netchain = flighttable[bucket];
+flighttable[bucket] = argEntry;
+argEntry->netflight = 1;
+
+flightlock.Release();
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+ProxyEntry *ProxyTable::RemoveFlight(ProxyEntry *argEntry)
+{
+ProxyEntry		*list,*local;
+
+flightlock.Acquire();
+
+	// nothing to do for queries that were never in the hash
+	if (argEntry->netflight == 0)
+	{
+	flightlock.Release();
+	return(NULL);
+	}
+
+// the followers are handed to the caller still linked together
+list = argEntry->netfollower;
+argEntry->netfollower = NULL;
+for(local = list;local != NULL;local = local->netfollower) local->netleader = NULL;
+
+DetachFlight(argEntry);
+
+flightlock.Release();
+
+return(list);
+}
+/*--------------------------------------------------------------------------*/
+void ProxyTable::DetachFlight(ProxyEntry *argEntry)
+{
+ProxyEntry		**link;
+ProxyEntry		*local,*after;
+
+// the caller holds the flightlock
+
+	// a follower is taken off the list of the query it follows
+	if (argEntry->netleader != NULL)
+	{
+	for(link = &argEntry->netleader->netfollower;(*link != NULL) && (*link != argEntry);link = &(*link)->netfollower);
+	if (*link != NULL) *link = argEntry->netfollower;
+	argEntry->netleader = NULL;
+	argEntry->netfollower = NULL;
+	}
+
+if (argEntry->netflight == 0) return;
+
+// take the query out of the hash so nothing else can follow it
+for(link = &flighttable[argEntry->netkey % FLIGHTBUCKETS];(*link != NULL) && (*link != argEntry);link = &(*link)->netchain);
+if (*link != NULL) *link = argEntry->netchain;
+argEntry->netchain = NULL;
+argEntry->netflight = 0;
+
+	// any followers still attached belong to a query that is being
+	// thrown away so they are cut loose and left for the clients to
+	// retry just like the query they were following
+	for(local = argEntry->netfollower;local != NULL;local = after)
+	{
+	after = local->netfollower;
+	local->netleader = NULL;
+	local->netfollower = NULL;
+	}
+
+argEntry->netfollower = NULL;
+}
+/*--------------------------------------------------------------------------*/
+unsigned int ProxyTable::FlightKey(ProxyEntry *argEntry)
+{
+const unsigned char		*key = (const unsigned char *)argEntry->q_record.qname;
+unsigned int			hash;
+
+// same hash as the HashTable but names are not case sensitive
+hash = 0;
+while (*key) hash = (tolower(*key++) + (hash << 6) + (hash << 16) - hash);
+hash = (argEntry->q_record.qtype + (hash << 6) + (hash << 16) - hash);
+hash = (argEntry->q_record.qclass + (hash << 6) + (hash << 16) - hash);
+
+return(hash);
+}
+/*--------------------------------------------------------------------------*/
+int ProxyTable::FlightVariant(ProxyEntry *argEntry)
+{
+int		variant;
+
+if (cfg_Coalesce == 0) return(-1);
+
+// only standard queries with nothing but the question and maybe an
+// OPT record without options can share a reply since things like
+// client subnet and cookies are different for every client
+if (argEntry->q_header.flags.pf.opcode != 0) return(-1);
+if (argEntry->ednsoptions != 0) return(-1);
+if ((argEntry->q_header.ancount + argEntry->q_header.nscount + argEntry->q_header.arcount) != argEntry->ednsclient) return(-1);
+
+// the RD, AD, and CD bits and the DO bit can change the answer, and
+// the transport and where the OPT record came from change what the
+// reply looks like, so all of them have to match
+variant = (argEntry->q_header.flags.value & 0x0130);
+if ((argEntry->ednsflags & 0x8000) != 0) variant|=0x0001;
+if ((argEntry->netprotocol == IPPROTO_TCP) || (argEntry->netretry != 0)) variant|=0x0002;
+if (argEntry->ednsclient != 0) variant|=0x0004;
+if (argEntry->ednsadded != 0) variant|=0x0008;
+
+return(variant);
+}
+/*--------------------------------------------------------------------------*/
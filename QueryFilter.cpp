@@ -43,6 +43,18 @@ void QueryFilter::ThreadSaturation(int argTotal)
 if (argTotal < ThreadLimit) g_master->PushMessage(new MessageFrame(MSG_ADDQUERYTHREAD));
 }
 /*--------------------------------------------------------------------------*/
+void QueryFilter::ThreadDrained(void)
+{
+int		x;
+
+// Called by a pool worker when it finds the message queue empty, which
+// marks the end of a batch of work, so we transmit any client replies
+// and forwarded queries that are being held for batching.
+
+for(x = 0;x < cfg_ClientThreads;x++) if (g_client[x] != NULL) g_client[x]->FlushReplies();
+if (g_server != NULL) g_server->FlushQueries();
+}
+/*--------------------------------------------------------------------------*/
 void QueryFilter::ThreadCallback(MessageFrame *argMessage)
 {
 ProxyMessage	*message = (ProxyMessage *)argMessage;
@@ -90,8 +102,10 @@ g_log->LogMessage(LOG_DEBUG,"NAME:%s  WHITE:%d  BLACK:%d\n",local->q_record.qnam
 	// either the blaclist or category block we forward
 	if ((white != 0) || (black == 0))
 	{
+	// the reply can arrive and the entry be deleted before the forward
+	// call returns so we must not touch the entry after forwarding
 	if (local->netprotocol == IPPROTO_TCP) g_server->ForwardTCPQuery(local);
-	if (local->netprotocol == IPPROTO_UDP) g_server->ForwardUDPQuery(local);
+	else if (local->netprotocol == IPPROTO_UDP) g_server->ForwardUDPQuery(local);
 	}
 
 	// otherwise it was blocked so we send back the block
@@ -117,12 +131,20 @@ if (flags.pf.wantrec != 0) flags.pf.haverec = 1;
 
 // create a DNS response with our block server as the answer
 packet = new DNSPacket();
-packet->Insert_Master(htons(argEntry->q_header.qid),flags.value,1,1,0,0);
+packet->Insert_Master(htons(argEntry->q_header.qid),flags.value,1,1,0,argEntry->ednsclient);
 packet->Insert_Question(argEntry->q_record.qname,argEntry->q_record.qtype,argEntry->q_record.qclass);
 packet->Begin_Record(argEntry->q_record.qname,argEntry->q_record.qtype,argEntry->q_record.qclass,60);
 packet->Insert_IPV4(cfg_BlockServerAddr);
 packet->Close_Record();
 
+	// answer an EDNS0 query with our own option record keeping only
+	// the DO flag from the query
+	if (argEntry->ednsclient != 0)
+	{
+	packet->Begin_Record(".",DNSTYPEOPT,(cfg_EdnsPayload != 0 ? cfg_EdnsPayload : DNSUDPLIMIT),(argEntry->ednsflags & 0x8000));
+	packet->Close_Record();
+	}
+
 // insert our synthetic response into the proxy table object
 argEntry->InsertReply(packet);
 
@@ -130,8 +152,8 @@ argEntry->InsertReply(packet);
 delete(packet);
 
 // forward the query response back to the client
-if (argEntry->netprotocol == IPPROTO_UDP) g_client->ForwardUDPReply(argEntry);
-if (argEntry->netprotocol == IPPROTO_TCP) g_client->ForwardTCPReply(argEntry);
+if (argEntry->netprotocol == IPPROTO_UDP) argEntry->netowner->ForwardUDPReply(argEntry);
+if (argEntry->netprotocol == IPPROTO_TCP) argEntry->netowner->ForwardTCPReply(argEntry);
 }
 /*--------------------------------------------------------------------------*/
 
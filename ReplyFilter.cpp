@@ -19,7 +19,9 @@
 	retrieve the corresponding ProxyEntry object, and do the actual filtering
 	work.  The calling thread takes care of deleting the message object, and
 	the ProxyEntry will be deleted when the response is finally transmitted
-	to the original client.
+	to the original client.  Queries that were held as followers of the
+	one being answered get a copy of the reply and a message of their
+	own so each one is trimmed and sent back to its client separately.
 */
 
 /*--------------------------------------------------------------------------*/
@@ -41,10 +43,21 @@ void ReplyFilter::ThreadSaturation(int argTotal)
 if (argTotal < ThreadLimit) g_master->PushMessage(new MessageFrame(MSG_ADDREPLYTHREAD));
 }
 /*--------------------------------------------------------------------------*/
+void ReplyFilter::ThreadDrained(void)
+{
+int		x;
+
+// Called by a pool worker when it finds the message queue empty, which
+// marks the end of a batch of work, so we transmit any client replies
+// that are being held for batching.
+
+for(x = 0;x < cfg_ClientThreads;x++) if (g_client[x] != NULL) g_client[x]->FlushReplies();
+}
+/*--------------------------------------------------------------------------*/
 void ReplyFilter::ThreadCallback(MessageFrame *argMessage)
 {
 ProxyMessage	*message = (ProxyMessage *)argMessage;
-ProxyEntry		*local;
+ProxyEntry		*local,*follow,*after;
 
 g_replycount++;
 g_log->LogMessage(LOG_DEBUG,"ReplyFilter processing index %hu-%hu\n",message->qgrid,message->qslot);
@@ -53,13 +66,51 @@ g_log->LogMessage(LOG_DEBUG,"ReplyFilter processing index %hu-%hu\n",message->qg
 local = g_table->RetrieveObject(message->qgrid,message->qslot);
 if (local == NULL) return;
 
+	// every query that was waiting on this one gets a copy of the reply
+	// and comes back through here on its own before anything else can
+	// happen to the reply or the entry
+	for(follow = g_table->RemoveFlight(local);follow != NULL;follow = after)
+	{
+	after = follow->netfollower;
+	follow->netfollower = NULL;
+	follow->CopyReply(local);
+	PushMessage(new ProxyMessage(follow->mygrid,follow->myslot));
+	}
+
+	// a server that doesn't know EDNS0 answers the option we added
+	// with FORMERR so we send the query again without it, and any
+	// followers that got the same reply come back here and do the same
+	if ((local->ednsadded != 0) && (local->rawrsize > 3) && ((local->rawreply[3] & 0x0F) == 1))
+	{
+	local->RemoveOption();
+	g_ednsfallback++;
+	g_server->ForwardUDPQuery(local);
+	return;
+	}
+
+	// a truncated reply to an EDNS0 query is sent to the server again
+	// over TCP since the full answer may still fit what the client can
+	// accept which saves the client a retry of its own, but without
+	// EDNS0 the answer is already too big for the client so we don't
+	// bother, and we must not touch the entry once the forward starts
+	if ((cfg_TruncateRetry != 0) && (local->netprotocol == IPPROTO_UDP) && (local->ednsclient != 0) && (local->netretry == 0) && (local->rawrsize > 2) && ((local->rawreply[2] & 0x02) != 0))
+	{
+	local->netretry = 1;
+	g_tcpretry++;
+	g_server->ForwardTCPQuery(local);
+	return;
+	}
+
+// strip our own EDNS0 option and make the reply fit the client
+if (local->netprotocol == IPPROTO_UDP) local->TrimReply();
+
 // This is where the actual blacklist checks should happen.  Right now we
 // just foward the reply to the client.  Eventually we'll do the actual
 // checking, and also have a mechanism to return a block response
 
 // forward the query response back to the client
-if (local->netprotocol == IPPROTO_UDP) g_client->ForwardUDPReply(local);
-if (local->netprotocol == IPPROTO_TCP) g_client->ForwardTCPReply(local);
+if (local->netprotocol == IPPROTO_UDP) local->netowner->ForwardUDPReply(local);
+if (local->netprotocol == IPPROTO_TCP) local->netowner->ForwardTCPReply(local);
 
 // all done so delete the proxy table entry
 g_table->RemoveObject(message->qgrid,message->qslot);
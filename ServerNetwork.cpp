@@ -24,16 +24,57 @@
 	the reply actually matches up with the question we asked,
 	the reply details are added to the ProxyEntry object, and
 	the object then passed to the ReplyFilter message queue for
-	the next stage of processing.
+	the next stage of processing.  With edge triggered epoll each
+	socket is read until it is empty or reaches the fairness limit
+	in which case it goes on a ready list to be serviced again after
+	the other sockets have had a turn.  Queries that go to the server
+	over TCP use a pool of long lived sessions for each grid which are
+	opened without blocking by the first filter thread that needs one.
+	Many queries are pipelined on each session and the replies are
+	matched by query id the same way as the UDP replies, and since a
+	reply can be split across reads or share one with others each
+	session has its own read buffer.  Queries sent while the session
+	is connecting or the socket is full are queued until it drains.
+	Sessions are closed once they have been idle for the session
+	timeout using a TimerWheel that is shared with the filter threads
+	under the session lock.  Every forwarded query also has a timer
+	on a second wheel with a much finer tick, and a query is only
+	waiting for a reply while its timer is running, so a reply has
+	to stop the timer before it is accepted.  When the timer expires
+	the query is sent again with the wait doubled, to a different
+	server when there is one, and after the last retry we answer
+	the client with SERVFAIL.  The UDP queries are queued on a
+	PacketBatch for each socket and sent with sendmmsg when the batch
+	fills, when a filter thread runs out of work, or when they have
+	waited the send delay, and the replies are read with recvmmsg so
+	the upstream side scales the same way as the client side.
+	In busy poll mode the loop polls without blocking for as long as
+	replies keep arriving and only blocks again after an idle period.
 */
 
 /*--------------------------------------------------------------------------*/
 ServerNetwork::ServerNetwork(void)
 {
 memset(udpsocket,0,sizeof(udpsocket));
-tcpactive = NULL;
+memset(udpbatch,0,sizeof(udpbatch));
+batchmsg = NULL;
+batchvec = NULL;
+batchaddr = NULL;
+batchbuffer = NULL;
+batchctrl = NULL;
+uring = NULL;
+memset(readylist,0,sizeof(readylist));
+readycount = 0;
+lastbusy = 0;
+spincount = 0;
+upstreamcount = LoadUpstreams();
+lastsample = TimerWheel::NowMilliseconds();
+tcptotal = (upstreamcount * cfg_PushLocalCount * cfg_PushTcpPool);
+tcppool = (netportal *)calloc(tcptotal,sizeof(netportal));
+tcpwheel = new TimerWheel(WHEELTICK);
+querywheel = new TimerWheel(QUERYTICK);
+memset(&wakeportal,0,sizeof(wakeportal));
 pollsock = 0;
-tcpcount = 0;
 running = 1;
 }
 /*--------------------------------------------------------------------------*/
@@ -44,12 +85,10 @@ ServerNetwork::~ServerNetwork(void)
 void* ServerNetwork::ThreadWorker(void)
 {
 epoll_event		*trigger;
-netportal		*local;
-time_t			lasttime,current;
 int				iftot,evtot;
+int				timeout;
 int				check;
-int				ret;
-int				x;
+int				ret,x;
 
 // spin up the server sockets
 iftot = SocketStartup();
@@ -58,26 +97,27 @@ iftot = SocketStartup();
 	// the running flag and return
 	if (iftot == 0)
 	{
+	DestroyPool();
 	running = 0;
 	return(NULL);
 	}
 
 // allocate a chunk of memory to hold events returned from epoll_wait
-evtot = (iftot + (cfg_SessionLimit * 2));
+evtot = (iftot + tcptotal + 1);
 trigger = (epoll_event *)calloc(evtot,sizeof(struct epoll_event));
 
-lasttime = time(NULL);
-
 	for(;;)
 	{
-	current = time(NULL);
+	// expire any TCP sessions that have been idle too long
+	SessionCleanup();
 
-		// every second we clean the TCP session table
-		if (current > lasttime)
-		{
-		SessionCleanup();
-		lasttime = current;
-		}
+	// retry or fail any queries the servers haven't answered and send
+	// the retries and hedges right away
+	QueryCleanup();
+	FlushQueries();
+
+	// take the next loss sample for each upstream server
+	UpdateUpstreams();
 
 	// watch the thread signal for termination
 	check = 0;
@@ -85,9 +125,32 @@ lasttime = time(NULL);
 	if (ret != 0) break;
 	if (check != 0) break;
 
+	// don't wait at all when sockets are known to have data waiting
+	timeout = (readycount != 0 ? 0 : 1000);
+
+	// while queries are waiting we wake up every query tick and the
+	// filter threads wake us when they start the first one so reading
+	// the count without the lock only changes how long we sleep
+	if ((timeout != 0) && (querywheel->TimerCount() != 0)) timeout = QUERYTICK;
+
+	// use a short timeout while queries are waiting to be sent
+	for(x = 0;x < cfg_PushLocalCount;x++) if ((udpbatch[x] != NULL) && (udpbatch[x]->PendingCount() != 0) && (timeout > cfg_SendDelay)) timeout = cfg_SendDelay;
+
+	// in busy poll mode keep spinning until we have been idle a while
+	if ((cfg_BusyPoll != 0) && (timeout != 0)) timeout = BusyTimeout(timeout);
+
+		// when using io_uring the ring does all of the waiting
+		if (uring != NULL)
+		{
+		ret = ProcessUringEvents(trigger,evtot,timeout);
+		if (ret > 0) lastbusy = TimerWheel::NowMilliseconds();
+		FlushQueries(cfg_SendDelay);
+		if (ret < 0) break;
+		continue;
+		}
+
 	// wait for one of the sockets to receive something
-	ret = epoll_wait(pollsock,trigger,evtot,1000);
-	if (ret == 0) continue;
+	ret = epoll_wait(pollsock,trigger,evtot,timeout);
 
 	// ignore interrupted system call errors
 	if ((ret < 0) && (errno == EINTR)) continue;
@@ -99,25 +162,154 @@ lasttime = time(NULL);
 		break;
 		}
 
-		// use process and continue here because for a TCP event
-		// the netportal object may be deleted while processing
-		for(x = 0;x < ret;x++)
-		{
-		local = (netportal *)trigger[x].data.ptr;
-		if (local->proto == IPPROTO_TCP) { ProcessTCPReply(local); continue; }
-		if (local->proto == IPPROTO_UDP) { ProcessUDPReply(local); continue; }
-		}
+	// process all the events that were returned and then give
+	// any sockets that hit the drain limit another turn
+	if (ret > 0) ProcessEpollEvents(trigger,ret);
+	if (ret > 0) lastbusy = TimerWheel::NowMilliseconds();
+	ProcessReadyList();
+
+	// send any queries that have been waiting too long
+	FlushQueries(cfg_SendDelay);
 	}
 
 // force cleanup any active TCP sessions
 SessionCleanup(TRUE);
+g_busyspins+=spincount;
 
 free(trigger);
 SocketDestroy();
+
+// the destructor runs before the thread is stopped so anything the
+// thread uses has to be released here instead
+DestroyPool();
+
 running = 0;
 return(NULL);
 }
 /*--------------------------------------------------------------------------*/
+void ServerNetwork::DestroyPool(void)
+{
+int		x;
+
+// the filter threads can still be forwarding queries while we shut
+// down so they have to see the pool is gone before any of it is freed
+tcplock.Acquire();
+
+	// the sessions are already closed but the buffers stay with the
+	// pool so they can be used again each time a session is opened
+	for(x = 0;x < tcptotal;x++)
+	{
+	if (tcppool[x].inbuffer != NULL) free(tcppool[x].inbuffer);
+	if (tcppool[x].outbuffer != NULL) free(tcppool[x].outbuffer);
+	}
+
+free(tcppool);
+tcppool = NULL;
+tcptotal = 0;
+tcplock.Release();
+
+delete(tcpwheel);
+tcpwheel = NULL;
+
+// the filter threads can also be starting query timers and using
+// the wakeup when the wheel is empty
+querylock.Acquire();
+delete(querywheel);
+querywheel = NULL;
+if (wakeportal.sock > 0) close(wakeportal.sock);
+wakeportal.sock = 0;
+querylock.Release();
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::ProcessEpollEvents(epoll_event *argList,int argCount)
+{
+netportal		*local;
+uint64_t		value;
+int				ret,x;
+
+	// use process and continue here because for a TCP event
+	// the session may be closed while processing
+	for(x = 0;x < argCount;x++)
+	{
+	local = (netportal *)argList[x].data.ptr;
+
+		// the filter threads only write the eventfd to wake us so
+		// all we have to do is clear the count
+		if (local == &wakeportal)
+		{
+		ret = read(local->sock,&value,sizeof(value));
+		if ((ret < 0) && (errno != EAGAIN)) g_log->LogMessage(LOG_WARNING,"Error %d returned from read(eventfd)\n",errno);
+		continue;
+		}
+
+	if ((local->proto == IPPROTO_TCP) && (argList[x].events & EPOLLOUT)) ProcessTCPWrite(local);
+	if ((local->proto == IPPROTO_TCP) && (argList[x].events & ~EPOLLOUT)) ProcessTCPReply(local);
+	if (local->proto == IPPROTO_TCP) continue;
+	if ((local->proto == IPPROTO_UDP) && (cfg_EdgeTrigger != 0)) { DrainUDPSocket(local); continue; }
+	if (local->proto == IPPROTO_UDP) { ProcessUDPReply(local); continue; }
+	}
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ProcessUringEvents(epoll_event *argList,int argCount,int argTimeout)
+{
+struct sockaddr_in		server;
+unsigned long long		data;
+struct msghdr			control;
+ProxyMessage			*message;
+netportal				*portal;
+unsigned				flags;
+char					*buffer;
+int						result;
+int						events;
+int						size;
+int						ret;
+
+// submit any pending requests and wait for completions
+ret = uring->WaitEvents(argTimeout);
+
+	if (ret < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from io_uring_enter(server)\n",errno);
+	return(-1);
+	}
+
+events = 0;
+
+	while (uring->GrabEvent(data,result,flags) != 0)
+	{
+	events++;
+
+		// a zero tag is the poll on our epoll descriptor which holds all
+		// of the TCP sockets so we grab and process those events and then
+		// arm the poll again for the next time
+		if (data == 0)
+		{
+		ret = epoll_wait(pollsock,argList,argCount,0);
+		if (ret > 0) ProcessEpollEvents(argList,ret);
+		uring->ArmPoll(pollsock,0);
+		continue;
+		}
+
+	// anything else is a multishot receive on one of our UDP sockets
+	portal = (netportal *)data;
+	size = uring->ExtractMessage(result,flags,&server,&buffer,&control);
+	if (size >= 0) check_dropcount(portal,&control,g_serverdrops);
+	message = (size >= 0 ? InsertUDPReply(portal,buffer,size,&server) : NULL);
+	if (message != NULL) g_rfilter->PushMessage(message);
+
+	// give the buffer back to the kernel as soon as we're done with it
+	uring->RecycleBuffer(flags);
+
+	// the multishot receive must be armed again when it terminates
+	// which usually happens when the kernel runs out of buffers
+	if (uring->CheckMultishot(flags) != 0) continue;
+	if ((result < 0) && (result != -ENOBUFS)) g_log->LogMessage(LOG_WARNING,"Error %d returned from io_uring recvmsg(%s:%d)\n",-result,cfg_PushLocalAddr,cfg_PushLocalPort+portal->ifidx);
+	uring->ArmRecvMessage(portal->sock,(unsigned long)portal);
+	}
+
+return(events);
+}
+/*--------------------------------------------------------------------------*/
 int ServerNetwork::SocketStartup(void)
 {
 struct sockaddr_in		addr;
@@ -125,6 +317,35 @@ struct epoll_event		evt;
 int						val,ret;
 int						x;
 
+	if (upstreamcount == 0)
+	{
+	g_log->LogMessage(LOG_ERR,"No valid upstream servers in %s\n",cfg_PushServerAddr);
+	return(0);
+	}
+
+for(x = 0;x < upstreamcount;x++) g_log->LogMessage(LOG_INFO,"ServerNetwork forwarding to %s\n",upstreamlist[x].name);
+
+	// allocate the ring of buffers used for receiving replies in batches
+	if (cfg_RecvBatch > 1)
+	{
+	batchmsg = (struct mmsghdr *)calloc(cfg_RecvBatch,sizeof(struct mmsghdr));
+	batchvec = (struct iovec *)calloc(cfg_RecvBatch,sizeof(struct iovec));
+	batchaddr = (struct sockaddr_in *)calloc(cfg_RecvBatch,sizeof(struct sockaddr_in));
+	batchbuffer = (char *)malloc(cfg_RecvBatch * SOCKBUFFER);
+	batchctrl = (char *)calloc(cfg_RecvBatch,CTRLBUFFER);
+
+		// point each message header at its own buffer and address
+		for(x = 0;x < cfg_RecvBatch;x++)
+		{
+		batchvec[x].iov_base = &batchbuffer[x * SOCKBUFFER];
+		batchvec[x].iov_len = SOCKBUFFER;
+		batchmsg[x].msg_hdr.msg_iov = &batchvec[x];
+		batchmsg[x].msg_hdr.msg_iovlen = 1;
+		batchmsg[x].msg_hdr.msg_name = &batchaddr[x];
+		batchmsg[x].msg_hdr.msg_control = &batchctrl[x * CTRLBUFFER];
+		}
+	}
+
 	for(x = 0;x < cfg_PushLocalCount;x++)
 	{
 	g_log->LogMessage(LOG_INFO,"ServerNetwork listening on %s:%d\n",cfg_PushLocalAddr,cfg_PushLocalPort+x);
@@ -148,6 +369,10 @@ int						x;
 		return(0);
 		}
 
+	// enable busy polling when configured and watch for kernel drops
+	busypoll_socket(udpsocket[x].sock);
+	dropwatch_socket(udpsocket[x].sock);
+
 	// set socket to nonblocking mode
 	ret = fcntl(udpsocket[x].sock,F_SETFL,O_NONBLOCK);
 
@@ -169,12 +394,15 @@ int						x;
 		g_log->LogMessage(LOG_ERR,"Error %d returned from bind(server)\n",errno);
 		return(0);
 		}
+
+	// queue the forwarded queries so they go out with sendmmsg
+	if (cfg_SendBatch > 1) udpbatch[x] = new PacketBatch(udpsocket[x].sock,cfg_SendBatch,&g_serversendcalls,&g_serversendpackets);
 	}
 
 g_log->LogMessage(LOG_DEBUG,"Setting up server epoll engine\n");
 
 // allocate an epoll thingy large enough to hold all interfaces
-pollsock = epoll_create(cfg_PushLocalCount + (cfg_SessionLimit * 2));
+pollsock = epoll_create(cfg_PushLocalCount + tcptotal);
 
 	if (pollsock < 0)
 	{
@@ -182,15 +410,58 @@ pollsock = epoll_create(cfg_PushLocalCount + (cfg_SessionLimit * 2));
 	return(0);
 	}
 
-	// add each UDP socket to the epoll
+// the filter threads use this to wake us when they start the first
+// query timer so we never sleep through the deadline
+wakeportal.sock = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (wakeportal.sock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from eventfd(server)\n",errno);
+	wakeportal.sock = 0;
+	return(0);
+	}
+
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = &wakeportal;
+evt.events = EPOLLIN;
+epoll_ctl(pollsock,EPOLL_CTL_ADD,wakeportal.sock,&evt);
+
+	// when configured we try to use io_uring and fall back to epoll
+	if (cfg_UringEngine != 0)
+	{
+	g_log->LogMessage(LOG_DEBUG,"Setting up server io_uring engine\n");
+	uring = new UringEngine();
+	ret = uring->Startup(cfg_UringBuffers,cfg_UringBuffers,DNSBUFFER);
+
+		if (ret == 0)
+		{
+		g_log->LogMessage(LOG_WARNING,"Server unable to use io_uring so falling back to epoll\n");
+		delete(uring);
+		uring = NULL;
+		}
+
+	// every buffer needs room for the kernel drop count
+	if (uring != NULL) uring->EnableControl(CTRLBUFFER);
+	}
+
+	// add each UDP socket to the epoll or the io_uring
 	for(x = 0;x < cfg_PushLocalCount;x++)
 	{
+		if (uring != NULL)
+		{
+		uring->ArmRecvMessage(udpsocket[x].sock,(unsigned long)&udpsocket[x]);
+		continue;
+		}
+
 	memset(&evt,0,sizeof(evt));
 	evt.data.ptr = &udpsocket[x];
-	evt.events = EPOLLIN;
+	evt.events = (cfg_EdgeTrigger != 0 ? EPOLLIN | EPOLLET : EPOLLIN);
 	epoll_ctl(pollsock,EPOLL_CTL_ADD,udpsocket[x].sock,&evt);
 	}
 
+// with io_uring the epoll holding the TCP sockets is polled by the ring
+if (uring != NULL) uring->ArmPoll(pollsock,0);
+
 return(1);
 }
 /*--------------------------------------------------------------------------*/
@@ -202,158 +473,184 @@ int		x;
 g_log->LogMessage(LOG_DEBUG,"Shutting down server epoll engine\n");
 close(pollsock);
 
+	// close the io_uring which cancels all outstanding requests
+	if (uring != NULL)
+	{
+	delete(uring);
+	uring = NULL;
+	}
+
 	for(x = 0;x < cfg_PushLocalCount;x++)
 	{
 	g_log->LogMessage(LOG_INFO,"Disconnecting ServerNetwork from %s:%d\n",cfg_PushLocalAddr,cfg_PushLocalPort+x);
 
+	// the filter threads can still be forwarding and flushing queries
+	// while we shut down so they have to see the batch is gone
+	batchlock.Acquire();
+
+		if (udpbatch[x] != NULL)
+		{
+		udpbatch[x]->FlushBatch();
+		delete(udpbatch[x]);
+		udpbatch[x] = NULL;
+		}
+
+	batchlock.Release();
+
 		if (udpsocket[x].sock > 0)
 		{
 		shutdown(udpsocket[x].sock,SHUT_RDWR);
 		close(udpsocket[x].sock);
 		}
 	}
+
+// free the batch receive buffers
+if (batchmsg != NULL) free(batchmsg);
+if (batchvec != NULL) free(batchvec);
+if (batchaddr != NULL) free(batchaddr);
+if (batchbuffer != NULL) free(batchbuffer);
+if (batchctrl != NULL) free(batchctrl);
+batchmsg = NULL;
+batchvec = NULL;
+batchaddr = NULL;
+batchbuffer = NULL;
+batchctrl = NULL;
 }
 /*--------------------------------------------------------------------------*/
 int ServerNetwork::SessionCleanup(int argForce)
 {
-struct netportal	*item,*next;
-time_t				current;
+struct netportal	*item;
+struct timernode	*timer,*after;
+long long			current,expires;
 char				textaddr[32];
-int					total;
+int					total,x;
 
-// get the current time and initialize local variables
-current = time(NULL);
-item = tcpactive;
 total = 0;
 
-	// look at every item in the linked list
-	while (item != NULL)
+	// when forced we close every session in the pool
+	if (argForce != 0)
 	{
-	// save pointer to next
-	next = item->next;
-
-		// if the item is stale or force is set we delete
-		if (((current - item->created) > cfg_SessionTimeout) || (argForce != 0))
+		for(x = 0;x < tcptotal;x++)
 		{
-		inet_ntop(AF_INET,&item->addr.sin_addr,textaddr,sizeof(textaddr));
-		g_log->LogMessage(LOG_DEBUG,"Removing stale server TCP session for %s:%d\n",textaddr,htons(item->addr.sin_port));
-		RemoveSession(item);
+		if (tcppool[x].sock <= 0) continue;
+		RemoveSession(&tcppool[x]);
 		total++;
 		}
 
-	// adjust our working pointer
-	item = next;
+	return(total);
 	}
 
-return(total);
-}
-/*--------------------------------------------------------------------------*/
-void ServerNetwork::RemoveSession(struct netportal *argPortal)
-{
-struct epoll_event	evt;
-int					ret;
-
-// remove the socket from the epoll - note that evt isn't used but
-// we pass it to prevent a bug in case the kernel version < 2.3.9
-memset(&evt,0,sizeof(evt));
-ret = epoll_ctl(pollsock,EPOLL_CTL_DEL,argPortal->sock,&evt);
+// get the list of session timers that have expired while holding the
+// lock since the filter threads add timers when they open sessions
+current = TimerWheel::NowMilliseconds();
+tcplock.Acquire();
+timer = tcpwheel->ExpireTimers(current);
+tcplock.Release();
 
-	// unexpected error so spew a message and clear the running flag
-	if (ret != 0)
+	while (timer != NULL)
 	{
-	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(server)\n",errno);
-	running = 0;
-	}
+	// save pointer to next
+	after = timer->next;
+	item = (netportal *)timer->owner;
+	expires = (item->active + (cfg_SessionTimeout * 1000));
 
-// shutdown and close the socket
-shutdown(argPortal->sock,SHUT_RDWR);
-close(argPortal->sock);
+		// a session that was active since the timer was started gets
+		// the timer started again for the rest of the timeout
+		if (expires > current)
+		{
+		tcplock.Acquire();
+		tcpwheel->InsertTimer(&item->timer,expires);
+		tcplock.Release();
+		timer = after;
+		continue;
+		}
 
-// remove the netportal from the double linked list
-if (argPortal->last != NULL) argPortal->last->next = argPortal->next;
-if (argPortal->next != NULL) argPortal->next->last = argPortal->last;
+	inet_ntop(AF_INET,&item->addr.sin_addr,textaddr,sizeof(textaddr));
+	g_log->LogMessage(LOG_DEBUG,"Closing idle server TCP session for %s:%d\n",textaddr,htons(item->addr.sin_port));
+	RemoveSession(item);
+	total++;
 
-// if the item we deleted was first in the list adjust the pointer
-if (tcpactive == argPortal) tcpactive = argPortal->next;
+	// adjust our working pointer
+	timer = after;
+	}
 
-// delete the object and decrement the session counter
-delete(argPortal);
-tcpcount--;
+return(total);
 }
 /*--------------------------------------------------------------------------*/
-int ServerNetwork::ForwardTCPQuery(ProxyEntry *argEntry)
+int ServerNetwork::OpenSession(struct netportal *argPortal,int argGrid,int argUpstream)
 {
 struct epoll_event	evt;
-struct netportal	*network;
-unsigned short		prefix;
-unsigned short		*qid;
 sockaddr_in			source;
-int					ret;
-int					total;
+int					val,ret;
 
-// create new network object and initiate outbound connection
-network = new netportal();
-memset(network,0,sizeof(struct netportal));
-network->sock = socket(PF_INET,SOCK_STREAM,0);
+// the caller holds the tcplock and we start the connection in
+// nonblocking mode so the filter thread never waits for the server
+argPortal->sock = socket(PF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
 
-	if (network->sock == -1)
+	if (argPortal->sock == -1)
 	{
 	g_log->LogMessage(LOG_WARNING,"Error %d returned from socket(server)\n",errno);
-	delete(network);
+	argPortal->sock = 0;
 	return(0);
 	}
 
+// enable busy polling when configured
+busypoll_socket(argPortal->sock);
+
+// the queries are small and pipelined so send each one right away
+val = 1;
+setsockopt(argPortal->sock,IPPROTO_TCP,TCP_NODELAY,(char *)&val,sizeof(val));
+
 // bind the socket to our forwarding interface
 memset(&source,0,sizeof(source));
 source.sin_family = AF_INET;
 source.sin_port = 0;
 source.sin_addr.s_addr = inet_addr(cfg_PushLocalAddr);
-ret = bind(network->sock,(struct sockaddr *)&source,sizeof(source));
+ret = bind(argPortal->sock,(struct sockaddr *)&source,sizeof(source));
 
 	if (ret == -1)
 	{
 	g_log->LogMessage(LOG_ERR,"Error %d returned from bind(server)\n",errno);
-	delete(network);
+	close(argPortal->sock);
+	argPortal->sock = 0;
 	return(0);
 	}
 
-// establish a connection with the external server
-memset(&network->addr,0,sizeof(network->addr));
-network->addr.sin_family = AF_INET;
-network->addr.sin_port = ntohs(cfg_PushServerPort);
-network->addr.sin_addr.s_addr = inet_addr(cfg_PushServerAddr);
-ret = connect(network->sock,(struct sockaddr *)&network->addr,sizeof(network->addr));
+// start the connection with the upstream server
+memcpy(&argPortal->addr,&upstreamlist[argUpstream].addr,sizeof(argPortal->addr));
+ret = connect(argPortal->sock,(struct sockaddr *)&argPortal->addr,sizeof(argPortal->addr));
 
-// replace the inbound query id with our index
-qid = (unsigned short *)&argEntry->rawquery[0];
-*qid = htons(argEntry->myslot);
+	if ((ret == -1) && (errno != EINPROGRESS))
+	{
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from connect(server)\n",errno);
+	close(argPortal->sock);
+	argPortal->sock = 0;
+	return(0);
+	}
 
-// now forward the query to the external server
-prefix = htons(argEntry->rawqsize);
-memcpy(&netbuffer[0],&prefix,sizeof(prefix));
-total = sizeof(prefix);
-memcpy(&netbuffer[total],argEntry->rawquery,argEntry->rawqsize);
-total+=argEntry->rawqsize;
-
-g_log->LogMessage(LOG_DEBUG,"ServerNetwork TCP forwarding index %d-%d\n",argEntry->mygrid,argEntry->myslot);
-send(network->sock,netbuffer,total,MSG_DONTWAIT);
-
-// add the new network objet to the double linked list
-network->created = time(NULL);
-network->proto = IPPROTO_TCP;
-network->next = tcpactive;
-network->ifidx = argEntry->mygrid;
-network->length = 0;
-network->next = NULL;
-network->last = NULL;
-if (tcpactive != NULL) tcpactive->last = network;
-tcpactive = network;
-
-// add the new socket to the epoll
+argPortal->proto = IPPROTO_TCP;
+argPortal->ifidx = argGrid;
+argPortal->incount = 0;
+argPortal->outcount = 0;
+
+	// the read buffer stays with the pool when the session is closed
+	if (argPortal->inbuffer == NULL)
+	{
+	argPortal->insize = TCPBUFFER;
+	argPortal->inbuffer = (char *)malloc(argPortal->insize);
+	}
+
+// start the idle timer for the session
+argPortal->active = TimerWheel::NowMilliseconds();
+argPortal->timer.owner = argPortal;
+tcpwheel->InsertTimer(&argPortal->timer,argPortal->active + (cfg_SessionTimeout * 1000));
+
+// the connection is finished when the socket is writable and any
+// queries sent before then are held in the queue
 memset(&evt,0,sizeof(evt));
-evt.data.ptr = network;
-evt.events = EPOLLIN;
-ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,network->sock,&evt);
+evt.data.ptr = argPortal;
+evt.events = argPortal->events = (EPOLLIN | EPOLLOUT);
+ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,argPortal->sock,&evt);
 
 	// unexpected error so spew a message and clear the running flag
 	if (ret != 0)
@@ -362,169 +659,1131 @@ ret = epoll_ctl(pollsock,EPOLL_CTL_ADD,network->sock,&evt);
 	running = 0;
 	}
 
-// increment the count of active TCP sessions
-tcpcount++;
-
+g_upstreamconnects++;
 return(1);
 }
 /*--------------------------------------------------------------------------*/
-int ServerNetwork::ForwardUDPQuery(ProxyEntry *argEntry)
+void ServerNetwork::RemoveSession(struct netportal *argPortal)
 {
-sockaddr_in		target;
-unsigned short	*qid;
-int				ret;
+struct epoll_event	evt;
+int					ret;
 
-// replace the inbound query id with our index
-qid = (unsigned short *)&argEntry->rawquery[0];
-*qid = htons(argEntry->myslot);
+// the filter threads send on the session and open it again once it
+// has been closed so everything is changed while holding the lock
+tcplock.Acquire();
 
-// now forward the query to the external server
-g_log->LogMessage(LOG_DEBUG,"ServerNetwork UDP forwarding index %d-%d\n",argEntry->mygrid,argEntry->myslot);
-memset(&target,0,sizeof(target));
-target.sin_family = AF_INET;
-target.sin_port = ntohs(cfg_PushServerPort);
-target.sin_addr.s_addr = inet_addr(cfg_PushServerAddr);
-ret = sendto(udpsocket[argEntry->mygrid].sock,argEntry->rawquery,argEntry->rawqsize,0,(sockaddr *)&target,sizeof(target));
+// remove the socket from the epoll - note that evt isn't used but
+// we pass it to prevent a bug in case the kernel version < 2.3.9
+memset(&evt,0,sizeof(evt));
+ret = epoll_ctl(pollsock,EPOLL_CTL_DEL,argPortal->sock,&evt);
 
-return(ret);
+	// unexpected error so spew a message and clear the running flag
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(server)\n",errno);
+	running = 0;
+	}
+
+tcpwheel->RemoveTimer(&argPortal->timer);
+
+// shutdown and close the socket
+shutdown(argPortal->sock,SHUT_RDWR);
+close(argPortal->sock);
+
+// anything still waiting to be sent or received is thrown away
+argPortal->sock = 0;
+argPortal->incount = 0;
+argPortal->outcount = 0;
+argPortal->events = 0;
+
+tcplock.Release();
 }
 /*--------------------------------------------------------------------------*/
-int ServerNetwork::ProcessTCPReply(netportal *argPortal)
+int ServerNetwork::ForwardTCPQuery(ProxyEntry *argEntry)
 {
-ProxyEntry			*local;
+// nothing to send when the same question is already on the way
+if (g_table->InsertFlight(argEntry) == 0) return(1);
+
+// pick the server and start the timer before the reply can arrive
+StartQuery(argEntry);
+
+return(SendTCPQuery(argEntry,argEntry->netupstream));
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::SendTCPQuery(ProxyEntry *argEntry,int argUpstream)
+{
+struct netportal	*portal;
+struct iovec		vec[2];
 unsigned short		prefix;
-unsigned short		index;
 unsigned short		*qid;
-void				*buffer;
-char				textaddr[32];
-char				temp[256];
-int					need,size;
+unsigned short		grid,slot;
+int					ret;
 
-	// if we don't have the length yet we need to read that first
-	if (argPortal->length == 0)
-	{
-	buffer = &prefix;
-	need = sizeof(prefix);
-	}
+// replace the inbound query id with our index
+qid = (unsigned short *)&argEntry->rawquery[0];
+*qid = htons(argEntry->myslot);
 
-	// otherwise we know the length so now receive the data
-	else
-	{
-	buffer = netbuffer;
-	need = argPortal->length;
-	}
+// the reply can arrive and the entry be deleted by another thread
+// as soon as the query is sent so we only use our own copies after
+grid = argEntry->mygrid;
+slot = argEntry->myslot;
+
+// since we are called by the filter threads we send the length prefix
+// and query straight from where they are instead of using netbuffer
+prefix = htons(argEntry->rawqsize);
+vec[0].iov_base = &prefix;
+vec[0].iov_len = sizeof(prefix);
+vec[1].iov_base = argEntry->rawquery;
+vec[1].iov_len = argEntry->rawqsize;
+
+g_log->LogMessage(LOG_DEBUG,"ServerNetwork TCP forwarding index %d-%d\n",grid,slot);
 
-// read the data from the socket
-size = recv(argPortal->sock,buffer,need,MSG_DONTWAIT);
+tcplock.Acquire();
 
-	// if we don't get exactly what we need for any reason, shut it down
-	// this will pick up socket close and blatent protocol violations
-	if (size != need)
+	// the pool is released when the network thread shuts down
+	if (tcppool == NULL)
 	{
-	RemoveSession(argPortal);
+	tcplock.Release();
 	return(0);
 	}
 
-	// if we just grabbed the length save it and return
-	if (argPortal->length == 0)
+// the queries for each grid are spread across the sessions in the
+// pool for that grid and server and the replies are matched by query
+// id just like they are for UDP
+portal = &tcppool[(((argUpstream * cfg_PushLocalCount) + grid) * cfg_PushTcpPool) + (slot % cfg_PushTcpPool)];
+
+	// open the session when this is the first query to use it or the
+	// server closed it since the last one
+	if (portal->sock <= 0)
 	{
-	// convert to host byte order
-	argPortal->length = ntohs(prefix);
-	return(1);
+	ret = OpenSession(portal,grid,argUpstream);
+	if (ret == 0) { tcplock.Release(); return(0); }
 	}
 
-g_servercount++;
+else g_upstreamreused++;
 
-// extract the inbound address and do some logging
-inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
+ret = SendSession(portal,vec,2);
 
-	if (cfg_LogServerBinary != 0)
+tcplock.Release();
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::SendSession(struct netportal *argPortal,struct iovec *argList,int argCount)
+{
+struct msghdr	msg;
+int				sent,ret,x;
+
+	// the caller holds the tcplock and while the connection is still
+	// being made or earlier queries are waiting for the socket to
+	// drain the new query goes to the end of the queue
+	if (argPortal->events & EPOLLOUT)
 	{
-	sprintf(temp,"SERVER TCP: %d bytes on %s from %s:%d\n",size,cfg_PushLocalAddr,textaddr,htons(argPortal->addr.sin_port));
-	g_log->LogBinary(LOG_DEBUG,temp,netbuffer,size);
+		// a server that stops reading can't hold on to everything
+		if (argPortal->outcount > (cfg_WriteLimit * 4))
+		{
+		g_log->LogMessage(LOG_WARNING,"Discarding query for server TCP session with %d bytes waiting\n",argPortal->outcount);
+		return(0);
+		}
+
+	for(x = 0;x < argCount;x++) AppendSession(argPortal,(char *)argList[x].iov_base,argList[x].iov_len);
+	return(1);
 	}
 
-// grab the query id from the packet
-qid = (unsigned short *)&netbuffer[0];
-index = ntohs(*qid);
+memset(&msg,0,sizeof(msg));
+msg.msg_iov = argList;
+msg.msg_iovlen = argCount;
+ret = sendmsg(argPortal->sock,&msg,MSG_DONTWAIT | MSG_NOSIGNAL);
 
-g_log->LogMessage(LOG_DEBUG,"ServerNetwork received index %d-%d\n",argPortal->ifidx,index);
+// the network thread sees the error when it reads the socket and
+// closes the session so here we just give up on the query
+if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR)) return(0);
 
-// lookup the active query object
-local = g_table->RetrieveObject(argPortal->ifidx,index);
-if (local == NULL) return(0);
+// when the socket is full nothing was sent
+if (ret < 0) ret = 0;
+sent = ret;
 
-	// make sure the response is valid and matches the original question
-	if (size < local->rawqsize)
+// remember the activity so the idle timer is pushed back
+argPortal->active = TimerWheel::NowMilliseconds();
+
+	// queue whatever didn't fit in the socket
+	for(x = 0;x < argCount;x++)
 	{
-	g_log->LogMessage(LOG_WARNING,"Truncated query response received for %d-%d\n",argPortal->ifidx,index);
-	return(0);
+	if (sent >= (int)argList[x].iov_len) { sent-=argList[x].iov_len; continue; }
+	AppendSession(argPortal,(char *)argList[x].iov_base + sent,argList[x].iov_len - sent);
+	sent = 0;
 	}
 
-// insert the server response and push to reply filter queue
-local->InsertReply(netbuffer,size);
-g_rfilter->PushMessage(new ProxyMessage(argPortal->ifidx,index));
+// and watch for the socket to drain
+if (argPortal->outcount != 0) ArmSession(argPortal,EPOLLIN | EPOLLOUT);
 
-RemoveSession(argPortal);
 return(1);
 }
 /*--------------------------------------------------------------------------*/
-int ServerNetwork::ProcessUDPReply(netportal *argPortal)
+void ServerNetwork::AppendSession(struct netportal *argPortal,const char *argData,int argSize)
 {
-ProxyEntry			*local;
-struct sockaddr_in	server;
-unsigned short		index;
-unsigned short		*qid;
-unsigned int		len;
-char				netface[32];
-char				temp[256];
-int					size;
+int		need;
 
-// grab the packet from the socket
-memset(&server,0,sizeof(server));
-len = sizeof(server);
-size = recvfrom(udpsocket[argPortal->ifidx].sock,netbuffer,sizeof(netbuffer),0,(struct sockaddr *)&server,&len);
-if (size == 0) return(0);
+need = (argPortal->outcount + argSize);
 
-	if (size < 0)
+	// grow the queue in big steps to limit the number of copies
+	if (need > argPortal->outsize)
 	{
-	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvfrom(%s)\n",errno,cfg_PushServerAddr);
-	return(0);
+	argPortal->outsize = (need * 2);
+	argPortal->outbuffer = (char *)realloc(argPortal->outbuffer,argPortal->outsize);
 	}
 
-g_servercount++;
+memcpy(&argPortal->outbuffer[argPortal->outcount],argData,argSize);
+argPortal->outcount+=argSize;
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::ArmSession(struct netportal *argPortal,unsigned int argEvents)
+{
+struct epoll_event	evt;
+int					ret;
 
-// extract the inbound address and do some logging
-inet_ntop(AF_INET,&server.sin_addr,netface,sizeof(netface));
+if (argPortal->events == argEvents) return;
 
-	if (cfg_LogServerBinary != 0)
-	{
-	sprintf(temp,"SERVER UDP: %d bytes on %s:%d from %s:%d\n",size,cfg_PushLocalAddr,cfg_PushLocalPort+argPortal->ifidx,netface,htons(server.sin_port));
-	g_log->LogBinary(LOG_DEBUG,temp,netbuffer,size);
-	}
+memset(&evt,0,sizeof(evt));
+evt.data.ptr = argPortal;
+evt.events = argPortal->events = argEvents;
+ret = epoll_ctl(pollsock,EPOLL_CTL_MOD,argPortal->sock,&evt);
+if (ret != 0) g_log->LogMessage(LOG_ERR,"Error %d returned from epoll_ctl(server)\n",errno);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ForwardUDPQuery(ProxyEntry *argEntry)
+{
+// nothing to send when the same question is already on the way
+if (g_table->InsertFlight(argEntry) == 0) return(1);
 
-// grab the query id from the packet
-qid = (unsigned short *)&netbuffer[0];
-index = ntohs(*qid);
+// pick the server and start the timer before the reply can arrive
+StartQuery(argEntry);
 
-g_log->LogMessage(LOG_DEBUG,"ServerNetwork received index %d-%d\n",argPortal->ifidx,index);
+return(SendUDPQuery(argEntry,argEntry->netupstream));
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::SendUDPQuery(ProxyEntry *argEntry,int argUpstream)
+{
+unsigned short	*qid;
+int				ret;
 
-// lookup the active query object
-local = g_table->RetrieveObject(argPortal->ifidx,index);
-if (local == NULL) return(0);
+// replace the inbound query id with our index
+qid = (unsigned short *)&argEntry->rawquery[0];
+*qid = htons(argEntry->myslot);
 
-	// make sure the response is valid and matches the original question
-	if (size < local->rawqsize)
+// now forward the query to the upstream server
+g_log->LogMessage(LOG_DEBUG,"ServerNetwork UDP forwarding index %d-%d to %s\n",argEntry->mygrid,argEntry->myslot,upstreamlist[argUpstream].name);
+
+	// when batching queue the query on the socket for the grid unless
+	// the batch is already gone because we are shutting down
+	if (cfg_SendBatch > 1)
+	{
+	batchlock.Acquire();
+	if (udpbatch[argEntry->mygrid] != NULL) ret = udpbatch[argEntry->mygrid]->InsertPacket(argEntry->rawquery,argEntry->rawqsize,&upstreamlist[argUpstream].addr);
+	else ret = -1;
+	batchlock.Release();
+	return(ret);
+	}
+
+ret = sendto(udpsocket[argEntry->mygrid].sock,argEntry->rawquery,argEntry->rawqsize,0,(sockaddr *)&upstreamlist[argUpstream].addr,sizeof(upstreamlist[argUpstream].addr));
+g_serversendcalls++;
+g_serversendpackets++;
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::FlushQueries(int argDelay)
+{
+int		total;
+int		x;
+
+total = 0;
+
+// the filter threads call this too so the batches are only used
+// while holding the lock that keeps them from being deleted
+batchlock.Acquire();
+
+	// transmit any queries queued on our UDP sockets
+	for(x = 0;x < cfg_PushLocalCount;x++)
+	{
+	if (udpbatch[x] == NULL) continue;
+	total+=udpbatch[x]->FlushBatch(argDelay);
+	}
+
+batchlock.Release();
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::TransmitQuery(ProxyEntry *argEntry,int argUpstream)
+{
+// use TCP for client TCP queries and the ones we retried over TCP
+if ((argEntry->netprotocol == IPPROTO_UDP) && (argEntry->netretry == 0)) return(SendUDPQuery(argEntry,argUpstream));
+return(SendTCPQuery(argEntry,argUpstream));
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::StartQuery(ProxyEntry *argEntry)
+{
+uint64_t		value;
+long long		expires;
+int				ret;
+
+// pick the server and stamp the entry before anything is sent
+argEntry->netattempt = 0;
+argEntry->nethedge = -1;
+argEntry->netupstream = SelectUpstream();
+argEntry->netmask = (1 << argEntry->netupstream);
+argEntry->netsent = TimerWheel::NowMicroseconds();
+
+expires = QueryDeadline(argEntry,argEntry->netsent / 1000);
+
+// the wheel is released when the network thread shuts down
+querylock.Acquire();
+
+	// the network thread only wakes up every query tick while there
+	// are timers running so we wake it for the first one, but not
+	// before the eventfd exists since the socket would be stdin
+	if (querywheel != NULL)
+	{
+	value = (querywheel->TimerCount() == 0 ? 1 : 0);
+	querywheel->InsertTimer(&argEntry->nettimer,expires);
+
+		// a full counter already means the thread will wake up
+		if ((value != 0) && (wakeportal.sock > 0))
+		{
+		ret = write(wakeportal.sock,&value,sizeof(value));
+		if ((ret < 0) && (errno != EAGAIN)) g_log->LogMessage(LOG_WARNING,"Error %d returned from write(eventfd)\n",errno);
+		}
+	}
+
+querylock.Release();
+}
+/*--------------------------------------------------------------------------*/
+long long ServerNetwork::QueryDeadline(ProxyEntry *argEntry,long long argCurrent)
+{
+long long		hedge;
+
+// the wait before we send the query again doubles each time
+argEntry->netdeadline = (argCurrent + ((long long)cfg_RetryTimeout << argEntry->netattempt));
+
+// only the first attempt is hedged and only when there is another
+// server to send the copy to
+if ((cfg_HedgePercent == 0) || (upstreamcount < 2)) return(argEntry->netdeadline);
+if ((argEntry->netattempt != 0) || (argEntry->nethedge >= 0)) return(argEntry->netdeadline);
+
+// the timer goes off early for the hedge if it comes first
+hedge = (argCurrent + ((upstreamlist[argEntry->netupstream].hedge + 999) / 1000));
+return(hedge < argEntry->netdeadline ? hedge : argEntry->netdeadline);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::HedgeQuery(ProxyEntry *argEntry)
+{
+upstream	*local;
+int			target;
+
+local = &upstreamlist[argEntry->netupstream];
+
+// a server that slows down for everyone would otherwise have us
+// sending every query twice so hedges come out of a budget
+if (local->hedgecredit == 0) return(0);
+local->hedgecredit--;
+
+// the copy goes to another server and whichever reply comes first
+// is the one we use
+target = SelectUpstream(argEntry->netupstream);
+argEntry->nethedge = target;
+argEntry->netmask|=(1 << target);
+argEntry->nethedged = TimerWheel::NowMicroseconds();
+g_hedgesent++;
+
+g_log->LogMessage(LOG_DEBUG,"ServerNetwork hedging index %d-%d to %s\n",argEntry->mygrid,argEntry->myslot,upstreamlist[target].name);
+TransmitQuery(argEntry,target);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ClaimQuery(ProxyEntry *argEntry)
+{
+int		ret;
+
+querylock.Acquire();
+
+// a query is only waiting for a reply while the timer is running and
+// anything else is a duplicate or arrived after we gave up
+ret = (argEntry->nettimer.head != NULL ? 1 : 0);
+if (ret != 0) querywheel->RemoveTimer(&argEntry->nettimer);
+
+querylock.Release();
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::CancelQuery(ProxyEntry *argEntry)
+{
+// called when a dirty entry is deleted from the table
+querylock.Acquire();
+if (querywheel != NULL) querywheel->RemoveTimer(&argEntry->nettimer);
+querylock.Release();
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::QueryCleanup(void)
+{
+struct timernode	*timer,*after;
+ProxyEntry			*local;
+long long			current;
+int					total;
+
+total = 0;
+current = TimerWheel::NowMilliseconds();
+
+// we hold the lock while handling the expired queries so a dirty
+// entry can't be deleted from the table while we are using it
+querylock.Acquire();
+timer = querywheel->ExpireTimers(current);
+
+	while (timer != NULL)
+	{
+	// save pointer to next
+	after = timer->next;
+	local = (ProxyEntry *)timer->owner;
+	total++;
+
+		// the timer went off before the deadline so it was for the
+		// hedge and we wait out the rest of the timeout after
+		if (current < local->netdeadline)
+		{
+		HedgeQuery(local);
+		querywheel->InsertTimer(&local->nettimer,local->netdeadline);
+		timer = after;
+		continue;
+		}
+
+		// send the query again to a different server than last time
+		if (local->netattempt < cfg_RetryLimit)
+		{
+		local->netattempt++;
+		local->netupstream = SelectUpstream(local->netupstream);
+		local->netmask|=(1 << local->netupstream);
+		local->netsent = TimerWheel::NowMicroseconds();
+		querywheel->InsertTimer(&local->nettimer,QueryDeadline(local,current));
+		g_log->LogMessage(LOG_DEBUG,"ServerNetwork retransmitting index %d-%d\n",local->mygrid,local->myslot);
+		g_upstreamretry++;
+
+		TransmitQuery(local,local->netupstream);
+		timer = after;
+		continue;
+		}
+
+	// out of retries so the entry goes to the reply filter which sends
+	// it to the client and cleans up, and a query we retried over TCP
+	// still has the truncated reply which is better than SERVFAIL
+	g_log->LogMessage(LOG_DEBUG,"ServerNetwork giving up on index %d-%d\n",local->mygrid,local->myslot);
+
+		if ((local->netretry == 0) || (local->rawreply == NULL))
+		{
+		local->InsertFailure();
+		g_upstreamfailed++;
+		}
+
+	g_rfilter->PushMessage(new ProxyMessage(local->mygrid,local->myslot));
+	timer = after;
+	}
+
+querylock.Release();
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::LoadUpstreams(void)
+{
+upstream	*local;
+char		buffer[256];
+char		*item,*colon,*save;
+int			count,port;
+
+memset(upstreamlist,0,sizeof(upstreamlist));
+count = 0;
+
+strncpy(buffer,cfg_PushServerAddr,sizeof(buffer));
+buffer[sizeof(buffer) - 1] = 0;
+
+	// the servers are separated by commas or spaces and each one
+	// can have its own port after the address
+	for(item = strtok_r(buffer,", \t",&save);item != NULL;item = strtok_r(NULL,", \t",&save))
+	{
+		if (count == UPSTREAMLIMIT)
+		{
+		g_log->LogMessage(LOG_WARNING,"Ignoring upstream servers past the limit of %d\n",UPSTREAMLIMIT);
+		break;
+		}
+
+	port = cfg_PushServerPort;
+	colon = strchr(item,':');
+	if (colon != NULL) *colon = 0;
+	if (colon != NULL) port = atoi(&colon[1]);
+
+	local = &upstreamlist[count];
+	local->addr.sin_family = AF_INET;
+	local->addr.sin_port = htons(port);
+
+		if ((port < 1) || (port > 65535) || (inet_pton(AF_INET,item,&local->addr.sin_addr) != 1))
+		{
+		g_log->LogMessage(LOG_WARNING,"Ignoring invalid upstream server %s\n",item);
+		memset(local,0,sizeof(upstream));
+		continue;
+		}
+
+	// until we have a real sample every server looks the same
+	snprintf(local->name,sizeof(local->name),"%s:%d",item,port);
+	local->srtt = UPSTREAMRTT;
+	local->rttvar = (UPSTREAMRTT / 2);
+	local->hedge = (cfg_HedgePercent != 0 ? local->srtt + (4 * local->rttvar) : 0);
+	count++;
+	}
+
+return(count);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::SelectUpstream(int argExclude)
+{
+upstream	*local;
+long long	current,last;
+long long	score,best;
+int			target,x;
+
+current = TimerWheel::NowMilliseconds();
+target = -1;
+best = 0;
+
+	for(x = 0;x < upstreamcount;x++)
+	{
+	// skip the server we are told to avoid unless it's the only one
+	if ((x == argExclude) && (upstreamcount > 1)) continue;
+
+	local = &upstreamlist[x];
+	last = __atomic_load_n(&local->lastsent,__ATOMIC_RELAXED);
+
+		// a server that hasn't been used for a while gets this query
+		// as a probe so one that was slow or down can earn its way
+		// back, and only the thread that wins the exchange sends it
+		if ((current - last) >= cfg_ProbeInterval)
+		{
+			if (__atomic_compare_exchange_n(&local->lastsent,&last,current,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED) != 0)
+			{
+			__atomic_fetch_add(&local->probes,1,__ATOMIC_RELAXED);
+			target = x;
+			break;
+			}
+		}
+
+	// otherwise we want the lowest expected latency counting each
+	// lost query as the time the client waits before trying again
+	score = (local->srtt + ((long long)local->loss * LOSSPENALTY));
+	if ((target >= 0) && (score >= best)) continue;
+	best = score;
+	target = x;
+	}
+
+local = &upstreamlist[target];
+__atomic_store_n(&local->lastsent,current,__ATOMIC_RELAXED);
+__atomic_fetch_add(&local->sent,1,__ATOMIC_RELAXED);
+__atomic_fetch_add(&local->queries,1,__ATOMIC_RELAXED);
+
+return(target);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::FindUpstream(struct sockaddr_in *argAddr)
+{
+int		x;
+
+	for(x = 0;x < upstreamcount;x++)
+	{
+	if (argAddr->sin_addr.s_addr != upstreamlist[x].addr.sin_addr.s_addr) continue;
+	if (argAddr->sin_port != upstreamlist[x].addr.sin_port) continue;
+	return(x);
+	}
+
+return(-1);
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::SampleUpstream(ProxyEntry *argEntry,int argUpstream)
+{
+upstream	*local;
+long long	sent;
+int			sample,delta,valid;
+
+// only the network thread updates the estimates so they need no lock
+local = &upstreamlist[argUpstream];
+
+	// the late copy of a query another server already answered still
+	// shows this one is up so it isn't counted as lost
+	if (argEntry == NULL)
+	{
+	local->answered++;
+	__atomic_fetch_add(&local->replies,1,__ATOMIC_RELAXED);
+	return;
+	}
+
+// the hedge has its own send time
+sent = (argUpstream == argEntry->nethedge ? argEntry->nethedged : argEntry->netsent);
+sample = (int)(TimerWheel::NowMicroseconds() - sent);
+if (sample < 0) sample = 0;
+
+// like TCP we take no sample from a query that was sent more than once
+// since we can't tell which one the reply is for, but the hedge and the
+// first attempt each went to their server only once
+valid = 0;
+if (argUpstream == argEntry->nethedge) valid = 1;
+if ((argUpstream == argEntry->netupstream) && (argEntry->netattempt == 0)) valid = 1;
+if ((valid != 0) && (argUpstream == argEntry->nethedge)) g_hedgewins++;
+
+	// the first sample replaces the guess we started with
+	if ((valid != 0) && (local->replies == 0))
+	{
+	local->srtt = sample;
+	local->rttvar = (sample / 2);
+	}
+
+	// after that we smooth them the same way as TCP does
+	else if (valid != 0)
+	{
+	delta = (local->srtt > sample ? local->srtt - sample : sample - local->srtt);
+	local->rttvar+=((delta - local->rttvar) / 4);
+	local->srtt+=((sample - local->srtt) / 8);
+	}
+
+// the histogram gives us the percentile for hedging
+if (valid != 0) local->histogram[RttBucket(sample)]++;
+
+// replies are credited to the window the query was sent in so the
+// ones that cross a window boundary aren't counted as lost
+if (sent >= (lastsample * 1000)) local->answered++;
+else if (sent >= ((lastsample - UPSTREAMWINDOW) * 1000)) local->late++;
+
+__atomic_fetch_add(&local->replies,1,__ATOMIC_RELAXED);
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::UpdateUpstreams(void)
+{
+upstream		*local;
+long long		current;
+unsigned int	sent,answered;
+int				sample,x;
+
+current = TimerWheel::NowMilliseconds();
+if ((current - lastsample) < UPSTREAMWINDOW) return;
+lastsample = current;
+
+	// the loss rate is the share of queries that were not answered and
+	// we score each window one window late so the replies to queries sent
+	// near the end have time to arrive
+	for(x = 0;x < upstreamcount;x++)
+	{
+	local = &upstreamlist[x];
+	sent = local->pending;
+	answered = local->late;
+	local->pending = __atomic_exchange_n(&local->sent,0,__ATOMIC_RELAXED);
+	local->late = local->answered;
+	local->answered = 0;
+
+	// each server can have a share of the queries it got in the window
+	// that just ended hedged during the next one
+	local->hedgecredit = (((local->pending * HEDGEBUDGET) / 100) + 1);
+	UpdateHedge(local);
+
+	if (sent == 0) continue;
+
+	sample = (answered >= sent ? 0 : (int)(((unsigned long long)(sent - answered) * 1000) / sent));
+	local->loss+=((sample - local->loss) / 4);
+
+	g_log->LogMessage(LOG_DEBUG,"UPSTREAM %s SRTT:%d RTTVAR:%d LOSS:%d HEDGE:%d SENT:%u ANSWERED:%u\n",local->name,local->srtt,local->rttvar,local->loss,local->hedge,sent,answered);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::UpdateHedge(upstream *argServer)
+{
+unsigned long long	total,count,target;
+int					x;
+
+// nothing to do when hedging is disabled
+if (cfg_HedgePercent == 0) return;
+
+total = 0;
+for(x = 0;x < RTTBUCKETS;x++) total+=argServer->histogram[x];
+
+	// until there are enough samples for a percentile we use the same
+	// timeout TCP would
+	if (total < (unsigned long long)HEDGESAMPLES)
+	{
+	argServer->hedge = (argServer->srtt + (4 * argServer->rttvar));
+	return;
+	}
+
+// find the bucket that holds the percentile and use the top of it
+target = (((total * cfg_HedgePercent) + 99) / 100);
+count = 0;
+
+	for(x = 0;x < (RTTBUCKETS - 1);x++)
+	{
+	count+=argServer->histogram[x];
+	if (count >= target) break;
+	}
+
+argServer->hedge = BucketLimit(x);
+
+// halve the counts each window so the recent samples count the most
+for(x = 0;x < RTTBUCKETS;x++) argServer->histogram[x]/=2;
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::RttBucket(int argSample)
+{
+int		msb,bucket;
+
+// each power of two is split in four so the buckets are never more
+// than a quarter wider than the samples they hold
+if (argSample < 4) return(argSample);
+msb = (31 - __builtin_clz(argSample));
+bucket = (((msb - 1) * 4) + ((argSample >> (msb - 2)) & 3));
+
+return(bucket < RTTBUCKETS ? bucket : (RTTBUCKETS - 1));
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::BucketLimit(int argBucket)
+{
+int		shift;
+
+// the microseconds just past the top of the bucket
+if (argBucket < 4) return(argBucket + 1);
+shift = ((argBucket / 4) - 1);
+
+return(((4 + (argBucket % 4)) << shift) + (1 << shift));
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::ReportUpstreams(void)
+{
+upstream	*local;
+int			x;
+
+	for(x = 0;x < upstreamcount;x++)
+	{
+	local = &upstreamlist[x];
+	g_log->LogMessage(LOG_INFO,"UPSTREAM:%s  SRTT:%d.%03d  RTTVAR:%d.%03d  HEDGE:%d.%03d  LOSS:%d.%d%%  QUERIES:%llu  REPLIES:%llu  PROBES:%llu\n",
+		local->name,local->srtt / 1000,local->srtt % 1000,local->rttvar / 1000,local->rttvar % 1000,local->hedge / 1000,local->hedge % 1000,
+		local->loss / 10,local->loss % 10,local->queries,local->replies,local->probes);
+	}
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ProcessTCPWrite(netportal *argPortal)
+{
+socklen_t		len;
+char			textaddr[32];
+int				error;
+int				ret;
+
+tcplock.Acquire();
+
+	// the session may have been closed by an earlier event
+	if ((argPortal->sock <= 0) || ((argPortal->events & EPOLLOUT) == 0))
+	{
+	tcplock.Release();
+	return(0);
+	}
+
+// the first event after the connect tells us if it worked
+error = 0;
+len = sizeof(error);
+getsockopt(argPortal->sock,SOL_SOCKET,SO_ERROR,&error,&len);
+
+// send everything that was waiting for the connection or the socket
+ret = 0;
+if ((error == 0) && (argPortal->outcount != 0)) ret = send(argPortal->sock,argPortal->outbuffer,argPortal->outcount,MSG_DONTWAIT | MSG_NOSIGNAL);
+if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR) || (errno == ENOTCONN))) ret = 0;
+
+	if ((error != 0) || (ret < 0))
+	{
+	if (error == 0) error = errno;
+	tcplock.Release();
+	inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
+	g_log->LogMessage(LOG_WARNING,"Error %d on server TCP session for %s:%d\n",error,textaddr,htons(argPortal->addr.sin_port));
+	RemoveSession(argPortal);
+	return(0);
+	}
+
+	// remove whatever was sent from the front of the queue
+	if (ret > 0)
+	{
+	argPortal->active = TimerWheel::NowMilliseconds();
+	argPortal->outcount-=ret;
+	if (argPortal->outcount != 0) memmove(argPortal->outbuffer,&argPortal->outbuffer[ret],argPortal->outcount);
+	}
+
+// stop watching for the socket to drain once the queue is empty
+if (argPortal->outcount == 0) ArmSession(argPortal,EPOLLIN);
+
+tcplock.Release();
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ProcessTCPReply(netportal *argPortal)
+{
+unsigned short		prefix;
+int					offset,need,size;
+
+// the session may have been closed by an earlier event
+if (argPortal->sock <= 0) return(0);
+
+// read whatever the server has sent into the space left in the buffer
+size = recv(argPortal->sock,&argPortal->inbuffer[argPortal->incount],argPortal->insize - argPortal->incount,MSG_DONTWAIT);
+
+// nothing to read right now so wait for the next event
+if ((size < 0) && ((errno == EAGAIN) || (errno == EINTR))) return(1);
+
+	// anything else means the server closed the session or an error
+	// and any queries still waiting for a reply on it are lost
+	if (size <= 0)
 	{
-	g_log->LogMessage(LOG_WARNING,"Truncated query response received for %d-%d\n",argPortal->ifidx,index);
+	RemoveSession(argPortal);
 	return(0);
 	}
 
+// remember the activity so the idle timer is pushed back
+argPortal->active = TimerWheel::NowMilliseconds();
+
+argPortal->incount+=size;
+offset = 0;
+
+	// the server may send many replies in one segment and a reply may
+	// be split across segments so we take every complete message
+	while ((argPortal->incount - offset) >= (int)sizeof(prefix))
+	{
+	memcpy(&prefix,&argPortal->inbuffer[offset],sizeof(prefix));
+	need = ntohs(prefix);
+	if ((argPortal->incount - offset - (int)sizeof(prefix)) < need) break;
+
+	InsertTCPReply(argPortal,&argPortal->inbuffer[offset + sizeof(prefix)],need);
+	offset+=(sizeof(prefix) + need);
+	}
+
+// move any partial message to the front of the buffer
+argPortal->incount-=offset;
+if ((offset != 0) && (argPortal->incount != 0)) memmove(argPortal->inbuffer,&argPortal->inbuffer[offset],argPortal->incount);
+
+	// grow the buffer when the next message won't fit
+	if (argPortal->incount >= (int)sizeof(prefix))
+	{
+	memcpy(&prefix,argPortal->inbuffer,sizeof(prefix));
+	need = (ntohs(prefix) + sizeof(prefix));
+
+		if (need > argPortal->insize)
+		{
+		argPortal->inbuffer = (char *)realloc(argPortal->inbuffer,need);
+		argPortal->insize = need;
+		}
+	}
+
+return(size);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::InsertTCPReply(netportal *argPortal,const char *argBuffer,int argSize)
+{
+ProxyEntry			*local;
+unsigned short		index;
+unsigned short		*qid;
+char				textaddr[32];
+char				temp[256];
+int					server,ret;
+
+g_servercount++;
+
+// extract the inbound address and do some logging
+inet_ntop(AF_INET,&argPortal->addr.sin_addr,textaddr,sizeof(textaddr));
+
+	if (cfg_LogServerBinary != 0)
+	{
+	sprintf(temp,"SERVER TCP: %d bytes on %s from %s:%d\n",argSize,cfg_PushLocalAddr,textaddr,htons(argPortal->addr.sin_port));
+	g_log->LogBinary(LOG_DEBUG,temp,argBuffer,argSize);
+	}
+
+	// make sure we have at least the query id
+	if (argSize < 2) return(0);
+
+// grab the query id from the packet
+qid = (unsigned short *)&argBuffer[0];
+index = ntohs(*qid);
+
+g_log->LogMessage(LOG_DEBUG,"ServerNetwork received index %d-%d\n",argPortal->ifidx,index);
+
+// the session was opened to one of our servers
+server = FindUpstream(&argPortal->addr);
+if (server < 0) return(0);
+
+// claim the active query object
+ret = g_table->ClaimObject(argPortal->ifidx,index,argBuffer,argSize,server);
+
+	// the entry is gone or we weren't waiting for the reply when another
+	// server already answered this one so we count the late copy and drop it
+	if (ret == CLAIM_LATE)
+	{
+	g_log->LogMessage(LOG_DEBUG,"Ignoring late reply for %d-%d\n",argPortal->ifidx,index);
+	SampleUpstream(NULL,server);
+	g_latereplies++;
+	return(0);
+	}
+
+	// the reply came from a server we never sent the query to
+	if (ret == CLAIM_SERVER)
+	{
+	g_log->LogMessage(LOG_DEBUG,"Ignoring reply for %d-%d from %s:%d\n",argPortal->ifidx,index,textaddr,htons(argPortal->addr.sin_port));
+	return(0);
+	}
+
+// the query is ours now so it is safe to use the entry
+local = g_table->RetrieveObject(argPortal->ifidx,index);
+
+// update the server stats before the entry goes to another thread
+SampleUpstream(local,server);
+
 // insert the server response and push to reply filter queue
-local->InsertReply(netbuffer,size);
+local->InsertReply(argBuffer,argSize);
 g_rfilter->PushMessage(new ProxyMessage(argPortal->ifidx,index));
 
 return(1);
 }
 /*--------------------------------------------------------------------------*/
+int ServerNetwork::ProcessUDPReply(netportal *argPortal)
+{
+struct sockaddr_in	server;
+struct msghdr		msg;
+struct iovec		vec;
+ProxyMessage		*message;
+int					size;
+
+// use the batched receive logic when enabled
+if (cfg_RecvBatch > 1) return(ProcessUDPBatch(argPortal));
+
+// grab the packet from the socket along with the kernel drop count
+memset(&server,0,sizeof(server));
+memset(&msg,0,sizeof(msg));
+vec.iov_base = netbuffer;
+vec.iov_len = sizeof(netbuffer);
+msg.msg_iov = &vec;
+msg.msg_iovlen = 1;
+msg.msg_name = &server;
+msg.msg_namelen = sizeof(server);
+msg.msg_control = netcontrol;
+msg.msg_controllen = sizeof(netcontrol);
+size = recvmsg(udpsocket[argPortal->ifidx].sock,&msg,MSG_DONTWAIT);
+
+	if (size < 0)
+	{
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(-1);
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvmsg(%s:%d)\n",errno,cfg_PushLocalAddr,cfg_PushLocalPort+argPortal->ifidx);
+	return(0);
+	}
+
+g_serverrecvcalls++;
+g_serverrecvpackets++;
+
+// count anything the kernel dropped because the socket was full
+check_dropcount(&udpsocket[argPortal->ifidx],&msg,g_serverdrops);
+
+message = InsertUDPReply(argPortal,netbuffer,size,&server);
+if (message != NULL) g_rfilter->PushMessage(message);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::ProcessUDPBatch(netportal *argPortal)
+{
+MessageFrame		*list[BATCHLIMIT];
+ProxyMessage		*message;
+int					count;
+int					ret,x;
+
+	// reset the address length and flags for every message in the batch
+	for(x = 0;x < cfg_RecvBatch;x++)
+	{
+	batchmsg[x].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	batchmsg[x].msg_hdr.msg_controllen = CTRLBUFFER;
+	batchmsg[x].msg_hdr.msg_flags = 0;
+	batchmsg[x].msg_len = 0;
+	}
+
+// grab as many replies as are waiting up to the batch limit
+ret = recvmmsg(udpsocket[argPortal->ifidx].sock,batchmsg,cfg_RecvBatch,MSG_DONTWAIT,NULL);
+if (ret == 0) return(-1);
+
+	if (ret < 0)
+	{
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return(-1);
+	g_log->LogMessage(LOG_WARNING,"Error %d returned from recvmmsg(%s:%d)\n",errno,cfg_PushLocalAddr,cfg_PushLocalPort+argPortal->ifidx);
+	return(0);
+	}
+
+g_serverrecvcalls++;
+g_serverrecvpackets+=ret;
+
+count = 0;
+
+	for(x = 0;x < ret;x++)
+	{
+	// count anything the kernel dropped because the socket was full
+	check_dropcount(&udpsocket[argPortal->ifidx],&batchmsg[x].msg_hdr,g_serverdrops);
+
+	// match the reply to the query and save the message for the batch
+	message = InsertUDPReply(argPortal,(char *)batchvec[x].iov_base,batchmsg[x].msg_len,&batchaddr[x]);
+	if (message != NULL) list[count++] = message;
+	}
+
+// hand the entire batch to the reply filter queue
+g_rfilter->PushBatch(list,count);
+
+return(ret);
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::DrainUDPSocket(netportal *argPortal)
+{
+int		total;
+int		ret;
+
+total = 0;
+
+	// keep reading until the socket is empty or we reach the fairness
+	// limit and count every pass so a socket error can't loop forever
+	while (total < cfg_DrainLimit)
+	{
+	ret = ProcessUDPReply(argPortal);
+	if (ret < 0) return(total);
+	total+=(ret > 0 ? ret : 1);
+	}
+
+	// with edge triggered epoll we won't get another event for data
+	// that is already waiting so we remember the socket and come
+	// back to it once everyone else has had a turn
+	if (argPortal->ready == 0)
+	{
+	argPortal->ready = 1;
+	readylist[readycount++] = argPortal;
+	g_draincapped++;
+	}
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void ServerNetwork::ProcessReadyList(void)
+{
+netportal	*list[SOCKLIMIT];
+int			count,x;
+
+if (readycount == 0) return;
+
+// take the current list so a socket that hits the limit again
+// goes to the back of the line behind the new epoll events
+count = readycount;
+memcpy(list,readylist,count * sizeof(netportal *));
+readycount = 0;
+
+	for(x = 0;x < count;x++)
+	{
+	list[x]->ready = 0;
+	DrainUDPSocket(list[x]);
+	}
+}
+/*--------------------------------------------------------------------------*/
+int ServerNetwork::BusyTimeout(int argTimeout)
+{
+long long		current;
+
+current = TimerWheel::NowMilliseconds();
 
+	// still inside the idle period since the last traffic so we poll
+	// without blocking and let the kernel busy poll the device queue
+	if ((current - lastbusy) < cfg_BusyIdle)
+	{
+	spincount++;
+	return(0);
+	}
+
+	// the spinning just ended so count it and go back to blocking
+	if (spincount != 0)
+	{
+	g_busyspins+=spincount;
+	g_busysleeps++;
+	spincount = 0;
+	}
+
+return(argTimeout);
+}
+/*--------------------------------------------------------------------------*/
+ProxyMessage *ServerNetwork::InsertUDPReply(netportal *argPortal,const char *argBuffer,int argSize,struct sockaddr_in *argServer)
+{
+ProxyEntry			*local;
+unsigned short		index;
+unsigned short		*qid;
+char				netface[32];
+char				temp[256];
+int					server,ret;
+
+g_servercount++;
+
+// extract the inbound address and do some logging
+inet_ntop(AF_INET,&argServer->sin_addr,netface,sizeof(netface));
+
+	if (cfg_LogServerBinary != 0)
+	{
+	sprintf(temp,"SERVER UDP: %d bytes on %s:%d from %s:%d\n",argSize,cfg_PushLocalAddr,cfg_PushLocalPort+argPortal->ifidx,netface,htons(argServer->sin_port));
+	g_log->LogBinary(LOG_DEBUG,temp,argBuffer,argSize);
+	}
+
+	// make sure we have at least the query id
+	if (argSize < 2) return(NULL);
+
+// grab the query id from the packet
+qid = (unsigned short *)&argBuffer[0];
+index = ntohs(*qid);
+
+g_log->LogMessage(LOG_DEBUG,"ServerNetwork received index %d-%d\n",argPortal->ifidx,index);
+
+	// the reply must come from one of our servers
+	server = FindUpstream(argServer);
+
+	if (server < 0)
+	{
+	g_log->LogMessage(LOG_WARNING,"Ignoring reply for %d-%d from %s:%d\n",argPortal->ifidx,index,netface,htons(argServer->sin_port));
+	return(NULL);
+	}
+
+// claim the active query object
+ret = g_table->ClaimObject(argPortal->ifidx,index,argBuffer,argSize,server);
+
+	// the entry is gone or we weren't waiting for the reply when another
+	// server already answered this one so we count the late copy and drop it
+	if (ret == CLAIM_LATE)
+	{
+	g_log->LogMessage(LOG_DEBUG,"Ignoring late reply for %d-%d\n",argPortal->ifidx,index);
+	SampleUpstream(NULL,server);
+	g_latereplies++;
+	return(NULL);
+	}
+
+	// the reply came from a server we never sent the query to
+	if (ret == CLAIM_SERVER)
+	{
+	g_log->LogMessage(LOG_WARNING,"Ignoring reply for %d-%d from %s:%d\n",argPortal->ifidx,index,netface,htons(argServer->sin_port));
+	return(NULL);
+	}
+
+// the query is ours now so it is safe to use the entry
+local = g_table->RetrieveObject(argPortal->ifidx,index);
+
+// update the server stats before the entry goes to another thread
+SampleUpstream(local,server);
+
+// insert the server response and give the caller the message
+// for the reply filter queue
+local->InsertReply(argBuffer,argSize);
+
+return(new ProxyMessage(argPortal->ifidx,index));
+}
+/*--------------------------------------------------------------------------*/
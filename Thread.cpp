@@ -248,6 +248,12 @@ g_log->LogMessage(LOG_INFO,"Thread pool %s starting thread %d\n",Parent->PoolNam
 	Parent->ThreadCallback(local);
 	Parent->LeaveCallback();
 	delete(local);
+
+	// when the queue has been drained let the pool know so it
+	// can finish any work that was held back for batching
+	check = 0;
+	ret = sem_getvalue(&Parent->MessageSignal,&check);
+	if ((ret == 0) && (check == 0)) Parent->ThreadDrained();
 	}
 
 g_log->LogMessage(LOG_INFO,"Thread pool %s stopping thread %d\n",Parent->PoolName,ThreadNumber);
@@ -0,0 +1,157 @@
+// TimerWheel.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The TimerWheel class tracks a large number of timers so each one
+	can be started, stopped, and expired in constant time.  Timers are
+	kept in a hierarchy of wheels where each level has WHEELSIZE slots
+	and each slot covers WHEELSIZE times as many ticks as a slot on the
+	level below.  A timer is placed on the lowest level that can hold
+	its deadline, and when the low level wraps around the next slot on
+	the level above is cascaded down so those timers land in the exact
+	slot where they expire.  The timernode is embedded in the object
+	being timed so no memory is allocated when timers are started and
+	the owner pointer leads back to the object.  The class does no
+	locking so callers that share a wheel between threads must do it.
+*/
+
+/*--------------------------------------------------------------------------*/
+TimerWheel::TimerWheel(int argTick)
+{
+memset(wheel,0,sizeof(wheel));
+tick = argTick;
+current = (NowMilliseconds() / tick);
+count = 0;
+}
+/*--------------------------------------------------------------------------*/
+TimerWheel::~TimerWheel(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::InsertTimer(timernode *argNode,long long argExpires)
+{
+// if the timer is already running we move it to the new slot
+RemoveTimer(argNode);
+
+// round the deadline up so timers never fire early
+argNode->expires = ((argExpires + tick - 1) / tick);
+LinkTimer(argNode);
+count++;
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::RemoveTimer(timernode *argNode)
+{
+// timers that are not running or already expired have no slot
+if (argNode->head == NULL) return;
+
+if (argNode->last != NULL) argNode->last->next = argNode->next;
+else *argNode->head = argNode->next;
+if (argNode->next != NULL) argNode->next->last = argNode->last;
+
+argNode->next = argNode->last = NULL;
+argNode->head = NULL;
+count--;
+}
+/*--------------------------------------------------------------------------*/
+timernode *TimerWheel::ExpireTimers(long long argCurrent)
+{
+timernode		*expired,*local;
+long long		target;
+int				level;
+int				index;
+
+target = (argCurrent / tick);
+expired = NULL;
+
+	// walk forward one tick at a time until we catch up
+	while (current <= target)
+	{
+		// when a level wraps pull down the next slot from above and
+		// do the highest level first so its timers trickle all the way
+		for(level = (WHEELLEVELS - 1);level > 0;level--)
+		{
+		if ((current & ((1LL << (level * WHEELBITS)) - 1)) != 0) continue;
+		CascadeTimers(level);
+		}
+
+	// everything in the current bottom slot has expired
+	index = (current & (WHEELSIZE - 1));
+
+		while (wheel[0][index] != NULL)
+		{
+		local = wheel[0][index];
+		wheel[0][index] = local->next;
+		local->last = NULL;
+		local->head = NULL;
+		local->next = expired;
+		expired = local;
+		count--;
+		}
+
+	current++;
+	}
+
+return(expired);
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::CascadeTimers(int argLevel)
+{
+timernode		*local;
+int				index;
+
+index = ((current >> (argLevel * WHEELBITS)) & (WHEELSIZE - 1));
+
+	// relink every timer in the slot which puts each one lower down
+	while (wheel[argLevel][index] != NULL)
+	{
+	local = wheel[argLevel][index];
+	wheel[argLevel][index] = local->next;
+	LinkTimer(local);
+	}
+}
+/*--------------------------------------------------------------------------*/
+void TimerWheel::LinkTimer(timernode *argNode)
+{
+long long		delta;
+int				level;
+int				index;
+
+// deadlines in the past go in the slot that is processed next and
+// those beyond the top level are clamped to the furthest slot
+if (argNode->expires < current) argNode->expires = current;
+delta = (argNode->expires - current);
+if (delta >= (1LL << (WHEELLEVELS * WHEELBITS))) argNode->expires = (current + (1LL << (WHEELLEVELS * WHEELBITS)) - 1);
+delta = (argNode->expires - current);
+
+// find the lowest level that can hold the deadline
+for(level = 0;level < (WHEELLEVELS - 1);level++) if (delta < (1LL << ((level + 1) * WHEELBITS))) break;
+index = ((argNode->expires >> (level * WHEELBITS)) & (WHEELSIZE - 1));
+
+argNode->head = &wheel[level][index];
+argNode->last = NULL;
+argNode->next = wheel[level][index];
+if (argNode->next != NULL) argNode->next->last = argNode;
+wheel[level][index] = argNode;
+}
+/*--------------------------------------------------------------------------*/
+long long TimerWheel::NowMilliseconds(void)
+{
+struct timespec		ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return(((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+/*--------------------------------------------------------------------------*/
+long long TimerWheel::NowMicroseconds(void)
+{
+struct timespec		ts;
+
+clock_gettime(CLOCK_MONOTONIC,&ts);
+return(((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+/*--------------------------------------------------------------------------*/
@@ -0,0 +1,276 @@
+// TlsEngine.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The TlsEngine class holds the OpenSSL context used for DNS over TLS
+	client sessions.  A single context is shared by all of the client
+	network threads so the server session cache and the ticket keys
+	work no matter which thread accepts the next connection from a
+	client that wants to resume.  Each TCP session accepted on a TLS
+	listener gets its own SSL object which runs the handshake as the
+	first data arrives.  The context asks the library to hand the
+	record layer to the kernel with kTLS once the handshake is done,
+	and when the kernel has the tls module loaded the reads and writes
+	go straight to the socket without being copied through the library.
+	Otherwise the library does the encryption itself and nothing else
+	changes.  Reads and writes return the same way as recv and send so
+	the session code in the client network is shared with plain TCP.
+	Sessions from the HTTPS listener must negotiate HTTP/2 with ALPN.
+	The caller must hold the session lock for every call that uses an
+	SSL object since reads and writes happen on different threads, but
+	the handshake is finished on its own first without the lock since
+	nothing can be written to the session before the client has sent
+	a query, and it is by far the most expensive part of a session.
+*/
+
+#ifdef HAVE_OPENSSL
+
+const unsigned char ALPNPROTOCOL[] = { 2,'h','2' };		// HTTP/2 in ALPN wire format
+
+/*--------------------------------------------------------------------------*/
+TlsEngine::TlsEngine(void)
+{
+context = NULL;
+}
+/*--------------------------------------------------------------------------*/
+TlsEngine::~TlsEngine(void)
+{
+if (context != NULL) SSL_CTX_free(context);
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::Startup(void)
+{
+char		message[256];
+const char	*keyfile;
+long		options;
+int			ret;
+
+context = SSL_CTX_new(TLS_server_method());
+
+	if (context == NULL)
+	{
+	ERR_error_string_n(ERR_get_error(),message,sizeof(message));
+	g_log->LogMessage(LOG_ERR,"Error returned from SSL_CTX_new(%s)\n",message);
+	return(0);
+	}
+
+// DNS over TLS requires at least TLS 1.2
+SSL_CTX_set_min_proto_version(context,TLS1_2_VERSION);
+
+// the key can be in the same file as the certificate chain
+keyfile = (cfg_TlsPrivateKey[0] != 0 ? cfg_TlsPrivateKey : cfg_TlsCertificate);
+
+ret = SSL_CTX_use_certificate_chain_file(context,cfg_TlsCertificate);
+
+	if (ret != 1)
+	{
+	ERR_error_string_n(ERR_get_error(),message,sizeof(message));
+	g_log->LogMessage(LOG_ERR,"Unable to load TLS certificate %s (%s)\n",cfg_TlsCertificate,message);
+	return(0);
+	}
+
+ret = SSL_CTX_use_PrivateKey_file(context,keyfile,SSL_FILETYPE_PEM);
+if (ret == 1) ret = SSL_CTX_check_private_key(context);
+
+	if (ret != 1)
+	{
+	ERR_error_string_n(ERR_get_error(),message,sizeof(message));
+	g_log->LogMessage(LOG_ERR,"Unable to load TLS private key %s (%s)\n",keyfile,message);
+	return(0);
+	}
+
+// ask for kernel TLS and refuse renegotiation since a session that
+// is being renegotiated can't be handed to the kernel
+options = SSL_OP_NO_RENEGOTIATION;
+#ifdef SSL_OP_ENABLE_KTLS
+options|=SSL_OP_ENABLE_KTLS;
+#endif
+SSL_CTX_set_options(context,options);
+
+// writes can finish one record at a time and the queue they come
+// from can be moved by realloc between a blocked write and the retry
+SSL_CTX_set_mode(context,SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+// keep sessions in the server cache for TLS 1.2 clients and issue
+// tickets for TLS 1.3 clients so both of them can resume
+SSL_CTX_set_session_cache_mode(context,SSL_SESS_CACHE_SERVER);
+SSL_CTX_sess_set_cache_size(context,cfg_TlsCache);
+SSL_CTX_set_session_id_context(context,(const unsigned char *)"dnsproxy",8);
+SSL_CTX_set_timeout(context,cfg_TlsLifetime);
+
+// DNS over HTTPS sessions have to negotiate HTTP/2 with ALPN
+SSL_CTX_set_alpn_select_cb(context,SelectProtocol,NULL);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+struct ssl_st *TlsEngine::CreateSession(int argSock,int argHttp)
+{
+char		message[256];
+SSL			*session;
+
+ERR_clear_error();
+session = SSL_new(context);
+
+	if ((session == NULL) || (SSL_set_fd(session,argSock) != 1))
+	{
+	ERR_error_string_n(ERR_get_error(),message,sizeof(message));
+	g_log->LogMessage(LOG_ERR,"Error returned from SSL_new(%s)\n",message);
+	if (session != NULL) SSL_free(session);
+	return(NULL);
+	}
+
+// sessions from the HTTPS listener are marked so the ALPN
+// callback knows to insist on HTTP/2
+if (argHttp != 0) SSL_set_app_data(session,session);
+
+SSL_set_accept_state(session);
+return(session);
+}
+/*--------------------------------------------------------------------------*/
+void TlsEngine::DestroySession(struct ssl_st *argSession)
+{
+// send the close alert without waiting for the one from the client
+if (SSL_is_init_finished(argSession) != 0) SSL_shutdown(argSession);
+ERR_clear_error();
+
+SSL_free(argSession);
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::AcceptSession(struct ssl_st *argSession)
+{
+// nothing to do once the handshake is finished
+if (SSL_is_init_finished(argSession) != 0) return(1);
+
+return(FinishHandshake(argSession));
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::ReadSession(struct ssl_st *argSession,char *argBuffer,int argSize)
+{
+int		ret;
+
+ERR_clear_error();
+ret = SSL_read(argSession,argBuffer,argSize);
+if (ret > 0) return(ret);
+
+return(CheckResult(argSession,ret));
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::WriteSession(struct ssl_st *argSession,const char *argBuffer,int argSize)
+{
+int		ret;
+
+ERR_clear_error();
+ret = SSL_write(argSession,argBuffer,argSize);
+if (ret > 0) return(ret);
+
+return(CheckResult(argSession,ret));
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::PendingData(struct ssl_st *argSession)
+{
+return(SSL_has_pending(argSession));
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::FinishHandshake(struct ssl_st *argSession)
+{
+char		message[256];
+int			ret;
+
+ERR_clear_error();
+ret = SSL_do_handshake(argSession);
+
+	if (ret != 1)
+	{
+	ret = CheckResult(argSession,ret);
+	if ((ret < 0) && (errno == EAGAIN)) return(ret);
+
+	ERR_error_string_n(ERR_peek_error(),message,sizeof(message));
+	g_log->LogMessage(LOG_DEBUG,"TLS handshake failed (%s)\n",message);
+	g_tlsfailed++;
+	return(ret);
+	}
+
+g_tlsaccepted++;
+if (SSL_session_reused(argSession) != 0) g_tlsresumed++;
+
+// count the sessions where the kernel took over the record layer
+if (BIO_ctrl(SSL_get_wbio(argSession),BIO_CTRL_GET_KTLS_SEND,0,NULL) > 0) g_tlskernelsend++;
+if (BIO_ctrl(SSL_get_rbio(argSession),BIO_CTRL_GET_KTLS_RECV,0,NULL) > 0) g_tlskernelrecv++;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::CheckResult(struct ssl_st *argSession,int argResult)
+{
+int		ret;
+
+ret = SSL_get_error(argSession,argResult);
+
+	// the library needs the socket to be ready before it can go on
+	// which we report the same way as a nonblocking socket would
+	if ((ret == SSL_ERROR_WANT_READ) || (ret == SSL_ERROR_WANT_WRITE))
+	{
+	errno = EAGAIN;
+	return(-1);
+	}
+
+// the client sent the close alert so treat it like a normal close
+if (ret == SSL_ERROR_ZERO_RETURN) return(0);
+
+// errors from the socket leave errno alone and anything else
+// is reported as if the connection was reset
+if ((ret != SSL_ERROR_SYSCALL) || (errno == 0) || (errno == EAGAIN)) errno = ECONNRESET;
+return(-1);
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::SelectProtocol(struct ssl_st *argSession,const unsigned char **argOut,unsigned char *argOutLen,const unsigned char *argIn,unsigned int argInLen,void *argData)
+{
+int		ret;
+
+// plain DNS over TLS sessions don't use an application protocol
+if (SSL_get_app_data(argSession) == NULL) return(SSL_TLSEXT_ERR_NOACK);
+
+ret = SSL_select_next_proto((unsigned char **)argOut,argOutLen,ALPNPROTOCOL,sizeof(ALPNPROTOCOL),argIn,argInLen);
+if (ret == OPENSSL_NPN_NEGOTIATED) return(SSL_TLSEXT_ERR_OK);
+
+// the client doesn't speak HTTP/2 so there is nothing we can do
+return(SSL_TLSEXT_ERR_ALERT_FATAL);
+}
+/*--------------------------------------------------------------------------*/
+
+#else
+
+/*--------------------------------------------------------------------------*/
+TlsEngine::TlsEngine(void)
+{
+context = NULL;
+}
+/*--------------------------------------------------------------------------*/
+TlsEngine::~TlsEngine(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+int TlsEngine::Startup(void)
+{
+g_log->LogMessage(LOG_ERR,"This build does not include TLS support\n");
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+struct ssl_st *TlsEngine::CreateSession(int argSock,int argHttp)								{ return(NULL); }
+void TlsEngine::DestroySession(struct ssl_st *argSession)										{ }
+int TlsEngine::AcceptSession(struct ssl_st *argSession)											{ return(0); }
+int TlsEngine::ReadSession(struct ssl_st *argSession,char *argBuffer,int argSize)				{ return(0); }
+int TlsEngine::WriteSession(struct ssl_st *argSession,const char *argBuffer,int argSize)		{ return(-1); }
+int TlsEngine::PendingData(struct ssl_st *argSession)											{ return(0); }
+int TlsEngine::FinishHandshake(struct ssl_st *argSession)										{ return(0); }
+int TlsEngine::CheckResult(struct ssl_st *argSession,int argResult)								{ return(-1); }
+int TlsEngine::SelectProtocol(struct ssl_st *argSession,const unsigned char **argOut,unsigned char *argOutLen,const unsigned char *argIn,unsigned int argInLen,void *argData) { return(0); }
+/*--------------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,402 @@
+// UringEngine.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The UringEngine class is a thin wrapper around the Linux io_uring
+	interface used by the ClientNetwork and ServerNetwork classes as an
+	alternative to epoll.  We talk to the kernel with the raw system
+	calls so there is no dependency on liburing.  UDP sockets are armed
+	with a single multishot recvmsg request that pulls buffers from a
+	provided buffer ring, so the kernel keeps delivering datagrams
+	without any further submissions from us.  Everything else is armed
+	with a oneshot poll request.  All new requests are queued in the
+	submission ring and handed to the kernel in the same io_uring_enter
+	call that waits for completions, so a busy server makes one system
+	call for an entire batch of packets.  Each instance must only be
+	used by the thread that owns it.
+*/
+
+#ifdef HAVE_IO_URING
+
+/*--------------------------------------------------------------------------*/
+UringEngine::UringEngine(void)
+{
+ringsock = -1;
+sqmemory = cqmemory = NULL;
+sqsize = cqsize = 0;
+sqelist = NULL;
+cqelist = NULL;
+bufring = NULL;
+bufmemory = NULL;
+bufcount = bufsize = 0;
+buftail = 0;
+pending = 0;
+memset(&msgtemplate,0,sizeof(msgtemplate));
+}
+/*--------------------------------------------------------------------------*/
+UringEngine::~UringEngine(void)
+{
+if (bufmemory != NULL) free(bufmemory);
+if (bufring != NULL) munmap(bufring,bufcount * sizeof(struct io_uring_buf));
+if (sqelist != NULL) munmap(sqelist,sqentries * sizeof(struct io_uring_sqe));
+if ((cqmemory != NULL) && (cqmemory != sqmemory)) munmap(cqmemory,cqsize);
+if (sqmemory != NULL) munmap(sqmemory,sqsize);
+if (ringsock >= 0) close(ringsock);
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::Startup(int argEntries,int argBuffers,int argSize)
+{
+struct io_uring_buf_reg		reg;
+struct io_uring_params		params;
+char						*sqbase,*cqbase;
+int							ret,x;
+
+// create the ring and let the kernel clamp the size if needed
+memset(&params,0,sizeof(params));
+params.flags = IORING_SETUP_CLAMP;
+ringsock = syscall(__NR_io_uring_setup,argEntries,&params);
+
+	if (ringsock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from io_uring_setup\n",errno);
+	return(0);
+	}
+
+	// we need the extended argument to pass a timeout when waiting
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+	{
+	g_log->LogMessage(LOG_ERR,"The kernel io_uring does not support IORING_FEAT_EXT_ARG\n");
+	return(0);
+	}
+
+// figure out how much memory we need to map for each ring
+sqsize = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+cqsize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+
+	// newer kernels map both rings with a single call
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+	if (cqsize > sqsize) sqsize = cqsize;
+	cqsize = sqsize;
+	}
+
+sqmemory = mmap(NULL,sqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringsock,IORING_OFF_SQ_RING);
+
+	if (sqmemory == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(IORING_OFF_SQ_RING)\n",errno);
+	sqmemory = NULL;
+	return(0);
+	}
+
+if (params.features & IORING_FEAT_SINGLE_MMAP) cqmemory = sqmemory;
+else cqmemory = mmap(NULL,cqsize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringsock,IORING_OFF_CQ_RING);
+
+	if (cqmemory == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(IORING_OFF_CQ_RING)\n",errno);
+	cqmemory = NULL;
+	return(0);
+	}
+
+sqentries = params.sq_entries;
+sqelist = (struct io_uring_sqe *)mmap(NULL,sqentries * sizeof(struct io_uring_sqe),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringsock,IORING_OFF_SQES);
+
+	if (sqelist == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(IORING_OFF_SQES)\n",errno);
+	sqelist = NULL;
+	return(0);
+	}
+
+// save pointers to all the ring fields we use
+sqbase = (char *)sqmemory;
+sqhead = (unsigned *)&sqbase[params.sq_off.head];
+sqtail = (unsigned *)&sqbase[params.sq_off.tail];
+sqmask = *(unsigned *)&sqbase[params.sq_off.ring_mask];
+sqarray = (unsigned *)&sqbase[params.sq_off.array];
+
+cqbase = (char *)cqmemory;
+cqhead = (unsigned *)&cqbase[params.cq_off.head];
+cqtail = (unsigned *)&cqbase[params.cq_off.tail];
+cqmask = *(unsigned *)&cqbase[params.cq_off.ring_mask];
+cqelist = (struct io_uring_cqe *)&cqbase[params.cq_off.cqes];
+
+// the provided buffer ring size must be a power of two
+for(bufcount = 1;bufcount < argBuffers;bufcount <<= 1);
+if (bufcount > 0x8000) bufcount = 0x8000;
+bufsize = argSize;
+
+// allocate the buffer ring which must be page aligned
+bufring = (struct io_uring_buf *)mmap(NULL,bufcount * sizeof(struct io_uring_buf),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+
+	if (bufring == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(buffer ring)\n",errno);
+	bufring = NULL;
+	return(0);
+	}
+
+bufmemory = (char *)malloc(bufcount * bufsize);
+
+// register the buffer ring with the kernel as buffer group zero
+memset(&reg,0,sizeof(reg));
+reg.ring_addr = (unsigned long)bufring;
+reg.ring_entries = bufcount;
+reg.bgid = 0;
+ret = syscall(__NR_io_uring_register,ringsock,IORING_REGISTER_PBUF_RING,&reg,1);
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from io_uring_register(IORING_REGISTER_PBUF_RING)\n",errno);
+	return(0);
+	}
+
+// hand all of the buffers to the kernel
+buftail = 0;
+for(x = 0;x < bufcount;x++) ReleaseBuffer(x);
+
+// the message header used by all of the multishot receive requests
+msgtemplate.msg_namelen = sizeof(struct sockaddr_in);
+msgtemplate.msg_controllen = 0;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+struct io_uring_sqe *UringEngine::GrabEntry(void)
+{
+struct io_uring_sqe		*sqe;
+unsigned				head,tail;
+
+tail = *sqtail;
+head = __atomic_load_n(sqhead,__ATOMIC_ACQUIRE);
+
+	// if the submission ring is full hand what we have to the kernel
+	if ((tail - head) >= sqentries)
+	{
+	syscall(__NR_io_uring_enter,ringsock,pending,0,0,NULL,0);
+	g_uringcalls++;
+	pending = 0;
+	}
+
+sqe = &sqelist[tail & sqmask];
+memset(sqe,0,sizeof(struct io_uring_sqe));
+sqarray[tail & sqmask] = (tail & sqmask);
+
+return(sqe);
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::QueueEntry(void)
+{
+// make the entry we just filled visible to the kernel
+__atomic_store_n(sqtail,*sqtail + 1,__ATOMIC_RELEASE);
+pending++;
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::ArmRecvMessage(int argSock,unsigned long long argData)
+{
+struct io_uring_sqe		*sqe;
+
+// multishot recvmsg that selects buffers from group zero
+sqe = GrabEntry();
+sqe->opcode = IORING_OP_RECVMSG;
+sqe->fd = argSock;
+sqe->addr = (unsigned long)&msgtemplate;
+sqe->len = 1;
+sqe->flags = IOSQE_BUFFER_SELECT;
+sqe->buf_group = 0;
+sqe->ioprio = IORING_RECV_MULTISHOT;
+sqe->user_data = argData;
+QueueEntry();
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::ArmPoll(int argSock,unsigned long long argData)
+{
+struct io_uring_sqe		*sqe;
+
+// oneshot poll which gives us level triggered behavior
+sqe = GrabEntry();
+sqe->opcode = IORING_OP_POLL_ADD;
+sqe->fd = argSock;
+sqe->poll32_events = POLLIN;
+sqe->user_data = argData;
+QueueEntry();
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::CancelRequest(unsigned long long argData)
+{
+struct io_uring_sqe		*sqe;
+
+// the request being cancelled completes with -ECANCELED and the
+// cancel itself completes with the URINGCANCEL tag
+sqe = GrabEntry();
+sqe->opcode = IORING_OP_ASYNC_CANCEL;
+sqe->fd = -1;
+sqe->addr = argData;
+sqe->user_data = URINGCANCEL;
+QueueEntry();
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::WaitEvents(int argTimeout)
+{
+struct io_uring_getevents_arg	arg;
+struct __kernel_timespec		ts;
+unsigned						head,tail;
+int								wait,ret;
+
+// don't wait if there are already completions in the ring
+head = *cqhead;
+tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+wait = ((head == tail) ? 1 : 0);
+
+// submit everything pending and wait for at least one completion
+ts.tv_sec = (argTimeout / 1000);
+ts.tv_nsec = ((argTimeout % 1000) * 1000000);
+memset(&arg,0,sizeof(arg));
+arg.ts = (unsigned long)&ts;
+
+ret = syscall(__NR_io_uring_enter,ringsock,pending,wait,IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+g_uringcalls++;
+
+	if (ret < 0)
+	{
+	// timeout and interrupted system call are expected
+	if ((errno == ETIME) || (errno == EINTR)) return(0);
+	return(-1);
+	}
+
+pending-=ret;
+if (pending < 0) pending = 0;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::GrabEvent(unsigned long long &argData,int &argResult,unsigned &argFlags)
+{
+struct io_uring_cqe		*cqe;
+unsigned				head,tail;
+
+head = *cqhead;
+tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+if (head == tail) return(0);
+
+// copy the completion details and release the ring entry
+cqe = &cqelist[head & cqmask];
+argData = cqe->user_data;
+argResult = cqe->res;
+argFlags = cqe->flags;
+__atomic_store_n(cqhead,head + 1,__ATOMIC_RELEASE);
+
+g_uringevents++;
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::ExtractMessage(int argResult,unsigned argFlags,struct sockaddr_in *argAddr,char **argData,struct msghdr *argControl)
+{
+struct io_uring_recvmsg_out		*info;
+char							*buffer;
+int								bid,len;
+
+// the completion must have a buffer attached
+if (argResult < 0) return(-1);
+if ((argFlags & IORING_CQE_F_BUFFER) == 0) return(-1);
+
+bid = (argFlags >> IORING_CQE_BUFFER_SHIFT);
+buffer = &bufmemory[bid * bufsize];
+info = (struct io_uring_recvmsg_out *)buffer;
+
+// the source address comes right after the header
+memset(argAddr,0,sizeof(struct sockaddr_in));
+len = info->namelen;
+if (len > (int)sizeof(struct sockaddr_in)) len = sizeof(struct sockaddr_in);
+memcpy(argAddr,&buffer[sizeof(*info)],len);
+
+// ignore anything that didn't fit in the buffer
+if (info->flags & MSG_TRUNC) return(-1);
+
+	// the control data comes after the space for the name
+	if (argControl != NULL)
+	{
+	memset(argControl,0,sizeof(struct msghdr));
+	argControl->msg_control = &buffer[sizeof(*info) + msgtemplate.msg_namelen];
+	argControl->msg_controllen = info->controllen;
+	}
+
+// the payload comes after the space for the name and control data
+*argData = &buffer[sizeof(*info) + msgtemplate.msg_namelen + msgtemplate.msg_controllen];
+
+return(info->payloadlen);
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::EnableControl(int argSize)
+{
+// reserve space for control messages in every receive buffer and this
+// must be called before any multishot receive requests are armed
+msgtemplate.msg_controllen = argSize;
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::RecycleBuffer(unsigned argFlags)
+{
+if ((argFlags & IORING_CQE_F_BUFFER) == 0) return;
+ReleaseBuffer(argFlags >> IORING_CQE_BUFFER_SHIFT);
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::CheckMultishot(unsigned argFlags)
+{
+// returns non-zero while a multishot request is still active
+return((argFlags & IORING_CQE_F_MORE) ? 1 : 0);
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::ReleaseBuffer(int argIndex)
+{
+struct io_uring_buf		*buf;
+
+// put the buffer back at the tail of the provided buffer ring
+buf = &bufring[buftail & (bufcount - 1)];
+buf->addr = (unsigned long)&bufmemory[argIndex * bufsize];
+buf->len = bufsize;
+buf->bid = argIndex;
+buftail++;
+
+// the ring tail is stored in the resv field of the first entry and we
+// don't use the io_uring_buf_ring struct because the flexible array
+// in the kernel header has a different layout when compiled as C++
+__atomic_store_n(&bufring[0].resv,buftail,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+
+#else
+
+/*--------------------------------------------------------------------------*/
+UringEngine::UringEngine(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+UringEngine::~UringEngine(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+int UringEngine::Startup(int argEntries,int argBuffers,int argSize)
+{
+g_log->LogMessage(LOG_ERR,"This build does not include io_uring support\n");
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+void UringEngine::ArmRecvMessage(int argSock,unsigned long long argData)		{ }
+void UringEngine::ArmPoll(int argSock,unsigned long long argData)				{ }
+void UringEngine::CancelRequest(unsigned long long argData)						{ }
+int UringEngine::WaitEvents(int argTimeout)										{ return(-1); }
+int UringEngine::GrabEvent(unsigned long long &argData,int &argResult,unsigned &argFlags)	{ return(0); }
+int UringEngine::ExtractMessage(int argResult,unsigned argFlags,struct sockaddr_in *argAddr,char **argData,struct msghdr *argControl)	{ return(-1); }
+void UringEngine::EnableControl(int argSize)									{ }
+void UringEngine::RecycleBuffer(unsigned argFlags)								{ }
+int UringEngine::CheckMultishot(unsigned argFlags)								{ return(0); }
+/*--------------------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,659 @@
+// XdpSocket.cpp
+// DNS Proxy Filter Server
+// Copyright (c) 2010-2019 Untangle, Inc.
+// All Rights Reserved
+// Written by Michael A. Hotz
+
+#include "common.h"
+
+/*
+	The XdpSocket class provides an optional AF_XDP ingress path for
+	client UDP queries.  On startup we load a tiny XDP program onto the
+	configured interface that redirects IPv4 UDP frames addressed to
+	our server port and one of our listen addresses into an XSKMAP,
+	and everything else continues up the normal kernel stack.  The
+	redirected frames land in a UMEM area shared with the kernel, and
+	the owning ClientNetwork thread pulls them from the RX ring, hands
+	the DNS payload to the usual query logic, and returns the frame to
+	the fill ring.  Replies are written into frames reserved for
+	transmit with the ethernet and address fields swapped, queued on
+	the TX ring, and pushed to the kernel in batches.  Replies that
+	don't fit in a frame are left for the caller to send through the
+	kernel stack.  The program is built and attached with the raw bpf
+	system call so there is no dependency on libbpf, and the link is
+	released automatically when we close the descriptors.  The generic
+	mode works on any interface including veth pairs, while the native
+	mode requires a driver with XDP support.
+*/
+
+#ifdef HAVE_AF_XDP
+
+const int XDPFRAME = 2048;			// size of each frame in the UMEM area
+const int XDPHEADER = 42;			// ethernet + IPv4 + UDP header size
+const int XDPMAPSIZE = 64;			// number of queues in the XSKMAP
+
+/*--------------------------------------------------------------------------*/
+XdpSocket::XdpSocket(void)
+{
+memset(&rxring,0,sizeof(rxring));
+memset(&txring,0,sizeof(txring));
+memset(&fillring,0,sizeof(fillring));
+memset(&compring,0,sizeof(compring));
+program = NULL;
+proglen = 0;
+umem = NULL;
+umemsize = 0;
+txfree = NULL;
+txcount = 0;
+txpending = 0;
+txlimit = 1;
+framecount = 0;
+xsksock = -1;
+progsock = -1;
+linksock = -1;
+xskmap = -1;
+addrmap = -1;
+}
+/*--------------------------------------------------------------------------*/
+XdpSocket::~XdpSocket(void)
+{
+// closing the link detaches the program from the interface
+if (linksock >= 0) close(linksock);
+if (progsock >= 0) close(progsock);
+if (xskmap >= 0) close(xskmap);
+if (addrmap >= 0) close(addrmap);
+
+if (rxring.memory != NULL) munmap(rxring.memory,rxring.size);
+if (txring.memory != NULL) munmap(txring.memory,txring.size);
+if (fillring.memory != NULL) munmap(fillring.memory,fillring.size);
+if (compring.memory != NULL) munmap(compring.memory,compring.size);
+
+if (xsksock >= 0) close(xsksock);
+if (umem != NULL) munmap(umem,umemsize);
+if (txfree != NULL) free(txfree);
+if (program != NULL) free(program);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::Startup(const char *argFace,int argQueue,int argFrames,int argNative,int argBatch)
+{
+struct xdp_mmap_offsets		offs;
+struct xdp_umem_reg			reg;
+struct sockaddr_xdp			sxdp;
+union bpf_attr				attr;
+unsigned int				ifindex;
+unsigned int				key;
+socklen_t					len;
+int							entries;
+int							ret,x;
+
+ifindex = if_nametoindex(argFace);
+
+	if (ifindex == 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from if_nametoindex(%s)\n",errno,argFace);
+	return(0);
+	}
+
+// the ring sizes must be a power of two and we use half of the
+// frames for receive and the other half for transmit
+for(framecount = 64;framecount < argFrames;framecount <<= 1);
+entries = (framecount / 2);
+txlimit = argBatch;
+
+// allocate the UMEM area shared with the kernel
+umemsize = ((size_t)framecount * XDPFRAME);
+umem = (char *)mmap(NULL,umemsize,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+
+	if (umem == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(UMEM)\n",errno);
+	umem = NULL;
+	return(0);
+	}
+
+xsksock = socket(AF_XDP,SOCK_RAW,0);
+
+	if (xsksock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from socket(AF_XDP)\n",errno);
+	return(0);
+	}
+
+// register the UMEM area with the socket
+memset(&reg,0,sizeof(reg));
+reg.addr = (unsigned long)umem;
+reg.len = umemsize;
+reg.chunk_size = XDPFRAME;
+reg.headroom = 0;
+ret = setsockopt(xsksock,SOL_XDP,XDP_UMEM_REG,&reg,sizeof(reg));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(XDP_UMEM_REG)\n",errno);
+	return(0);
+	}
+
+// set the size of all four rings
+ret = setsockopt(xsksock,SOL_XDP,XDP_UMEM_FILL_RING,&entries,sizeof(entries));
+if (ret == 0) ret = setsockopt(xsksock,SOL_XDP,XDP_UMEM_COMPLETION_RING,&entries,sizeof(entries));
+if (ret == 0) ret = setsockopt(xsksock,SOL_XDP,XDP_RX_RING,&entries,sizeof(entries));
+if (ret == 0) ret = setsockopt(xsksock,SOL_XDP,XDP_TX_RING,&entries,sizeof(entries));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from setsockopt(XDP rings)\n",errno);
+	return(0);
+	}
+
+// get the layout of the rings so we can map them
+memset(&offs,0,sizeof(offs));
+len = sizeof(offs);
+ret = getsockopt(xsksock,SOL_XDP,XDP_MMAP_OFFSETS,&offs,&len);
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from getsockopt(XDP_MMAP_OFFSETS)\n",errno);
+	return(0);
+	}
+
+if (MapRing(&rxring,XDP_PGOFF_RX_RING,&offs.rx,entries,sizeof(struct xdp_desc)) == 0) return(0);
+if (MapRing(&txring,XDP_PGOFF_TX_RING,&offs.tx,entries,sizeof(struct xdp_desc)) == 0) return(0);
+if (MapRing(&fillring,XDP_UMEM_PGOFF_FILL_RING,&offs.fr,entries,sizeof(unsigned long long)) == 0) return(0);
+if (MapRing(&compring,XDP_UMEM_PGOFF_COMPLETION_RING,&offs.cr,entries,sizeof(unsigned long long)) == 0) return(0);
+
+// give the first half of the frames to the kernel for receive
+for(x = 0;x < entries;x++) ((unsigned long long *)fillring.ring)[x] = ((unsigned long long)x * XDPFRAME);
+__atomic_store_n(fillring.producer,entries,__ATOMIC_RELEASE);
+
+// the second half of the frames are kept on a stack for transmit
+txfree = (unsigned long long *)calloc(entries,sizeof(unsigned long long));
+for(x = 0;x < entries;x++) txfree[x] = ((unsigned long long)(entries + x) * XDPFRAME);
+txcount = entries;
+
+// bind the socket to the interface queue
+memset(&sxdp,0,sizeof(sxdp));
+sxdp.sxdp_family = AF_XDP;
+sxdp.sxdp_ifindex = ifindex;
+sxdp.sxdp_queue_id = argQueue;
+sxdp.sxdp_flags = (argNative != 0 ? 0 : XDP_COPY);
+ret = bind(xsksock,(struct sockaddr *)&sxdp,sizeof(sxdp));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bind(AF_XDP %s queue %d)\n",errno,argFace,argQueue);
+	return(0);
+	}
+
+// create the map of sockets indexed by the interface queue
+memset(&attr,0,sizeof(attr));
+attr.map_type = BPF_MAP_TYPE_XSKMAP;
+attr.key_size = sizeof(unsigned int);
+attr.value_size = sizeof(int);
+attr.max_entries = XDPMAPSIZE;
+xskmap = syscall(__NR_bpf,BPF_MAP_CREATE,&attr,sizeof(attr));
+
+	if (xskmap < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_CREATE XSKMAP)\n",errno);
+	return(0);
+	}
+
+// create the map of local addresses we want to redirect
+memset(&attr,0,sizeof(attr));
+attr.map_type = BPF_MAP_TYPE_HASH;
+attr.key_size = sizeof(unsigned int);
+attr.value_size = sizeof(unsigned int);
+attr.max_entries = SOCKLIMIT;
+addrmap = syscall(__NR_bpf,BPF_MAP_CREATE,&attr,sizeof(attr));
+
+	if (addrmap < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_CREATE HASH)\n",errno);
+	return(0);
+	}
+
+// put our socket in the map slot for the queue we are bound to
+key = argQueue;
+memset(&attr,0,sizeof(attr));
+attr.map_fd = xskmap;
+attr.key = (unsigned long)&key;
+attr.value = (unsigned long)&xsksock;
+attr.flags = BPF_ANY;
+ret = syscall(__NR_bpf,BPF_MAP_UPDATE_ELEM,&attr,sizeof(attr));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_UPDATE_ELEM XSKMAP)\n",errno);
+	return(0);
+	}
+
+if (LoadProgram() == 0) return(0);
+
+// attach the program to the interface
+memset(&attr,0,sizeof(attr));
+attr.link_create.prog_fd = progsock;
+attr.link_create.target_ifindex = ifindex;
+attr.link_create.attach_type = BPF_XDP;
+attr.link_create.flags = (argNative != 0 ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE);
+linksock = syscall(__NR_bpf,BPF_LINK_CREATE,&attr,sizeof(attr));
+
+	if (linksock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_LINK_CREATE %s)\n",errno,argFace);
+	return(0);
+	}
+
+g_log->LogMessage(LOG_INFO,"XDP %s mode attached to %s queue %d with %d frames\n",(argNative != 0 ? "native" : "generic"),argFace,argQueue,framecount);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::MapRing(struct xdpring *argRing,unsigned long long argOffset,struct xdp_ring_offset *argInfo,int argEntries,int argSize)
+{
+char		*base;
+
+argRing->size = (argInfo->desc + ((size_t)argEntries * argSize));
+argRing->memory = mmap(NULL,argRing->size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,xsksock,argOffset);
+
+	if (argRing->memory == MAP_FAILED)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from mmap(XDP ring %llx)\n",errno,argOffset);
+	argRing->memory = NULL;
+	return(0);
+	}
+
+base = (char *)argRing->memory;
+argRing->producer = (unsigned *)&base[argInfo->producer];
+argRing->consumer = (unsigned *)&base[argInfo->consumer];
+argRing->ring = &base[argInfo->desc];
+argRing->mask = (argEntries - 1);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::InsertAddress(unsigned int argAddr)
+{
+union bpf_attr		attr;
+unsigned int		value;
+int					ret;
+
+// addresses are stored in network byte order to match the packet
+value = 1;
+memset(&attr,0,sizeof(attr));
+attr.map_fd = addrmap;
+attr.key = (unsigned long)&argAddr;
+attr.value = (unsigned long)&value;
+attr.flags = BPF_ANY;
+ret = syscall(__NR_bpf,BPF_MAP_UPDATE_ELEM,&attr,sizeof(attr));
+
+	if (ret != 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_UPDATE_ELEM HASH)\n",errno);
+	return(0);
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::RemoveAddress(unsigned int argAddr)
+{
+union bpf_attr		attr;
+int					ret;
+
+// once the key is gone the program passes the packets to the stack
+memset(&attr,0,sizeof(attr));
+attr.map_fd = addrmap;
+attr.key = (unsigned long)&argAddr;
+ret = syscall(__NR_bpf,BPF_MAP_DELETE_ELEM,&attr,sizeof(attr));
+
+	if ((ret != 0) && (errno != ENOENT))
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_MAP_DELETE_ELEM HASH)\n",errno);
+	return(0);
+	}
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::LoadProgram(void)
+{
+union bpf_attr		attr;
+char				*logbuff;
+int					pass;
+
+program = (struct bpf_insn *)calloc(64,sizeof(struct bpf_insn));
+proglen = 0;
+
+// the XDP_PASS exit is the last two instructions and every check
+// that fails jumps there so pass holds the target instruction index
+// which must be updated if any instructions are added or removed
+pass = 31;
+
+// save the context and load the packet data and end pointers
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_6,BPF_REG_1,0,0);
+AddInstruction(BPF_LDX | BPF_MEM | BPF_W,BPF_REG_2,BPF_REG_1,offsetof(struct xdp_md,data),0);
+AddInstruction(BPF_LDX | BPF_MEM | BPF_W,BPF_REG_3,BPF_REG_1,offsetof(struct xdp_md,data_end),0);
+
+// make sure we have a complete ethernet, IPv4, and UDP header
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_4,BPF_REG_2,0,0);
+AddInstruction(BPF_ALU64 | BPF_ADD | BPF_K,BPF_REG_4,0,0,XDPHEADER);
+AddInstruction(BPF_JMP | BPF_JGT | BPF_X,BPF_REG_4,BPF_REG_3,pass - 6,0);
+
+// must be IPv4 without options or VLAN tags
+AddInstruction(BPF_LDX | BPF_MEM | BPF_H,BPF_REG_4,BPF_REG_2,12,0);
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_4,0,pass - 8,htons(0x0800));
+AddInstruction(BPF_LDX | BPF_MEM | BPF_B,BPF_REG_4,BPF_REG_2,14,0);
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_4,0,pass - 10,0x45);
+
+// must be UDP and not a fragment
+AddInstruction(BPF_LDX | BPF_MEM | BPF_B,BPF_REG_4,BPF_REG_2,23,0);
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_4,0,pass - 12,IPPROTO_UDP);
+AddInstruction(BPF_LDX | BPF_MEM | BPF_H,BPF_REG_4,BPF_REG_2,20,0);
+AddInstruction(BPF_ALU64 | BPF_AND | BPF_K,BPF_REG_4,0,0,htons(0x3FFF));
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_4,0,pass - 15,0);
+
+// must be sent to our server port
+AddInstruction(BPF_LDX | BPF_MEM | BPF_H,BPF_REG_4,BPF_REG_2,36,0);
+AddInstruction(BPF_JMP | BPF_JNE | BPF_K,BPF_REG_4,0,pass - 17,htons(cfg_ServerPort));
+
+// must be sent to one of our addresses so look it up in the hash map
+AddInstruction(BPF_LDX | BPF_MEM | BPF_W,BPF_REG_4,BPF_REG_2,30,0);
+AddInstruction(BPF_STX | BPF_MEM | BPF_W,BPF_REG_10,BPF_REG_4,-4,0);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_X,BPF_REG_2,BPF_REG_10,0,0);
+AddInstruction(BPF_ALU64 | BPF_ADD | BPF_K,BPF_REG_2,0,0,-4);
+AddInstruction(BPF_LD | BPF_DW | BPF_IMM,BPF_REG_1,BPF_PSEUDO_MAP_FD,0,addrmap);
+AddInstruction(0,0,0,0,0);
+AddInstruction(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_map_lookup_elem);
+AddInstruction(BPF_JMP | BPF_JEQ | BPF_K,BPF_REG_0,0,pass - 25,0);
+
+// redirect to the socket for the receive queue or pass if there isn't one
+AddInstruction(BPF_LDX | BPF_MEM | BPF_W,BPF_REG_2,BPF_REG_6,offsetof(struct xdp_md,rx_queue_index),0);
+AddInstruction(BPF_LD | BPF_DW | BPF_IMM,BPF_REG_1,BPF_PSEUDO_MAP_FD,0,xskmap);
+AddInstruction(0,0,0,0,0);
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_3,0,0,XDP_PASS);
+AddInstruction(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_redirect_map);
+AddInstruction(BPF_JMP | BPF_EXIT,0,0,0,0);
+
+// everything else goes to the kernel network stack
+AddInstruction(BPF_ALU64 | BPF_MOV | BPF_K,BPF_REG_0,0,0,XDP_PASS);
+AddInstruction(BPF_JMP | BPF_EXIT,0,0,0,0);
+
+logbuff = (char *)calloc(1,0x10000);
+
+memset(&attr,0,sizeof(attr));
+attr.prog_type = BPF_PROG_TYPE_XDP;
+attr.expected_attach_type = BPF_XDP;
+attr.insns = (unsigned long)program;
+attr.insn_cnt = proglen;
+attr.license = (unsigned long)"GPL";
+attr.log_buf = (unsigned long)logbuff;
+attr.log_size = 0x10000;
+attr.log_level = 1;
+progsock = syscall(__NR_bpf,BPF_PROG_LOAD,&attr,sizeof(attr));
+
+	if (progsock < 0)
+	{
+	g_log->LogMessage(LOG_ERR,"Error %d returned from bpf(BPF_PROG_LOAD)\n",errno);
+	g_log->LogMessage(LOG_ERR,"%s\n",logbuff);
+	free(logbuff);
+	return(0);
+	}
+
+free(logbuff);
+
+return(1);
+}
+/*--------------------------------------------------------------------------*/
+void XdpSocket::AddInstruction(int argCode,int argDst,int argSrc,int argOff,int argImm)
+{
+program[proglen].code = argCode;
+program[proglen].dst_reg = argDst;
+program[proglen].src_reg = argSrc;
+program[proglen].off = argOff;
+program[proglen].imm = argImm;
+proglen++;
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::GrabPacket(struct xdppacket *argPacket)
+{
+struct xdp_desc		*desc;
+unsigned char		*data;
+unsigned			prod,cons;
+int					udplen;
+
+cons = *rxring.consumer;
+prod = __atomic_load_n(rxring.producer,__ATOMIC_ACQUIRE);
+if (cons == prod) return(0);
+
+// grab the next descriptor and give the slot back to the kernel
+desc = &((struct xdp_desc *)rxring.ring)[cons & rxring.mask];
+argPacket->frame = desc->addr;
+data = (unsigned char *)&umem[desc->addr];
+__atomic_store_n(rxring.consumer,cons + 1,__ATOMIC_RELEASE);
+
+	// the program already checked all this but we don't trust anybody
+	if ((desc->len < (unsigned)XDPHEADER) || (data[12] != 0x08) || (data[13] != 0x00) || (data[14] != 0x45) || (data[23] != IPPROTO_UDP))
+	{
+	ReleasePacket(argPacket);
+	return(-1);
+	}
+
+udplen = ntohs(*(unsigned short *)&data[38]);
+
+	// make sure the UDP length fits inside the frame we received
+	if ((udplen < 8) || ((udplen + 34) > (int)desc->len))
+	{
+	ReleasePacket(argPacket);
+	return(-1);
+	}
+
+// save the link and address info we need to send the reply
+memcpy(argPacket->linkaddr,data,sizeof(argPacket->linkaddr));
+memset(&argPacket->source,0,sizeof(argPacket->source));
+argPacket->source.sin_family = AF_INET;
+memcpy(&argPacket->source.sin_addr.s_addr,&data[26],4);
+memcpy(&argPacket->source.sin_port,&data[34],2);
+memcpy(&argPacket->target,&data[30],4);
+
+argPacket->data = (char *)&data[XDPHEADER];
+argPacket->size = (udplen - 8);
+
+return(argPacket->size);
+}
+/*--------------------------------------------------------------------------*/
+void XdpSocket::ReleasePacket(struct xdppacket *argPacket)
+{
+unsigned		prod;
+
+// the fill ring is the same size as the number of receive frames so
+// there is always room to put back a frame we got from the kernel
+prod = *fillring.producer;
+((unsigned long long *)fillring.ring)[prod & fillring.mask] = (argPacket->frame & ~((unsigned long long)XDPFRAME - 1));
+__atomic_store_n(fillring.producer,prod + 1,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::TransmitPacket(const char *argBuffer,int argSize,const sockaddr_in *argTarget,unsigned int argSource,const unsigned char *argLink)
+{
+struct xdp_desc			*desc;
+unsigned long long		frame;
+unsigned char			*data;
+unsigned short			value;
+unsigned				prod;
+
+// replies that don't fit in a frame are sent by the caller
+if ((argSize + XDPHEADER) > XDPFRAME) return(-1);
+
+control.Acquire();
+
+ReapCompletions();
+
+	// if we are out of frames kick the kernel and check again
+	if (txcount == 0)
+	{
+	TransmitQueue();
+	ReapCompletions();
+	}
+
+	if (txcount == 0)
+	{
+	control.Release();
+	return(-1);
+	}
+
+frame = txfree[--txcount];
+data = (unsigned char *)&umem[frame];
+
+// ethernet header with the addresses swapped
+memcpy(&data[0],&argLink[6],6);
+memcpy(&data[6],&argLink[0],6);
+data[12] = 0x08;
+data[13] = 0x00;
+
+// IPv4 header from our address back to the client
+data[14] = 0x45;
+data[15] = 0;
+value = htons(argSize + 28);
+memcpy(&data[16],&value,2);
+memset(&data[18],0,2);
+value = htons(0x4000);
+memcpy(&data[20],&value,2);
+data[22] = 64;
+data[23] = IPPROTO_UDP;
+memset(&data[24],0,2);
+memcpy(&data[26],&argSource,4);
+memcpy(&data[30],&argTarget->sin_addr.s_addr,4);
+value = Checksum(&data[14],20);
+memcpy(&data[24],&value,2);
+
+// UDP header from our server port back to the client port and
+// we leave the checksum zero which is allowed for IPv4
+value = htons(cfg_ServerPort);
+memcpy(&data[34],&value,2);
+memcpy(&data[36],&argTarget->sin_port,2);
+value = htons(argSize + 8);
+memcpy(&data[38],&value,2);
+memset(&data[40],0,2);
+
+memcpy(&data[XDPHEADER],argBuffer,argSize);
+
+// the TX ring is the same size as the number of transmit frames so
+// there is always room when we have a free frame
+prod = *txring.producer;
+desc = &((struct xdp_desc *)txring.ring)[prod & txring.mask];
+desc->addr = frame;
+desc->len = (argSize + XDPHEADER);
+desc->options = 0;
+__atomic_store_n(txring.producer,prod + 1,__ATOMIC_RELEASE);
+
+txpending++;
+g_xdpsend++;
+
+// push the queue to the kernel once we have a full batch
+if (txpending >= txlimit) TransmitQueue();
+
+control.Release();
+
+return(argSize);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::FlushTransmit(void)
+{
+int		total;
+
+// quick unlocked check so idle sockets cost almost nothing
+if (txpending == 0) return(0);
+
+control.Acquire();
+total = txpending;
+TransmitQueue();
+ReapCompletions();
+control.Release();
+
+return(total);
+}
+/*--------------------------------------------------------------------------*/
+void XdpSocket::TransmitQueue(void)
+{
+int		ret;
+
+// the caller must hold the control lock
+if (txpending == 0) return;
+
+// a zero length send tells the kernel to process the TX ring
+ret = sendto(xsksock,NULL,0,MSG_DONTWAIT,NULL,0);
+g_sendcalls++;
+g_sendpackets+=txpending;
+txpending = 0;
+
+if (ret >= 0) return;
+
+// these just mean the kernel is busy and will get to the ring later
+if ((errno == EAGAIN) || (errno == EBUSY) || (errno == ENOBUFS) || (errno == EINTR)) return;
+
+g_log->LogMessage(LOG_WARNING,"Error %d returned from sendto(AF_XDP)\n",errno);
+}
+/*--------------------------------------------------------------------------*/
+void XdpSocket::ReapCompletions(void)
+{
+unsigned		prod,cons;
+
+// the caller must hold the control lock
+cons = *compring.consumer;
+prod = __atomic_load_n(compring.producer,__ATOMIC_ACQUIRE);
+
+	// put every completed frame back on the transmit stack
+	while (cons != prod)
+	{
+	txfree[txcount++] = ((unsigned long long *)compring.ring)[cons & compring.mask];
+	cons++;
+	}
+
+__atomic_store_n(compring.consumer,cons,__ATOMIC_RELEASE);
+}
+/*--------------------------------------------------------------------------*/
+unsigned short XdpSocket::Checksum(const unsigned char *argData,int argSize)
+{
+unsigned int	sum;
+int				x;
+
+sum = 0;
+
+// the result is in network byte order since we sum the raw words
+for(x = 0;x < (argSize - 1);x+=2) sum+=*(unsigned short *)&argData[x];
+if (argSize & 1) sum+=argData[argSize - 1];
+
+while (sum >> 16) sum = ((sum & 0xFFFF) + (sum >> 16));
+
+return(~sum);
+}
+/*--------------------------------------------------------------------------*/
+
+#else
+
+/*--------------------------------------------------------------------------*/
+XdpSocket::XdpSocket(void)
+{
+xsksock = -1;
+txpending = 0;
+}
+/*--------------------------------------------------------------------------*/
+XdpSocket::~XdpSocket(void)
+{
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::Startup(const char *argFace,int argQueue,int argFrames,int argNative,int argBatch)
+{
+g_log->LogMessage(LOG_ERR,"This build does not include AF_XDP support\n");
+return(0);
+}
+/*--------------------------------------------------------------------------*/
+int XdpSocket::InsertAddress(unsigned int argAddr)								{ return(0); }
+int XdpSocket::RemoveAddress(unsigned int argAddr)								{ return(0); }
+int XdpSocket::GrabPacket(struct xdppacket *argPacket)							{ return(0); }
+void XdpSocket::ReleasePacket(struct xdppacket *argPacket)						{ }
+int XdpSocket::TransmitPacket(const char *argBuffer,int argSize,const sockaddr_in *argTarget,unsigned int argSource,const unsigned char *argLink)	{ return(-1); }
+int XdpSocket::FlushTransmit(void)												{ return(0); }
+/*--------------------------------------------------------------------------*/
+
+#endif
+
@@ -6,9 +6,11 @@
 
 #include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <syslog.h>
 #include <signal.h>
 #include <unistd.h>
@@ -19,19 +21,68 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/syscall.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+// the io_uring engine needs multishot receive and provided buffer rings
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+
+// the AF_XDP ingress needs the XDP socket and bpf headers
+#if defined(__has_include)
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#endif
+#endif
+
+#ifdef XDP_USE_NEED_WAKEUP
+#define HAVE_AF_XDP
+#endif
+
+// reuseport steering needs the bpf header for the socket array map
+#if defined(__has_include)
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#ifdef SO_ATTACH_REUSEPORT_EBPF
+#define HAVE_REUSEPORT_EBPF
+#endif
+#endif
+#endif
+
+// the DNS over TLS listener needs the OpenSSL headers
+#if defined(__has_include)
+#if __has_include(<openssl/ssl.h>)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#define HAVE_OPENSSL
+#endif
+#endif
 
 #include <mysql/mysql.h>
 #include "INIFile.h"
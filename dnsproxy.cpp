@@ -97,16 +97,46 @@ g_rfilter->BeginExecution(STARTWAIT);
 g_server = new ServerNetwork();
 g_server->BeginExecution(STARTWAIT);
 
-// allocate the global client network
-g_client = new ClientNetwork();
-g_client->BeginExecution(STARTWAIT);
+	// with multiple client threads we can keep each flow on one core
+	if ((cfg_SteerCPU != 0) && (cfg_ClientThreads > 1))
+	{
+	g_steer = new CoreSteering(cfg_ClientThreads);
+
+		if (g_steer->Startup() == 0)
+		{
+		g_log->LogMessage(LOG_WARNING,"Unable to start core steering - continuing without it\n");
+		delete(g_steer);
+		g_steer = NULL;
+		}
+	}
+
+	// the DNS over TLS listeners are only opened with a certificate
+	if (cfg_TlsCertificate[0] != 0)
+	{
+	g_tls = new TlsEngine();
+
+		if (g_tls->Startup() == 0)
+		{
+		g_log->LogMessage(LOG_WARNING,"Unable to start TLS - continuing without DNS over TLS\n");
+		delete(g_tls);
+		g_tls = NULL;
+		}
+	}
+
+	// allocate the global client network threads
+	for(x = 0;x < cfg_ClientThreads;x++)
+	{
+	g_client[x] = new ClientNetwork(x);
+	g_client[x]->BeginExecution(STARTWAIT);
+	}
 
 if (g_console != 0) g_log->LogMessage(LOG_NOTICE,"=== Running on console - Use ENTER or CTRL+C to terminate ===\n");
 
 	while (g_goodbye == 0)
 	{
 	// watch for errors in the client and server threads
-	if (g_client->CheckStatus() == 0) break;
+	for(x = 0;x < cfg_ClientThreads;x++) if (g_client[x]->CheckStatus() == 0) break;
+	if (x != cfg_ClientThreads) break;
 	if (g_server->CheckStatus() == 0) break;
 
 		// if running on the console check for keyboard input
@@ -131,7 +161,13 @@ if (g_console != 0) g_log->LogMessage(LOG_NOTICE,"=== Running on console - Use E
 	delete(local);
 	}
 
-if (g_client != NULL) delete(g_client);
+	for(x = 0;x < cfg_ClientThreads;x++)
+	{
+	if (g_client[x] == NULL) continue;
+	delete(g_client[x]);
+	g_client[x] = NULL;
+	}
+if (g_server != NULL) g_server->ReportUpstreams();
 if (g_server != NULL) delete(g_server);
 if (g_rfilter != NULL) delete(g_rfilter);
 if (g_qfilter != NULL) delete(g_qfilter);
@@ -145,6 +181,32 @@ mysql_library_end();
 g_log->LogMessage(LOG_INFO,"CLIENT:%lld  QUERY:%lld  SERVER:%lld  REPLY:%lld  DIRTY:%lld\n",
 	g_clientcount.val(),g_querycount.val(),g_servercount.val(),g_replycount.val(),g_dirtycount.val());
 
+g_log->LogMessage(LOG_INFO,"RECVBATCH:%d  RECVCALLS:%lld  RECVPACKETS:%lld  SENDBATCH:%d  SENDCALLS:%lld  SENDPACKETS:%lld\n",
+	cfg_RecvBatch,g_recvcalls.val(),g_recvpackets.val(),cfg_SendBatch,g_sendcalls.val(),g_sendpackets.val());
+g_log->LogMessage(LOG_INFO,"SERVERRECVCALLS:%lld  SERVERRECVPACKETS:%lld  SERVERSENDCALLS:%lld  SERVERSENDPACKETS:%lld\n",
+	g_serverrecvcalls.val(),g_serverrecvpackets.val(),g_serversendcalls.val(),g_serversendpackets.val());
+
+g_log->LogMessage(LOG_INFO,"ACCEPTBATCH:%d  ACCEPTCALLS:%lld  TCPACCEPTED:%lld  TCPREFUSED:%lld  TCPEVICTED:%lld  TCPSATURATED:%lld\n",
+	cfg_AcceptBatch,g_acceptcalls.val(),g_tcpaccepted.val(),g_tcprefused.val(),g_tcpevicted.val(),g_tcpsaturated.val());
+g_log->LogMessage(LOG_INFO,"TCPQUEUED:%lld  TCPPAUSED:%lld  TCPDROPPED:%lld\n",g_tcpqueued.val(),g_tcppaused.val(),g_tcpdropped.val());
+if (cfg_EdgeTrigger != 0) g_log->LogMessage(LOG_INFO,"DRAINLIMIT:%d  DRAINCAPPED:%lld\n",cfg_DrainLimit,g_draincapped.val());
+if (cfg_UringEngine != 0) g_log->LogMessage(LOG_INFO,"URINGCALLS:%lld  URINGEVENTS:%lld\n",g_uringcalls.val(),g_uringevents.val());
+if ((cfg_WatchAddresses != 0) && (cfg_Wildcard == 0)) g_log->LogMessage(LOG_INFO,"LISTENADD:%lld  LISTENREMOVE:%lld  STALEREPLIES:%lld\n",g_listenadd.val(),g_listenremove.val(),g_stalereplies.val());
+if ((cfg_XdpInterface[0] != 0) && (cfg_Wildcard == 0)) g_log->LogMessage(LOG_INFO,"XDPRECV:%lld  XDPSEND:%lld  XDPDROP:%lld\n",g_xdprecv.val(),g_xdpsend.val(),g_xdpdrop.val());
+g_log->LogMessage(LOG_INFO,"EDNSPAYLOAD:%d  TCPRETRY:%lld  TRUNCATED:%lld  FALLBACK:%lld\n",cfg_EdnsPayload,g_tcpretry.val(),g_ednstruncate.val(),g_ednsfallback.val());
+g_log->LogMessage(LOG_INFO,"UPSTREAMCONNECTS:%lld  UPSTREAMREUSED:%lld  RETRANSMITS:%lld  SERVFAILS:%lld\n",g_upstreamconnects.val(),g_upstreamreused.val(),g_upstreamretry.val(),g_upstreamfailed.val());
+g_log->LogMessage(LOG_INFO,"HEDGEPERCENT:%d  HEDGES:%lld  HEDGEWINS:%lld  LATEREPLIES:%lld\n",cfg_HedgePercent,g_hedgesent.val(),g_hedgewins.val(),g_latereplies.val());
+g_log->LogMessage(LOG_INFO,"COALESCE:%d  COALESCED:%lld\n",cfg_Coalesce,g_coalesced.val());
+g_log->LogMessage(LOG_INFO,"CLIENTDROPS:%lld  SERVERDROPS:%lld  BUFFERGROW:%lld\n",g_clientdrops.val(),g_serverdrops.val(),g_buffergrow.val());
+if (cfg_BusyPoll != 0) g_log->LogMessage(LOG_INFO,"BUSYPOLL:%d  BUSYSPINS:%lld  BUSYSLEEPS:%lld\n",cfg_BusyPoll,g_busyspins.val(),g_busysleeps.val());
+if (g_steer != NULL) g_steer->ReportCounters();
+if (g_steer != NULL) delete(g_steer);
+if (g_tls != NULL) g_log->LogMessage(LOG_INFO,"TLSACCEPTED:%lld  TLSRESUMED:%lld  TLSFAILED:%lld  KTLSSEND:%lld  KTLSRECV:%lld\n",
+	g_tlsaccepted.val(),g_tlsresumed.val(),g_tlsfailed.val(),g_tlskernelsend.val(),g_tlskernelrecv.val());
+if ((g_tls != NULL) && (cfg_DohPort != 0)) g_log->LogMessage(LOG_INFO,"DOHSESSIONS:%lld  DOHQUERIES:%lld  DOHREJECTED:%lld\n",
+	g_dohsessions.val(),g_dohqueries.val(),g_dohrejected.val());
+if (g_tls != NULL) delete(g_tls);
+
 g_log->LogMessage(LOG_NOTICE,"GOODBYE DNSProxy Version %s Build %s\n",VERSION,BUILDID);
 
 delete(g_log);
@@ -251,6 +313,27 @@ ini->GetItem("General","ServerPort",cfg_ServerPort,53);
 ini->GetItem("TCP","SessionTimeout",cfg_SessionTimeout,5);
 ini->GetItem("TCP","SessionLimit",cfg_SessionLimit,32);
 ini->GetItem("TCP","ListenBacklog",cfg_ListenBacklog,8);
+ini->GetItem("TCP","AcceptBatch",cfg_AcceptBatch,64);
+if (cfg_AcceptBatch < 1) cfg_AcceptBatch = 1;
+ini->GetItem("TCP","FastOpen",cfg_FastOpen,256);
+ini->GetItem("TCP","DeferAccept",cfg_DeferAccept,1);
+ini->GetItem("TCP","SourceLimit",cfg_SourceLimit,0);
+ini->GetItem("TCP","EvictIdle",cfg_EvictIdle,1000);
+ini->GetItem("TCP","WriteLimit",cfg_WriteLimit,65536);
+if (cfg_WriteLimit < 1024) cfg_WriteLimit = 1024;
+
+ini->GetItem("TLS","Port",cfg_TlsPort,853);
+ini->GetItem("TLS","Certificate",cfg_TlsCertificate,"");
+ini->GetItem("TLS","PrivateKey",cfg_TlsPrivateKey,"");
+ini->GetItem("TLS","SessionCache",cfg_TlsCache,1024);
+if (cfg_TlsCache < 1) cfg_TlsCache = 1;
+ini->GetItem("TLS","SessionLifetime",cfg_TlsLifetime,7200);
+if (cfg_TlsLifetime < 1) cfg_TlsLifetime = 1;
+
+ini->GetItem("HTTPS","Port",cfg_DohPort,443);
+ini->GetItem("HTTPS","Path",cfg_DohPath,"/dns-query");
+ini->GetItem("HTTPS","Streams",cfg_DohStreams,100);
+if (cfg_DohStreams < 1) cfg_DohStreams = 1;
 
 ini->GetItem("QueryFilter","StartThreads",cfg_QueryThreads,2);
 ini->GetItem("QueryFilter","LimitThreads",cfg_QueryLimit,50);
@@ -258,11 +341,72 @@ ini->GetItem("QueryFilter","LimitThreads",cfg_QueryLimit,50);
 ini->GetItem("ReplyFilter","StartThreads",cfg_ReplyThreads,2);
 ini->GetItem("ReplyFilter","LimitThreads",cfg_ReplyLimit,50);
 
+ini->GetItem("Network","RecvBatch",cfg_RecvBatch,32);
+if (cfg_RecvBatch < 1) cfg_RecvBatch = 1;
+if (cfg_RecvBatch > BATCHLIMIT) cfg_RecvBatch = BATCHLIMIT;
+
+ini->GetItem("Network","ClientThreads",cfg_ClientThreads,1);
+if (cfg_ClientThreads < 1) cfg_ClientThreads = 1;
+if (cfg_ClientThreads > CLIENTMAX) cfg_ClientThreads = CLIENTMAX;
+ini->GetItem("Network","SteerCPU",cfg_SteerCPU,0);
+
+ini->GetItem("Network","BusyPoll",cfg_BusyPoll,0);
+if (cfg_BusyPoll < 0) cfg_BusyPoll = 0;
+ini->GetItem("Network","BusyBudget",cfg_BusyBudget,64);
+if (cfg_BusyBudget < 1) cfg_BusyBudget = 1;
+ini->GetItem("Network","BusyIdle",cfg_BusyIdle,200);
+if (cfg_BusyIdle < 1) cfg_BusyIdle = 1;
+
+ini->GetItem("Network","AdaptBuffers",cfg_AdaptBuffers,1);
+ini->GetItem("Network","BufferLimit",cfg_BufferLimit,8388608);
+if (cfg_BufferLimit < 65536) cfg_BufferLimit = 65536;
+
+ini->GetItem("Network","SendBatch",cfg_SendBatch,32);
+if (cfg_SendBatch < 1) cfg_SendBatch = 1;
+if (cfg_SendBatch > BATCHLIMIT) cfg_SendBatch = BATCHLIMIT;
+ini->GetItem("Network","SendDelay",cfg_SendDelay,2);
+if (cfg_SendDelay < 1) cfg_SendDelay = 1;
+
+ini->GetItem("Network","Engine",temp,"epoll");
+cfg_UringEngine = (strcasecmp(temp,"uring") == 0 ? 1 : 0);
+ini->GetItem("Network","UringBuffers",cfg_UringBuffers,1024);
+if (cfg_UringBuffers < 16) cfg_UringBuffers = 16;
+
+ini->GetItem("Network","Wildcard",cfg_Wildcard,0);
+ini->GetItem("Network","WatchAddresses",cfg_WatchAddresses,0);
+
+ini->GetItem("Network","EdgeTrigger",cfg_EdgeTrigger,0);
+ini->GetItem("Network","DrainLimit",cfg_DrainLimit,256);
+if (cfg_DrainLimit < 1) cfg_DrainLimit = 1;
+
+ini->GetItem("Network","XdpInterface",cfg_XdpInterface,"");
+ini->GetItem("Network","XdpQueue",cfg_XdpQueue,0);
+ini->GetItem("Network","XdpFrames",cfg_XdpFrames,4096);
+if (cfg_XdpFrames < 64) cfg_XdpFrames = 64;
+ini->GetItem("Network","XdpMode",temp,"generic");
+cfg_XdpNative = (strcasecmp(temp,"native") == 0 ? 1 : 0);
+
 ini->GetItem("Forward","ServerAddr",cfg_PushServerAddr,"8.8.8.8");
 ini->GetItem("Forward","ServerPort",cfg_PushServerPort,53);
 ini->GetItem("Forward","LocalAddr",cfg_PushLocalAddr,"0.0.0.0");
 ini->GetItem("Forward","LocalPort",cfg_PushLocalPort,5320);
 ini->GetItem("Forward","LocalCount",cfg_PushLocalCount,10);
+ini->GetItem("Forward","TcpPool",cfg_PushTcpPool,2);
+if (cfg_PushTcpPool < 1) cfg_PushTcpPool = 1;
+ini->GetItem("Forward","ProbeInterval",cfg_ProbeInterval,2000);
+if (cfg_ProbeInterval < 1) cfg_ProbeInterval = 1;
+ini->GetItem("Forward","RetryTimeout",cfg_RetryTimeout,500);
+if (cfg_RetryTimeout < QUERYTICK) cfg_RetryTimeout = QUERYTICK;
+ini->GetItem("Forward","RetryLimit",cfg_RetryLimit,2);
+if (cfg_RetryLimit < 0) cfg_RetryLimit = 0;
+ini->GetItem("Forward","HedgePercent",cfg_HedgePercent,0);
+if (cfg_HedgePercent < 0) cfg_HedgePercent = 0;
+if (cfg_HedgePercent > 99) cfg_HedgePercent = 99;
+ini->GetItem("Forward","Coalesce",cfg_Coalesce,1);
+ini->GetItem("Forward","EdnsPayload",cfg_EdnsPayload,1232);
+if ((cfg_EdnsPayload != 0) && (cfg_EdnsPayload < DNSUDPLIMIT)) cfg_EdnsPayload = DNSUDPLIMIT;
+if (cfg_EdnsPayload > 65535) cfg_EdnsPayload = 65535;
+ini->GetItem("Forward","TruncateRetry",cfg_TruncateRetry,1);
 
 ini->GetItem("Blocking","ServerAddr",cfg_BlockServerAddr,"0.0.0.0");
 
@@ -298,4 +442,102 @@ cfg_NetFilterCount = 0;
 delete(ini);
 }
 /*--------------------------------------------------------------------------*/
+void busypoll_socket(int sock)
+{
+int		val,ret;
+
+if (cfg_BusyPoll == 0) return;
+
+// ask the kernel to spin on the device queue when the socket is empty
+val = cfg_BusyPoll;
+ret = setsockopt(sock,SOL_SOCKET,SO_BUSY_POLL,(char *)&val,sizeof(val));
+if (ret != 0) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(SO_BUSY_POLL)\n",errno);
+
+#ifdef SO_PREFER_BUSY_POLL
+// keep the softirq from racing our polling under load
+val = 1;
+ret = setsockopt(sock,SOL_SOCKET,SO_PREFER_BUSY_POLL,(char *)&val,sizeof(val));
+if (ret != 0) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(SO_PREFER_BUSY_POLL)\n",errno);
+#endif
+
+#ifdef SO_BUSY_POLL_BUDGET
+val = cfg_BusyBudget;
+ret = setsockopt(sock,SOL_SOCKET,SO_BUSY_POLL_BUDGET,(char *)&val,sizeof(val));
+if (ret != 0) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(SO_BUSY_POLL_BUDGET)\n",errno);
+#endif
+}
+/*--------------------------------------------------------------------------*/
+void dropwatch_socket(int sock)
+{
+int		val,ret;
+
+// have the kernel tell us how many packets it dropped on the socket
+val = 1;
+ret = setsockopt(sock,SOL_SOCKET,SO_RXQ_OVFL,(char *)&val,sizeof(val));
+if (ret != 0) g_log->LogMessage(LOG_WARNING,"Error %d returned from setsockopt(SO_RXQ_OVFL)\n",errno);
+}
+/*--------------------------------------------------------------------------*/
+int check_dropcount(netportal *portal,struct msghdr *header,AtomicValue &counter)
+{
+struct cmsghdr		*cmsg;
+unsigned int		total,delta;
+
+// the kernel only includes the drop count once something was dropped
+total = portal->dropped;
+
+	for(cmsg = CMSG_FIRSTHDR(header);cmsg != NULL;cmsg = CMSG_NXTHDR(header,cmsg))
+	{
+	if (cmsg->cmsg_level != SOL_SOCKET) continue;
+	if (cmsg->cmsg_type != SO_RXQ_OVFL) continue;
+	memcpy(&total,CMSG_DATA(cmsg),sizeof(total));
+	}
+
+// the value is a running total for the socket so we count the change
+delta = (total - portal->dropped);
+if (delta == 0) return(0);
+
+portal->dropped = total;
+counter+=delta;
+
+if (cfg_AdaptBuffers != 0) grow_buffers(portal->sock);
+
+return(delta);
+}
+/*--------------------------------------------------------------------------*/
+int grow_buffers(int sock)
+{
+int		option[2] = { SO_RCVBUF,SO_SNDBUF };
+int		forced[2] = { SO_RCVBUFFORCE,SO_SNDBUFFORCE };
+int		grown,value,check,ret,x;
+socklen_t	len;
+
+grown = 0;
+
+	for(x = 0;x < 2;x++)
+	{
+	len = sizeof(value);
+	ret = getsockopt(sock,SOL_SOCKET,option[x],(char *)&value,&len);
+	if (ret != 0) continue;
+
+	// the kernel reports double the size requested to cover its own
+	// overhead so asking for the reported size doubles the buffer
+	if (value >= cfg_BufferLimit) continue;
+	if ((value * 2) > cfg_BufferLimit) value = (cfg_BufferLimit / 2);
+
+	// the forced version goes past the system maximum but only works
+	// with CAP_NET_ADMIN so we fall back to the normal option
+	ret = setsockopt(sock,SOL_SOCKET,forced[x],(char *)&value,sizeof(value));
+	if (ret != 0) setsockopt(sock,SOL_SOCKET,option[x],(char *)&value,sizeof(value));
+
+	// the normal option is silently capped so see if anything changed
+	len = sizeof(check);
+	ret = getsockopt(sock,SOL_SOCKET,option[x],(char *)&check,&len);
+	if ((ret == 0) && (check > value)) grown++;
+	}
+
+if (grown != 0) g_buffergrow++;
+
+return(grown);
+}
+/*--------------------------------------------------------------------------*/
 
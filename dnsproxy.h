@@ -14,9 +14,34 @@
 
 const int SOCKBUFFER = 0x10000;		// sets the size of the socet recv buffer
 const int DNSBUFFER = 0x4000;		// sets the size of the dns packet buffer
+const int CTRLBUFFER = 64;			// sets the size of socket control buffers
+const int TCPBUFFER = 512;			// initial size of client TCP read buffers
+const int DOHFRAME = 16384;			// largest HTTP/2 frame payload we accept
+const int DOHBUFFER = 16393;		// read buffer that holds the largest frame
+const int HPACKLIMIT = 128;			// most entries in the HPACK dynamic table
+const int DNSUDPLIMIT = 512;		// UDP payload size for clients without EDNS0
+const int DNSTYPEOPT = 41;			// resource record type of the EDNS0 option
+const int DNSTYPESIG = 24;			// resource record type for SIG(0) signatures
+const int DNSTYPETSIG = 250;		// resource record type for TSIG signatures
 const int STARTWAIT = 50000;		// microsecond wait time for thread startup
 const int SOCKLIMIT = 1024;			// sets maximum number of listen sockets
 const int POOLMAX = 1024;			// maximum number of threads in a pool
+const int BATCHLIMIT = 1024;		// maximum number of datagrams per batch
+const int CLIENTMAX = 64;			// maximum number of client network threads
+const int URINGCANCEL = 1;			// io_uring tag used for cancel requests
+const int WHEELBITS = 6;			// slot index bits for each timer wheel level
+const int WHEELSIZE = 64;			// number of slots in each timer wheel level
+const int WHEELLEVELS = 4;			// number of levels in the timer wheel
+const int WHEELTICK = 100;			// millisecond resolution of session timers
+const int UPSTREAMLIMIT = 16;		// maximum number of upstream servers
+const int UPSTREAMRTT = 100000;		// microsecond RTT assumed for a new upstream
+const int UPSTREAMWINDOW = 1000;	// milliseconds between upstream loss samples
+const int LOSSPENALTY = 1000;		// microseconds added to the RTT for each 1/1000 lost
+const int QUERYTICK = 10;			// millisecond resolution of upstream query timers
+const int RTTBUCKETS = 96;			// quarter octave RTT histogram buckets per upstream
+const int HEDGESAMPLES = 20;		// RTT samples needed before we trust the percentile
+const int HEDGEBUDGET = 10;			// percent of last window queries that can be hedged
+const int FLIGHTBUCKETS = 4096;		// hash buckets for finding identical queries in flight
 
 const int BLACKLIST = 'B';
 const int WHITELIST = 'W';
@@ -25,16 +50,115 @@ const int TRUE = 1;
 
 const int MSG_ADDQUERYTHREAD = 0x11111111;
 const int MSG_ADDREPLYTHREAD = 0x22222222;
+
+const int CLAIM_LATE = 0;
+const int CLAIM_TAKEN = 1;
+const int CLAIM_SERVER = 2;
+/*--------------------------------------------------------------------------*/
+struct timernode
+{
+	struct timernode		*next,*last;
+	struct timernode		**head;
+	long long				expires;
+	void					*owner;
+};
 /*--------------------------------------------------------------------------*/
 struct netportal
 {
 	struct sockaddr_in		addr;
+	unsigned int			ifaddr;
 	int						ifidx;
 	int						proto;
 	int						sock;
 	int						length;
+	int						ready;
+	int						session;
+	unsigned int			serial;
+	unsigned int			dropped;
+	char					*inbuffer;
+	int						insize;
+	int						incount;
+	char					*outbuffer;
+	int						outsize;
+	int						outcount;
+	unsigned int			events;
+	struct ssl_st			*tls;
+	class DohSession		*doh;
 	struct netportal		*next,*last;
-	time_t					created;
+	struct netportal		*chain;
+	struct timernode		timer;
+	long long				active;
+};
+/*--------------------------------------------------------------------------*/
+struct xdpring
+{
+	unsigned				*producer;
+	unsigned				*consumer;
+	void					*ring;
+	void					*memory;
+	size_t					size;
+	unsigned				mask;
+};
+/*--------------------------------------------------------------------------*/
+struct xdppacket
+{
+	struct sockaddr_in		source;
+	unsigned int			target;
+	unsigned char			linkaddr[12];
+	unsigned long long		frame;
+	char					*data;
+	int						size;
+};
+/*--------------------------------------------------------------------------*/
+struct steergroup
+{
+	unsigned int			addr;
+	int						mapsock;
+	int						progsock;
+};
+/*--------------------------------------------------------------------------*/
+struct dohstream
+{
+	unsigned int			id;
+	int						state;
+	int						method;
+	int						pathok;
+	int						pathcount;
+	int						typeok;
+	int						window;
+	char					*body;
+	int						bodysize;
+	int						bodylimit;
+	char					*pending;
+	int						pendsize;
+	int						pendsent;
+};
+/*--------------------------------------------------------------------------*/
+struct hpackentry
+{
+	char					*name;
+	int						namelen;
+	int						valuelen;
+};
+/*--------------------------------------------------------------------------*/
+struct upstream
+{
+	struct sockaddr_in		addr;
+	char					name[32];
+	long long				lastsent;
+	int						srtt;
+	int						rttvar;
+	int						loss;
+	unsigned int			sent;
+	unsigned int			answered;
+	unsigned int			pending;
+	unsigned int			late;
+	int						hedge;
+	unsigned int			hedgecredit;
+	unsigned int			histogram[RTTBUCKETS];
+	unsigned long long		queries;
+	unsigned long long		replies;
+	unsigned long long		probes;
 };
 /*--------------------------------------------------------------------------*/
 struct category_info
@@ -105,6 +229,13 @@ class DNSPacket;
 class HashTable;
 class HashObject;
 class NetworkEntry;
+class PacketBatch;
+class UringEngine;
+class XdpSocket;
+class TimerWheel;
+class CoreSteering;
+class TlsEngine;
+class DohSession;
 /*--------------------------------------------------------------------------*/
 class CountDevice
 {
@@ -182,6 +313,14 @@ public:
 	return(temp);
 	}
 
+	inline unsigned long long operator+=(const unsigned long long aValue)
+	{
+	control.Acquire();
+	unsigned long long temp = (value+=aValue);
+	control.Release();
+	return(temp);
+	}
+
 	inline unsigned long long operator--(int)
 	{
 	control.Acquire();
@@ -254,37 +393,105 @@ class ClientNetwork : public ThreadLogic
 {
 public:
 
-	ClientNetwork(void);
+	ClientNetwork(int argIndex);
 	~ClientNetwork(void);
 	int CheckStatus(void) { return(running); }
 
 	int ForwardTCPReply(ProxyEntry *argEntry);
 	int ForwardUDPReply(ProxyEntry *argEntry);
+	int FlushReplies(int argDelay = 0);
 
 private:
 
 	void* ThreadWorker(void);
 
 	void RemoveSession(struct netportal *argPortal);
+	netportal *AllocatePortal(void);
+	void ReleasePortal(netportal *argPortal);
+	int CountSource(unsigned int argAddr);
+	void InsertSource(netportal *argPortal);
+	void RemoveSource(netportal *argPortal);
+	int CheckEviction(void);
+	void EvictSession(void);
+	void ArmListeners(unsigned int argEvents);
+	int FlushSession(netportal *argPortal,struct iovec *argList,int argCount);
+	int SendSession(netportal *argPortal,struct iovec *argList,int argCount);
+	void AppendSession(netportal *argPortal,const char *argData,int argSize);
+	void UpdateSession(netportal *argPortal);
 	void EnumerateInterfaces(void);
+	void RefreshInterfaces(void);
+	int ScanInterfaces(unsigned int *argList,int argLimit);
+	void WatchInterfaces(void);
 	void SocketDestroy(void);
 
+	void ProcessEpollEvents(epoll_event *argList,int argCount);
+	int ProcessUringEvents(epoll_event *argList,int argCount,int argTimeout);
 	int ProcessTCPConnect(netportal *argPortal);
+	int AcceptSession(netportal *argPortal);
 	int ProcessTCPQuery(netportal *argPortal);
+	int ProcessFrames(netportal *argPortal,MessageFrame **argList,int *argCount);
+	int ProcessTCPWrite(netportal *argPortal);
 	int ProcessUDPQuery(netportal *argPortal);
+	int ProcessUDPBatch(netportal *argPortal);
+	int ProcessXDPQuery(int argLimit);
+	int DrainUDPSocket(netportal *argPortal);
+	void ProcessReadyList(void);
+	int ProcessNetlink(void);
+	int BusyTimeout(int argTimeout);
 	int SessionCleanup(int argForce = 0);
 	int SocketStartup(void);
+	int OpenListener(netportal *argPortal,int argIndex,int argPort);
+	void CloseListener(netportal *argPortal);
+	void ArmListener(netportal *argPortal,unsigned int argEvents);
+	int BindInterface(int argIndex);
+	void UnbindInterface(int argIndex);
+	void InsertInterface(unsigned int argAddr);
+	void RemoveInterface(unsigned int argAddr);
+
+	ProxyEntry *InsertUDPQuery(netportal *argPortal,const char *argBuffer,int argSize);
+	ProxyEntry *InsertTCPQuery(netportal *argPortal,const char *argBuffer,int argSize);
+	unsigned int ExtractTarget(struct msghdr *argHeader);
+	int CheckNetFilter(unsigned int argAddr);
 
 	unsigned int			IPv4list[SOCKLIMIT];
 	int						IPv4tot;
 
 	char					netbuffer[SOCKBUFFER];
+	char					netcontrol[CTRLBUFFER];
+
+	struct mmsghdr			*batchmsg;
+	struct iovec			*batchvec;
+	struct sockaddr_in		*batchaddr;
+	char					*batchbuffer;
+	char					*batchctrl;
 
 	char					netface[SOCKLIMIT][32];
 	netportal				tcplisten[SOCKLIMIT];
+	netportal				tlslisten[SOCKLIMIT];
+	netportal				dohlisten[SOCKLIMIT];
 	netportal				udplisten[SOCKLIMIT];
+	PacketBatch				*udpbatch[SOCKLIMIT];
+	UringEngine				*uring;
+	XdpSocket				*xdp;
+	netportal				xdpportal;
+	netportal				linkportal;
 	netportal				*tcpactive;
-
+	netportal				**tcptable;
+	netportal				*tcpslab;
+	netportal				*tcppool;
+	netportal				*tcpoldest;
+	netportal				**tcpsource;
+	unsigned int			tcpbuckets;
+	unsigned int			tcparmed;
+	TimerWheel				*tcpwheel;
+	SyncDevice				tcplock;
+	unsigned int			tcpserial;
+	netportal				*readylist[SOCKLIMIT + 1];
+	long long				lastbusy;
+	long long				spincount;
+
+	int						readycount;
+	int						udpcount;
 	int						tcpcount;
 	int						pollsock;
 	int						running;
@@ -300,24 +507,79 @@ public:
 
 	int ForwardTCPQuery(ProxyEntry *argEntry);
 	int ForwardUDPQuery(ProxyEntry *argEntry);
+	void CancelQuery(ProxyEntry *argEntry);
+	int ClaimQuery(ProxyEntry *argEntry);
+	int FlushQueries(int argDelay = 0);
+	void ReportUpstreams(void);
 
 private:
 
 	void* ThreadWorker(void);
 
+	int LoadUpstreams(void);
+	int SelectUpstream(int argExclude = -1);
+	int FindUpstream(struct sockaddr_in *argAddr);
+	void SampleUpstream(ProxyEntry *argEntry,int argUpstream);
+	void UpdateUpstreams(void);
+	void UpdateHedge(upstream *argServer);
+	int RttBucket(int argSample);
+	int BucketLimit(int argBucket);
+
+	int SendTCPQuery(ProxyEntry *argEntry,int argUpstream);
+	int SendUDPQuery(ProxyEntry *argEntry,int argUpstream);
+	int TransmitQuery(ProxyEntry *argEntry,int argUpstream);
+	void StartQuery(ProxyEntry *argEntry);
+	long long QueryDeadline(ProxyEntry *argEntry,long long argCurrent);
+	int HedgeQuery(ProxyEntry *argEntry);
+	int QueryCleanup(void);
+	void DestroyPool(void);
+	int OpenSession(struct netportal *argPortal,int argGrid,int argUpstream);
 	void RemoveSession(struct netportal *argPortal);
+	int SendSession(struct netportal *argPortal,struct iovec *argList,int argCount);
+	void AppendSession(struct netportal *argPortal,const char *argData,int argSize);
+	void ArmSession(struct netportal *argPortal,unsigned int argEvents);
 	void SocketDestroy(void);
 
+	void ProcessEpollEvents(epoll_event *argList,int argCount);
+	int ProcessUringEvents(epoll_event *argList,int argCount,int argTimeout);
 	int ProcessUDPReply(netportal *argPortal);
+	int ProcessUDPBatch(netportal *argPortal);
 	int ProcessTCPReply(netportal *argPortal);
+	int ProcessTCPWrite(netportal *argPortal);
+	int InsertTCPReply(netportal *argPortal,const char *argBuffer,int argSize);
+	ProxyMessage *InsertUDPReply(netportal *argPortal,const char *argBuffer,int argSize,struct sockaddr_in *argServer);
+	int DrainUDPSocket(netportal *argPortal);
+	void ProcessReadyList(void);
+	int BusyTimeout(int argTimeout);
 	int SessionCleanup(int argForce = 0);
 	int SocketStartup(void);
 
 	char					netbuffer[SOCKBUFFER];
+	char					netcontrol[CTRLBUFFER];
 
 	netportal				udpsocket[SOCKLIMIT];
-	netportal				*tcpactive;
-	int						tcpcount;
+	PacketBatch				*udpbatch[SOCKLIMIT];
+	SyncDevice				batchlock;
+	upstream				upstreamlist[UPSTREAMLIMIT];
+	struct mmsghdr			*batchmsg;
+	struct iovec			*batchvec;
+	struct sockaddr_in		*batchaddr;
+	char					*batchbuffer;
+	char					*batchctrl;
+	UringEngine				*uring;
+	netportal				*tcppool;
+	TimerWheel				*tcpwheel;
+	SyncDevice				tcplock;
+	TimerWheel				*querywheel;
+	SyncDevice				querylock;
+	netportal				wakeportal;
+	netportal				*readylist[SOCKLIMIT];
+	long long				lastbusy;
+	long long				lastsample;
+	long long				spincount;
+	int						upstreamcount;
+	int						readycount;
+	int						tcptotal;
 	int						pollsock;
 	int						running;
 };
@@ -332,10 +594,20 @@ public:
 	int InsertObject(ProxyEntry *argEntry);
 	int RemoveObject(unsigned short argGrid,unsigned short argSlot);
 	ProxyEntry *RetrieveObject(unsigned short argGrid,unsigned short argSlot);
+	int ClaimObject(unsigned short argGrid,unsigned short argSlot,const char *argBuffer,int argSize,int argServer);
+	int InsertFlight(ProxyEntry *argEntry);
+	ProxyEntry *RemoveFlight(ProxyEntry *argEntry);
 
 private:
 
+	void DetachFlight(ProxyEntry *argEntry);
+	unsigned int FlightKey(ProxyEntry *argEntry);
+	int FlightVariant(ProxyEntry *argEntry);
+
 	ProxyEntry				***worktable;
+	ProxyEntry				**flighttable;
+	SyncDevice				tablelock;
+	SyncDevice				flightlock;
 	unsigned short			tablesize;
 	unsigned short			slotindex;
 	unsigned short			gridindex;
@@ -351,8 +623,19 @@ public:
 	int InsertQuery(const char *argBuffer,int argSize,netportal *argPortal);
 	int InsertReply(const char *argBuffer,int argSize);
 	int InsertReply(DNSPacket *argPacket);
+	int CopyReply(ProxyEntry *argEntry);
+	int InsertFailure(void);
+	int MatchReply(const char *argBuffer,int argSize);
+	int TrimReply(void);
+	void RemoveOption(void);
 
 	struct sockaddr_in		origin;
+	unsigned int			netlocal;
+	unsigned char			linkaddr[12];
+	ClientNetwork			*netowner;
+	int						netindex;
+	int						netsession;
+	unsigned int			netserial;
 	unsigned short			mygrid;
 	unsigned short			myslot;
 
@@ -367,6 +650,36 @@ public:
 
 	header					q_header;
 	qrec					q_record;
+
+	int						ednsclient;
+	int						ednsadded;
+	int						ednspayload;
+	unsigned int			ednsflags;
+	int						ednsoptions;
+	int						querysigned;
+	int						netretry;
+	unsigned int			netstream;
+	int						netupstream;
+	int						netattempt;
+	int						nethedge;
+	unsigned int			netmask;
+	long long				netsent;
+	long long				nethedged;
+	long long				netdeadline;
+	struct timernode		nettimer;
+	ProxyEntry				*netleader;
+	ProxyEntry				*netfollower;
+	ProxyEntry				*netchain;
+	unsigned int			netkey;
+	int						netvariant;
+	int						netflight;
+
+private:
+
+	int ExtractOption(const unsigned char *argData,int argSize,int argOffset);
+	void InsertOption(void);
+	int SkipName(const unsigned char *argData,int argSize,int argOffset);
+	int SkipRecord(const unsigned char *argData,int argSize,int argOffset,int *argType);
 };
 /*--------------------------------------------------------------------------*/
 class ProxyMessage : public MessageFrame
@@ -390,6 +703,7 @@ public:
 	virtual ~MessageQueue(void);
 
 	void PushMessage(MessageFrame *argObject);
+	void PushBatch(MessageFrame **argList,int argCount);
 	MessageFrame *GrabMessage(void);
 
 	sem_t					MessageSignal;
@@ -417,6 +731,7 @@ public:
 
 	virtual void ThreadCallback(MessageFrame *argMessage) = 0;
 	virtual void ThreadSaturation(int argTotal) { }
+	virtual void ThreadDrained(void) { }
 
 	char					*PoolName;
 	int						ThreadLimit;
@@ -459,6 +774,7 @@ private:
 
 	void ThreadCallback(MessageFrame *argMessage);
 	void ThreadSaturation(int argTotal);
+	void ThreadDrained(void);
 	void TransmitBlockTarget(ProxyEntry *argEntry);
 
 	Database				*database;
@@ -475,6 +791,7 @@ private:
 
 	void ThreadCallback(MessageFrame *argMessage);
 	void ThreadSaturation(int argTotal);
+	void ThreadDrained(void);
 };
 /*--------------------------------------------------------------------------*/
 class LoggerInfo : public MessageFrame
@@ -670,9 +987,282 @@ private:
 
 	int GetObjectSize(void);
 };
+class PacketBatch
+{
+public:
+
+	PacketBatch(int argSock,int argLimit,AtomicValue *argCalls = NULL,AtomicValue *argPackets = NULL);
+	~PacketBatch(void);
+
+	int InsertPacket(const char *argBuffer,int argSize,const sockaddr_in *argTarget,unsigned int argSource = 0);
+	int FlushBatch(int argDelay = 0);
+	int PendingCount(void) { return(count); }
+
+private:
+
+	int TransmitBatch(void);
+	void SetSource(struct msghdr *argHeader,char *argControl,unsigned int argSource);
+	long long NowMilliseconds(void);
+
+	SyncDevice				control;
+	AtomicValue				*sendcalls;
+	AtomicValue				*sendpackets;
+	struct mmsghdr			*batchmsg;
+	struct iovec			*batchvec;
+	struct sockaddr_in		*batchaddr;
+	char					*batchbuffer;
+	char					*batchctrl;
+	long long				oldest;
+	int						limit;
+	int						count;
+	int						sock;
+};
+/*--------------------------------------------------------------------------*/
+class UringEngine
+{
+public:
+
+	UringEngine(void);
+	~UringEngine(void);
+
+	int Startup(int argEntries,int argBuffers,int argSize);
+	void ArmRecvMessage(int argSock,unsigned long long argData);
+	void ArmPoll(int argSock,unsigned long long argData);
+	void CancelRequest(unsigned long long argData);
+	int WaitEvents(int argTimeout);
+	int GrabEvent(unsigned long long &argData,int &argResult,unsigned &argFlags);
+	int ExtractMessage(int argResult,unsigned argFlags,struct sockaddr_in *argAddr,char **argData,struct msghdr *argControl = NULL);
+	void EnableControl(int argSize);
+	void RecycleBuffer(unsigned argFlags);
+	int CheckMultishot(unsigned argFlags);
+
+private:
+
+	struct io_uring_sqe *GrabEntry(void);
+	void QueueEntry(void);
+	void ReleaseBuffer(int argIndex);
+
+	struct io_uring_sqe		*sqelist;
+	struct io_uring_cqe		*cqelist;
+	struct io_uring_buf		*bufring;
+	struct msghdr			msgtemplate;
+	void					*sqmemory;
+	void					*cqmemory;
+	size_t					sqsize;
+	size_t					cqsize;
+	unsigned				*sqhead;
+	unsigned				*sqtail;
+	unsigned				*sqarray;
+	unsigned				sqmask;
+	unsigned				sqentries;
+	unsigned				*cqhead;
+	unsigned				*cqtail;
+	unsigned				cqmask;
+	char					*bufmemory;
+	unsigned short			buftail;
+	int						bufcount;
+	int						bufsize;
+	int						ringsock;
+	int						pending;
+};
+/*--------------------------------------------------------------------------*/
+class XdpSocket
+{
+public:
+
+	XdpSocket(void);
+	~XdpSocket(void);
+
+	int Startup(const char *argFace,int argQueue,int argFrames,int argNative,int argBatch);
+	int InsertAddress(unsigned int argAddr);
+	int RemoveAddress(unsigned int argAddr);
+	int GrabPacket(struct xdppacket *argPacket);
+	void ReleasePacket(struct xdppacket *argPacket);
+	int TransmitPacket(const char *argBuffer,int argSize,const sockaddr_in *argTarget,unsigned int argSource,const unsigned char *argLink);
+	int FlushTransmit(void);
+	int PendingCount(void) { return(txpending); }
+	int GetSocket(void) { return(xsksock); }
+
+private:
+
+	int MapRing(struct xdpring *argRing,unsigned long long argOffset,struct xdp_ring_offset *argInfo,int argEntries,int argSize);
+	int LoadProgram(void);
+	void AddInstruction(int argCode,int argDst,int argSrc,int argOff,int argImm);
+	void TransmitQueue(void);
+	void ReapCompletions(void);
+	unsigned short Checksum(const unsigned char *argData,int argSize);
+
+	SyncDevice				control;
+	struct xdpring			rxring;
+	struct xdpring			txring;
+	struct xdpring			fillring;
+	struct xdpring			compring;
+	struct bpf_insn			*program;
+	unsigned long long		*txfree;
+	char					*umem;
+	size_t					umemsize;
+	int						proglen;
+	int						txcount;
+	int						txpending;
+	int						txlimit;
+	int						framecount;
+	int						xsksock;
+	int						progsock;
+	int						linksock;
+	int						xskmap;
+	int						addrmap;
+};
+/*--------------------------------------------------------------------------*/
+class TimerWheel
+{
+public:
+
+	TimerWheel(int argTick);
+	~TimerWheel(void);
+
+	void InsertTimer(timernode *argNode,long long argExpires);
+	void RemoveTimer(timernode *argNode);
+	timernode *ExpireTimers(long long argCurrent);
+	int TimerCount(void) { return(count); }
+
+	static long long NowMilliseconds(void);
+	static long long NowMicroseconds(void);
+
+private:
+
+	void LinkTimer(timernode *argNode);
+	void CascadeTimers(int argLevel);
+
+	timernode				*wheel[WHEELLEVELS][WHEELSIZE];
+	long long				current;
+	int						tick;
+	int						count;
+};
+/*--------------------------------------------------------------------------*/
+class CoreSteering
+{
+public:
+
+	CoreSteering(int argThreads);
+	~CoreSteering(void);
+
+	int Startup(void);
+	int AttachSocket(unsigned int argAddr,int argIndex,int argSock);
+	void ReportCounters(void);
+
+private:
+
+	int LoadProgram(int argMap);
+	void AddInstruction(int argCode,int argDst,int argSrc,int argOff,int argImm);
+
+	SyncDevice				control;
+	struct steergroup		*grouplist;
+	struct bpf_insn			*program;
+	int						groupcount;
+	int						proglen;
+	int						cpucount;
+	int						statmap;
+	int						threads;
+};
+/*--------------------------------------------------------------------------*/
+class TlsEngine
+{
+public:
+
+	TlsEngine(void);
+	~TlsEngine(void);
+
+	int Startup(void);
+	struct ssl_st *CreateSession(int argSock,int argHttp);
+	void DestroySession(struct ssl_st *argSession);
+	int AcceptSession(struct ssl_st *argSession);
+	int ReadSession(struct ssl_st *argSession,char *argBuffer,int argSize);
+	int WriteSession(struct ssl_st *argSession,const char *argBuffer,int argSize);
+	int PendingData(struct ssl_st *argSession);
+
+private:
+
+	int FinishHandshake(struct ssl_st *argSession);
+	int CheckResult(struct ssl_st *argSession,int argResult);
+	static int SelectProtocol(struct ssl_st *argSession,const unsigned char **argOut,unsigned char *argOutLen,const unsigned char *argIn,unsigned int argInLen,void *argData);
+
+	struct ssl_ctx_st		*context;
+};
+/*--------------------------------------------------------------------------*/
+class DohSession
+{
+public:
+
+	DohSession(int argStreams);
+	~DohSession(void);
+
+	int ProcessInput(char *argBuffer,int argSize);
+	int InsertReply(unsigned int argStream,const char *argReply,int argSize);
+	void InsertStatus(unsigned int argStream,int argStatus);
+
+	char					*output;
+	int						outcount;
+
+	char					*query;
+	int						querysize;
+	unsigned int			querystream;
+
+private:
+
+	int ProcessFrame(int argType,int argFlags,unsigned int argStream,char *argData,int argSize);
+	int ProcessHeaders(int argFlags,unsigned int argStream,char *argData,int argSize);
+	int ProcessData(int argFlags,unsigned int argStream,char *argData,int argSize);
+	int CollectBlock(char *argBuffer,int argSize);
+	void AppendBlock(const char *argData,int argSize);
+	int CompleteRequest(dohstream *argStream);
+	int DecodeBlock(dohstream *argStream,const unsigned char *argData,int argSize);
+	void InsertHeader(dohstream *argStream,const char *argName,int argNameLen,const char *argValue,int argValueLen);
+	int DecodeInteger(const unsigned char *argData,int argSize,int *argOffset,int argPrefix,unsigned int *argValue);
+	int DecodeString(const unsigned char *argData,int argSize,int *argOffset,const char **argText,int *argLength);
+	int DecodeHuffman(const unsigned char *argData,int argSize,char *argTarget,int argLimit);
+	int DecodeBase64(const char *argText,int argLength,unsigned char *argTarget,int argLimit);
+	int LookupTable(unsigned int argIndex,const char **argName,int *argNameLen,const char **argValue,int *argValueLen);
+	void InsertTable(const char *argName,int argNameLen,const char *argValue,int argValueLen);
+	void EvictTable(int argRoom);
+	dohstream *FindStream(unsigned int argStream);
+	dohstream *CreateStream(unsigned int argStream);
+	void CloseStream(dohstream *argStream);
+	int SendData(dohstream *argStream,const char *argData,int argSize);
+	void SendPending(dohstream *argStream);
+	void SendSettings(void);
+	void SendWindow(unsigned int argStream,int argSize);
+	void SendReset(unsigned int argStream,int argError);
+	int GoAway(int argError);
+	int EncodeLiteral(unsigned char *argTarget,int argIndex,const char *argValue,int argLength);
+	void AppendFrame(int argType,int argFlags,unsigned int argStream,const char *argData,int argSize);
+
+	dohstream				*streamlist;
+	hpackentry				tablelist[HPACKLIMIT];
+	char					*scratch;
+	char					*block;
+	unsigned int			laststream;
+	int						streamcount;
+	int						tablehead;
+	int						tablecount;
+	int						tablesize;
+	int						tablelimit;
+	int						scratchsize;
+	int						scratchused;
+	int						blocksize;
+	int						outsize;
+	int						sendwindow;
+	int						peerwindow;
+	int						peerframe;
+	int						recvcount;
+	int						preface;
+};
 /*--------------------------------------------------------------------------*/
 void process_message(const MessageFrame *message);
 void load_configuration(void);
+void busypoll_socket(int sock);
+void dropwatch_socket(int sock);
+int check_dropcount(netportal *portal,struct msghdr *header,AtomicValue &counter);
+int grow_buffers(int sock);
 void sighandler(int sigval);
 char *strclean(char *s);
 char *newstr(const char *s);
@@ -687,8 +1277,10 @@ DATALOC pthread_key_t		g_threadkey;
 DATALOC category_info		*g_catinfo;
 DATALOC FilterManager		*g_manager;
 DATALOC MessageQueue		*g_master;
-DATALOC ClientNetwork		*g_client;
+DATALOC ClientNetwork		*g_client[CLIENTMAX];
 DATALOC ServerNetwork		*g_server;
+DATALOC CoreSteering		*g_steer;
+DATALOC TlsEngine			*g_tls;
 DATALOC QueryFilter			*g_qfilter;
 DATALOC ReplyFilter			*g_rfilter;
 DATALOC ProxyTable			*g_table;
@@ -705,6 +1297,55 @@ DATALOC AtomicValue			g_servercount;
 DATALOC AtomicValue			g_querycount;
 DATALOC AtomicValue			g_replycount;
 DATALOC AtomicValue			g_dirtycount;
+DATALOC AtomicValue			g_recvcalls;
+DATALOC AtomicValue			g_recvpackets;
+DATALOC AtomicValue			g_sendcalls;
+DATALOC AtomicValue			g_sendpackets;
+DATALOC AtomicValue			g_serverrecvcalls;
+DATALOC AtomicValue			g_serverrecvpackets;
+DATALOC AtomicValue			g_serversendcalls;
+DATALOC AtomicValue			g_serversendpackets;
+DATALOC AtomicValue			g_uringcalls;
+DATALOC AtomicValue			g_uringevents;
+DATALOC AtomicValue			g_draincapped;
+DATALOC AtomicValue			g_xdprecv;
+DATALOC AtomicValue			g_xdpsend;
+DATALOC AtomicValue			g_xdpdrop;
+DATALOC AtomicValue			g_listenadd;
+DATALOC AtomicValue			g_listenremove;
+DATALOC AtomicValue			g_stalereplies;
+DATALOC AtomicValue			g_acceptcalls;
+DATALOC AtomicValue			g_tcpaccepted;
+DATALOC AtomicValue			g_tcprefused;
+DATALOC AtomicValue			g_tcpevicted;
+DATALOC AtomicValue			g_tcpsaturated;
+DATALOC AtomicValue			g_tcpqueued;
+DATALOC AtomicValue			g_tcppaused;
+DATALOC AtomicValue			g_tcpdropped;
+DATALOC AtomicValue			g_busyspins;
+DATALOC AtomicValue			g_busysleeps;
+DATALOC AtomicValue			g_clientdrops;
+DATALOC AtomicValue			g_serverdrops;
+DATALOC AtomicValue			g_buffergrow;
+DATALOC AtomicValue			g_ednstruncate;
+DATALOC AtomicValue			g_tcpretry;
+DATALOC AtomicValue			g_ednsfallback;
+DATALOC AtomicValue			g_upstreamconnects;
+DATALOC AtomicValue			g_upstreamreused;
+DATALOC AtomicValue			g_upstreamretry;
+DATALOC AtomicValue			g_upstreamfailed;
+DATALOC AtomicValue			g_hedgesent;
+DATALOC AtomicValue			g_hedgewins;
+DATALOC AtomicValue			g_latereplies;
+DATALOC AtomicValue			g_coalesced;
+DATALOC AtomicValue			g_tlsaccepted;
+DATALOC AtomicValue			g_tlsresumed;
+DATALOC AtomicValue			g_tlsfailed;
+DATALOC AtomicValue			g_tlskernelsend;
+DATALOC AtomicValue			g_tlskernelrecv;
+DATALOC AtomicValue			g_dohsessions;
+DATALOC AtomicValue			g_dohqueries;
+DATALOC AtomicValue			g_dohrejected;
 /*--------------------------------------------------------------------------*/
 DATALOC unsigned int		cfg_NetFilterAddr[256];
 DATALOC unsigned int		cfg_NetFilterMask[256];
@@ -714,17 +1355,59 @@ DATALOC int					cfg_LogServerBinary;
 DATALOC int					cfg_LogDatabase;
 DATALOC int					cfg_NetFilterCount;
 DATALOC int					cfg_ListenBacklog;
+DATALOC int					cfg_AcceptBatch;
+DATALOC int					cfg_FastOpen;
+DATALOC int					cfg_DeferAccept;
+DATALOC int					cfg_SourceLimit;
+DATALOC int					cfg_EvictIdle;
 DATALOC int					cfg_SessionTimeout;
 DATALOC int					cfg_SessionLimit;
+DATALOC int					cfg_WriteLimit;
 DATALOC int					cfg_ServerPort;
+DATALOC int					cfg_TlsPort;
+DATALOC char				cfg_TlsCertificate[256];
+DATALOC char				cfg_TlsPrivateKey[256];
+DATALOC int					cfg_TlsCache;
+DATALOC int					cfg_TlsLifetime;
+DATALOC int					cfg_DohPort;
+DATALOC char				cfg_DohPath[256];
+DATALOC int					cfg_DohStreams;
 DATALOC char				cfg_BlockServerAddr[32];
-DATALOC char				cfg_PushServerAddr[32];
+DATALOC char				cfg_PushServerAddr[256];
 DATALOC char				cfg_PushLocalAddr[32];
 DATALOC int					cfg_PushServerPort;
 DATALOC int					cfg_PushLocalPort;
 DATALOC int					cfg_PushLocalCount;
+DATALOC int					cfg_PushTcpPool;
+DATALOC int					cfg_ProbeInterval;
+DATALOC int					cfg_RetryTimeout;
+DATALOC int					cfg_RetryLimit;
+DATALOC int					cfg_HedgePercent;
+DATALOC int					cfg_Coalesce;
+DATALOC int					cfg_EdnsPayload;
+DATALOC int					cfg_TruncateRetry;
 DATALOC int					cfg_QueryThreads,cfg_QueryLimit;
 DATALOC int					cfg_ReplyThreads,cfg_ReplyLimit;
+DATALOC int					cfg_RecvBatch;
+DATALOC int					cfg_ClientThreads;
+DATALOC int					cfg_SteerCPU;
+DATALOC int					cfg_BusyPoll;
+DATALOC int					cfg_BusyBudget;
+DATALOC int					cfg_BusyIdle;
+DATALOC int					cfg_AdaptBuffers;
+DATALOC int					cfg_BufferLimit;
+DATALOC int					cfg_SendBatch;
+DATALOC int					cfg_SendDelay;
+DATALOC int					cfg_UringEngine;
+DATALOC int					cfg_UringBuffers;
+DATALOC int					cfg_EdgeTrigger;
+DATALOC int					cfg_Wildcard;
+DATALOC int					cfg_WatchAddresses;
+DATALOC int					cfg_DrainLimit;
+DATALOC char				cfg_XdpInterface[32];
+DATALOC int					cfg_XdpQueue;
+DATALOC int					cfg_XdpFrames;
+DATALOC int					cfg_XdpNative;
 
 DATALOC char				cfg_SQLhostname[256];
 DATALOC char				cfg_SQLusername[256];